@@ -19,11 +19,21 @@
 #ifndef BAG_H_
 #define BAG_H_
 
-#include <string.h>
-#include <stdlib.h>
+#include <stdint.h>
 
-#include "blocks.h"
-#include "debug.h"
+#define BAG_LEN 7
+
+/* The bag and the generator that fills it. It's part of the game state, so
+ * a resumed game deals exactly the pieces the saved one would have.
+ */
+struct bag {
+	uint32_t rng;			/* xorshift32 state, never 0 */
+	uint8_t pieces[BAG_LEN];
+	uint8_t index;			/* next piece to hand out */
+};
+
+/* Empty bag, generator seeded with @seed */
+void bag_init(struct bag *, uint32_t seed);
 
 /* This is the "Random Generator" algorithm.
  * Create a 'bag' of all seven pieces, then one by one remove an element from
@@ -31,8 +41,8 @@
  *
  * This helps to reduce the length of sequential pieces.
  */
-void bag_random_generator(void);
-int bag_next_piece(void);
-int bag_is_empty(void);
+void bag_random_generator(struct bag *);
+int bag_next_piece(struct bag *);
+int bag_is_empty(const struct bag *);
 
 #endif /* BAG_H_ */
@@ -21,8 +21,15 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <sys/queue.h>
+
+#include "bag.h"
+#include "clock.h"
+#include "das.h"
+#include "pool.h"
+#include "stats.h"
+#include "tick.h"
 
 #define PI 3.141592653589L
 
@@ -32,20 +39,33 @@
 #define NUM_BLOCKS		7
 #define NEXT_BLOCKS_LEN		5
 
+/* Lock delay: how long a block may rest on the stack before it locks, and
+ * how many times moving or rotating it may restart the timer.
+ */
+#define LOCK_DELAY		500000000U
+#define LOCK_RESETS		15
+
 #define LEN(x) ((sizeof(x))/(sizeof(*x)))
 
 /* Define index yourself. We increment here at each definition */
 #define PIECE_XY(X, Y) \
 	block->p[index].x = (X); block->p[index].y = (Y); index++;
 
-/* First, Second, and Third elements in the linked list */
-#define HOLD_BLOCK() (pgame->blocks_head.lh_first)
-#define CURRENT_BLOCK() (HOLD_BLOCK()->entries.le_next)
-#define FIRST_NEXT_BLOCK() (CURRENT_BLOCK()->entries.le_next)
+/* The held and the falling block. The ones after are only types, see
+ * pgame->next.
+ */
+#define HOLD_BLOCK() (&pgame->hold)
+#define CURRENT_BLOCK() (&pgame->cur)
 
 /* Does a block exist at the specified (y, x) coordinate? */
 #define blocks_at_yx(y, x) (pgame->spaces[(y)] & (1 << (x)))
 
+/* Colors are packed like spaces, 3 bits (a block type) per column */
+#define COLOR_BITS		3
+#define COLOR_MASK		((1U << COLOR_BITS) - 1)
+#define blocks_color_at(y, x) \
+	((pgame->colors[(y)] >> ((x) * COLOR_BITS)) & COLOR_MASK)
+
 
 enum blocks_block_types {
 	O_BLOCK,
@@ -57,6 +77,22 @@ enum blocks_block_types {
 	S_BLOCK,
 };
 
+/* How pieces turn, and where they may be kicked to if they don't fit.
+ * SRS is the guideline's, with floor and I piece kicks. Classic only
+ * tries a column left, then right.
+ */
+enum blocks_rotation {
+	ROTATION_SRS,
+	ROTATION_CLASSIC,
+};
+
+/* What turning a T block into place was worth, see destroy_lines() */
+enum blocks_t_spin {
+	T_SPIN_NONE,
+	T_SPIN_MINI,
+	T_SPIN,
+};
+
 enum blocks_input_cmd {
 	MOVE_LEFT,
 	MOVE_RIGHT,
@@ -67,27 +103,32 @@ enum blocks_input_cmd {
 	HOLD,
 };
 
-/* Only the currently falling block, the next block, and the save block are
- * stored in this structure. Once a block hits another piece, we forget about
- * it; it becomes part of the game board.
+/* Only the currently falling block and the hold block are stored in this
+ * structure. Once a block hits another piece, we forget about it; it becomes
+ * part of the game board.
  */
 struct blocks {
 	uint32_t lock_delay;		/* how long to wait (nsec) */
+	uint8_t lock_resets;		/* lock delay restarts used */
 	uint8_t soft_drop, hard_drop;	/* number of blocks dropped */
 	uint8_t col_off, row_off;	/* column/row offsets */
 
-	bool t_spin;			/* T-Spin . not implemented*/
+	uint8_t t_spin;			/* enum blocks_t_spin, once locked */
+	uint8_t kick;			/* last move a turn: its kick + 1 */
 	bool hold;			/* can only hold once */
 
-	enum blocks_block_types type;
+	uint8_t type;			/* enum blocks_block_types */
+	uint8_t rot;			/* 0 as dealt, then 1-3 clockwise */
 
 	struct pieces {			/* pieces stores two values(x, y) */
 		int8_t x, y;		/* between -1 and +2 */
 	} p[4];				/* each block has 4 pieces */
-
-	LIST_ENTRY(blocks) entries;	/* LL entries */
 };
 
+/* A game, and nothing but. No pointers and no locks, so it's a few cache
+ * lines anyone can copy, compare or keep a million of: blocks_init() takes
+ * one from the host's pool. Whatever drives it is in struct blocks_host.
+ */
 struct blocks_game {
 	/* These variables are read/written to the database
 	 * when restoring/saving the game state
@@ -95,29 +136,158 @@ struct blocks_game {
 	uint16_t level, lines_destroyed;
 	uint16_t spaces[BLOCKS_MAX_ROWS];	/* bit-field, one per row */
 	uint32_t score;
+	uint32_t colors[BLOCKS_MAX_ROWS];	/* packed, see COLOR_BITS */
+	uint32_t difficult;			/* difficult clears in a row */
+	struct bag bag;
 
-	uint8_t *colors[BLOCKS_MAX_ROWS];	/* 1-to-1 with board */
-	uint16_t pause_ticks;			/* total pause ticks per game */
+	/* The rest of the game's state */
+	uint32_t lines;				/* cleared this game */
 	uint32_t nsec;				/* tick delay in nanoseconds */
+	uint16_t pause_ticks;			/* total pause ticks per game */
 	bool pause;				/* game pause */
 	bool lose, quit;			/* how we quit */
+	uint8_t next[NEXT_BLOCKS_LEN];		/* coming up, types */
+	uint8_t rotation;			/* enum blocks_rotation */
+	struct blocks hold, cur;
+	uint64_t lock_at;			/* block locks at (0 = airborne) */
+	struct tick tick;			/* gravity */
+	struct das das;				/* held left/right keys */
+};
+
+/* The game this thread is playing. Each thread that touches a game sets its
+ * own, so one process can run many.
+ */
+extern __thread struct blocks_game *pgame;
+
+/* What drives games: their clock, where they're drawn, the lock for a game
+ * shared with an input thread, and stats. A thread sets its own alongside
+ * pgame. One host can drive any number of games, a server worker has one
+ * for all of its sessions.
+ */
+struct blocks_host {
+	struct pool games;			/* for blocks_init() */
 	pthread_mutex_t lock;
 
-	LIST_HEAD(blocks_head, blocks) blocks_head;	/* point to LL head */
+	struct blocks_clock *clock;		/* all game timing */
+	struct clock_real real_clock;		/* default for ->clock */
+	void (*draw)(void);			/* redraw, NULL when headless */
+	bool many_games;			/* no level and score gauges */
+
+	/* Contention on ->lock, and how long a key takes to show up. Only
+	 * touched with ->lock held.
+	 */
+	struct lock_stats loop_lock, input_lock;
+	struct hist input_latency;		/* key read to drawn (nsec) */
+	struct tick_stats ticks;
+	bool show_stats;			/* overlay them, F2 */
+
+	struct blocks_game *game;		/* blocks_input() plays it */
 };
 
-extern struct blocks_game *pgame;
+extern __thread struct blocks_host *phost;
 
-/* Create game state */
+#define BLOCKS_SAVE_MAGIC	0x534b4c42	/* "BLKS" */
+#define BLOCKS_SAVE_VERSION	1
+
+/* A saved game. The layout is fixed: every field has an exact size and they
+ * are ordered so the compiler adds no padding, so the struct itself is the
+ * file format (in host byte order). Change anything, bump the version.
+ */
+struct blocks_save {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t level;
+	uint32_t score;
+	uint32_t difficult;
+	uint32_t colors[BLOCKS_MAX_ROWS];
+	struct bag bag;
+	uint16_t lines;
+	uint16_t spaces[BLOCKS_MAX_ROWS];
+	uint8_t blocks[NEXT_BLOCKS_LEN + 2];	/* hold, current, next types */
+	uint8_t hold;				/* bit i: blocks[i] was held */
+	uint16_t unused;
+	uint32_t checksum;			/* FNV-1a of everything above */
+};
+
+/* Everything a game does next depends on, which is all of struct
+ * blocks_game. Taking one is a memcpy(), so rollback can take one every
+ * frame.
+ */
+struct blocks_snapshot {
+	struct blocks_game game;
+};
+
+/* Set up @host: the real clock, drawn on the screen. Then set phost. */
+void blocks_host_init(struct blocks_host *host);
+
+/* Once all its games are cleaned up */
+void blocks_host_destroy(struct blocks_host *host);
+
+/* Create game state, on phost */
 int blocks_init(void);
 
-/* Free memory */
+/* Deal a new game's blocks from @seed instead, so games can get the same */
+void blocks_seed(uint32_t seed);
+
+/* Turn pieces the @rotation way, SRS unless told otherwise */
+void blocks_rotation(enum blocks_rotation rotation);
+
+/* Free memory, back to phost */
 int blocks_cleanup(void);
 
+/* A fresh block of @type, as it would come in at the top. For drawing the
+ * ones in pgame->next.
+ */
+void blocks_piece(struct blocks *block, int type);
+
 /* Main loop, doesn't return until game is over */
 void *blocks_loop(void *);
 
-/* Input loop */
+/* The main loop in pieces, for anyone running games off their own event
+ * loop. Call blocks_start() once, then blocks_step() with the time on the
+ * game's clock whenever blocks_deadline() comes around or blocks_keys()
+ * moved it. Check ->lose afterwards.
+ */
+void blocks_start(void);
+void blocks_step(uint64_t now);
+uint64_t blocks_deadline(void);
+
+/* Input loop, for the host @vp's ->game */
 void *blocks_input(void *);
 
+/* Copy the game into @save, ready to be written out as is */
+void blocks_save(struct blocks_save *save);
+
+/* Returns 1 if @save is intact and from this version, -1 if not */
+int blocks_save_check(const struct blocks_save *save);
+
+/* Carry on from @save. The current block starts over at the top. Returns -1,
+ * and leaves the game alone, if @save is damaged or from another version.
+ */
+int blocks_restore(const struct blocks_save *save);
+
+/* Copy the game into @snap, or put it back exactly as it was. Unlike
+ * blocks_save(), the falling block, timers and all come along. Only for
+ * games the caller steps itself, see blocks_step().
+ */
+void blocks_snapshot(struct blocks_snapshot *snap);
+void blocks_rewind(const struct blocks_snapshot *snap);
+
+/* Same on both peers if their games are, for finding desyncs */
+uint32_t blocks_snapshot_checksum(const struct blocks_snapshot *snap);
+
+/* Versus: push @rows of garbage up from the bottom of the board, each full
+ * but for column @hole. The falling block is pushed up with the stack if it
+ * has to be; if that takes it off the board, or the stack goes over the top,
+ * the game is lost.
+ */
+void blocks_garbage(unsigned rows, unsigned hole);
+
+/* Apply keys (ncurses getch() values, see input.h) as if they were typed at
+ * the game clock's current time. Used by blocks_input, and by anything
+ * driving a game without a terminal. @events is true if key releases will
+ * be reported too.
+ */
+void blocks_keys(const int *keys, size_t n, bool events);
+
 #endif				/* BLOCKS_H_ */
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BROADCAST_H_
+#define BROADCAST_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "wire.h"
+
+/*
+ * One game to many spectators. The game's thread encodes each change once,
+ * as a delta and as a keyframe (WIRE_RESET, then the whole game), into
+ * reference counted frames. Spectators' send queues point at those same
+ * frames, and send them with one sendmsg() each, never a copy.
+ *
+ * A spectator that falls behind has its queue dropped for the latest
+ * keyframe, and carries on with deltas from there.
+ */
+
+/* A frame as the wire has it, shared by every queue sending it */
+struct bcast_frame {
+	unsigned refs;
+	uint16_t len;
+	uint8_t data[];
+};
+
+void bcast_frame_ref(struct bcast_frame *);
+void bcast_frame_unref(struct bcast_frame *);
+
+/* Frames a channel keeps, for subscribers that were busy */
+#define BCAST_BACKLOG	64
+
+struct bcast_channel {
+	unsigned refs;
+	struct wire_state state;	/* as of the last frame */
+
+	/* The rest is under the lock */
+	pthread_mutex_t lock;
+	uint64_t seq;			/* frames published */
+	struct {
+		struct bcast_frame *delta, *key;
+	} ring[BCAST_BACKLOG];		/* frame n is ring[n % BCAST_BACKLOG] */
+	uint64_t subscribers;		/* bit each, woken on changes */
+	bool over;			/* nothing more comes */
+};
+
+/* With one reference, for the caller */
+struct bcast_channel *bcast_channel_new(void);
+void bcast_channel_ref(struct bcast_channel *);
+void bcast_channel_unref(struct bcast_channel *);
+
+/* Only the caller refers to it */
+bool bcast_channel_alone(struct bcast_channel *);
+
+/* From the game's thread only. Returns the subscribers to wake, 0 if
+ * nothing changed.
+ */
+uint64_t bcast_publish(struct bcast_channel *, const struct wire_state *now);
+
+/* The game is over. Returns the subscribers to wake. */
+uint64_t bcast_close(struct bcast_channel *);
+
+/* Subscribers are numbered 0-63 */
+void bcast_subscribe(struct bcast_channel *, unsigned bit);
+void bcast_unsubscribe(struct bcast_channel *, unsigned bit);
+
+/* What a subscriber missed. Every frame in it holds a reference. */
+struct bcast_catchup {
+	struct bcast_frame *deltas[BCAST_BACKLOG];
+	size_t n;
+	struct bcast_frame *key;	/* as of the last delta, or NULL */
+	bool skipped;			/* too far behind, deltas are gone */
+	bool over;
+};
+
+/* Frames since @seq, which moves up to the latest */
+void bcast_catchup(struct bcast_channel *, uint64_t *seq,
+		   struct bcast_catchup *);
+
+/* Let go of the deltas, ->key is the caller's to keep or unref */
+void bcast_catchup_done(struct bcast_catchup *);
+
+/* Frames a spectator may fall behind before it's resynced */
+#define BCAST_QUEUE_LEN	32
+
+struct bcast_queue {
+	struct bcast_frame *frames[BCAST_QUEUE_LEN];
+	uint8_t head, len;
+	uint16_t off;			/* sent of the head frame */
+};
+
+/* Returns -1 if the queue's full */
+int bcast_queue_push(struct bcast_queue *, struct bcast_frame *);
+
+/* Drop everything not started on for @key. Returns the frames dropped. */
+size_t bcast_queue_resync(struct bcast_queue *, struct bcast_frame *key);
+
+/* Send what the socket takes, adding to @sent. Returns -1 on error, 1
+ * once the queue is empty, 0 if some is left.
+ */
+int bcast_queue_send(struct bcast_queue *, int fd, size_t *sent);
+
+void bcast_queue_clear(struct bcast_queue *);
+
+#endif				/* BROADCAST_H_ */
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+/* Checkpoint every this many pieces. Writing one is a struct copy into
+ * memory, so every piece is fine.
+ */
+#define CHECKPOINT_PIECES	1
+
+/* The checkpoint file is mmap'd, it's two of these. Writes alternate between
+ * them, and a slot's seq is only bumped once its save is complete, so if we
+ * die halfway through one the other is still good. seq 0 is empty.
+ */
+struct checkpoint_slot {
+	uint64_t seq;
+	char game_slot[16];		/* the save slot the game is for */
+	struct blocks_save save;
+};
+
+/* Map the checkpoint file at @path, creating it if needed, for a game in
+ * save slot @game_slot. A file that has another slot's game is left alone.
+ */
+int checkpoint_open(const char *path, const char *game_slot);
+
+/* Restore the game from the newest good checkpoint of our save slot.
+ * Returns 1 if there was one, -1 if not.
+ */
+int checkpoint_recover(void);
+
+/* A piece locked. Checkpoints the game every CHECKPOINT_PIECES pieces, does
+ * nothing if there's no checkpoint file. Call with the current block off the
+ * board.
+ */
+void checkpoint_piece(void);
+
+/* Unmap the file. With @clear, forget the checkpoints first: the game ended
+ * properly, the database has whatever's left of it.
+ */
+void checkpoint_close(bool clear);
+
+#endif				/* CHECKPOINT_H_ */
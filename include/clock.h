@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_USEC	1000ULL
+
+/* Every bit of game timing (gravity, pause, auto shift, lock delay) reads
+ * the time and sleeps through one of these. All times are in nanoseconds.
+ *
+ * The real clock is CLOCK_MONOTONIC. The virtual clock never sleeps, it jumps
+ * straight to the deadline, so a whole game runs as fast as the CPU allows
+ * with exactly the same timing decisions as a real one.
+ */
+struct blocks_clock {
+	uint64_t (*now)(struct blocks_clock *);
+
+	/* Called with @lock held. Returns with @lock held, at @deadline or
+	 * earlier if someone called wake().
+	 */
+	void (*sleep)(struct blocks_clock *, pthread_mutex_t *lock,
+		      uint64_t deadline);
+
+	/* Cut a sleep short, a deadline moved. Call with the lock held. */
+	void (*wake)(struct blocks_clock *);
+};
+
+struct clock_real {
+	struct blocks_clock clock;
+	pthread_cond_t cond;
+};
+
+/* Whoever drives a virtual game (a bot, a test) gets called before each
+ * jump in time, without the game lock, and may feed it input. Time only
+ * moves forward if nothing called wake() in the meantime.
+ */
+struct clock_virtual {
+	struct blocks_clock clock;
+	uint64_t now;
+	bool woken;
+	void (*idle)(struct clock_virtual *, uint64_t deadline);
+	void *arg;				/* for idle() */
+};
+
+void clock_real_init(struct clock_real *);
+void clock_real_destroy(struct clock_real *);
+
+void clock_virtual_init(struct clock_virtual *, uint64_t start);
+
+#endif				/* CLOCK_H_ */
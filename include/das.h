@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DAS_H_
+#define DAS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Delayed Auto Shift. Holding left or right moves the block once, waits
+ * DAS_DELAY, then keeps moving it every DAS_REPEAT (the auto repeat rate)
+ * until the key is let go. All times are in nanoseconds.
+ */
+#define DAS_DELAY	167000000ULL	/* 10 frames at 60Hz */
+#define DAS_REPEAT	33000000ULL	/* 2 frames at 60Hz */
+
+/* Most shifts handed out by one das_update() call. The board is only
+ * BLOCKS_MAX_COLUMNS wide, anything more just hits the wall.
+ */
+#define DAS_MAX_SHIFTS	16
+
+struct das {
+	int8_t dir;		/* -1 left, 1 right, 0 idle */
+	bool left, right;	/* which keys are down */
+	uint64_t next;		/* time of the next shift */
+};
+
+/* Key went down (dir = -1 or 1). The caller does the first move itself. */
+void das_press(struct das *, int dir, uint64_t now);
+
+/* Key went up. If the other direction is still held, it takes over. */
+void das_release(struct das *, int dir, uint64_t now);
+
+/* Number of shifts in das->dir due at @now */
+unsigned das_update(struct das *, uint64_t now);
+
+/* Time of the next shift, or 0 if no key is held */
+uint64_t das_deadline(const struct das *);
+
+#endif				/* DAS_H_ */
@@ -21,7 +21,7 @@
 
 #include <stdint.h>
 #include <sqlite3.h>
-#include <sys/queue.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "blocks.h"
@@ -30,39 +30,88 @@ struct db_info {
 	sqlite3 *db;		/* internal handler */
 	char *file_loc;		/* database location on filesystem */
 	char id[16];		/* ID of a game save */
+	char slot[16];		/* save slot, each player has their own */
 };
 
+/* The Scores table and its leaderboard indexes, here for blocks-db too.
+ * Leaderboard order is score, then ROWID (newest first).
+ */
+#define DB_SCORES_TABLE \
+	"CREATE TABLE IF NOT EXISTS Scores(name TEXT,level INT,score INT," \
+	"date INT);"
+#define DB_SCORES_INDEXES \
+	"CREATE INDEX IF NOT EXISTS ScoresByScore ON Scores(score);" \
+	"CREATE INDEX IF NOT EXISTS ScoresByName ON Scores(name,score);"
+#define DB_SCORES_DROP_INDEXES \
+	"DROP INDEX IF EXISTS ScoresByScore;" \
+	"DROP INDEX IF EXISTS ScoresByName;"
+#define DB_INSERT_SCORE \
+	"INSERT INTO Scores VALUES(?,?,?,?);"
+
+/* Slot used when none is picked */
+#define DB_SLOT_DEFAULT	"default"
+
 extern struct db_info *psave;
 
-/* Linked list returned to user after db_get_scores() call */
-TAILQ_HEAD(db_results_head, db_results) results_head;
-struct db_results {
+/* Scores and saves waiting to be written. Saving blocks once this fills. */
+#define DB_QUEUE_LEN	64
+
+/* Best scores kept in memory for the leaderboard */
+#define DB_TOP_LEN	10
+
+/* A row on the leaderboard */
+struct db_score {
+	int64_t rowid;		/* position, for paging past this row */
 	char id[16];
 	uint32_t score;
 	uint8_t level;
 	time_t date;
-	TAILQ_ENTRY(db_results) entries;
 };
 
-/* These functions automatically open the database specified in db_info,
- * they do their thing and then cleanup after themselves.
+/* ROWID of a score that's saved but not written yet. It will be the newest
+ * row, so it sorts ahead of every other row with the same score.
+ */
+#define DB_ROWID_PENDING INT64_MAX
+
+/* Open the database specified in db_info and start the thread that writes
+ * to it. The connection, and every statement we use, stays around until
+ * db_close().
  */
+int db_start(void);
 
-/* Saves game state to disk. Can be restored at a later time */
+/* Saves game state to disk, in slot db_info->slot of player db_info->id.
+ * Can be restored at a later time.
+ *
+ * Saving only queues a copy of the game for the database thread, it never
+ * waits on the disk. Everything queued is written before db_close()
+ * returns.
+ */
 int db_save_state(void);
+
+/* Restores, and removes, the newest save in the player's slot */
 int db_resume_state(void);
 
 /* Save game score to disk when the player loses a game */
 int db_save_score(void);
 
-/* Returns a linked list to (n) highscores in the database */
-struct db_results *db_get_scores(size_t);
+/* Same, for a player other than db_info->id. Any thread can. */
+int db_save_score_as(const char *id);
 
-/* Cleanup memory */
-#define db_clean_scores() while (results_head.tqh_first) { \
-		struct db_results *tmp_ = results_head.tqh_first; \
-		TAILQ_REMOVE (&results_head, tmp_, entries); \
-		free(tmp_); \
-	}
+/* Copies up to @len leaderboard rows into @res, starting with the row after
+ * @after, or at the top if @after is NULL. Pass the last row of one page as
+ * @after to get the next, even one that's still DB_ROWID_PENDING. Returns
+ * the number of rows, -1 on error.
+ */
+ssize_t db_get_scores(struct db_score *res, size_t len,
+		      const struct db_score *after);
+
+/* Best score for player @name. Returns 1 if found, 0 if not, -1 on error. */
+int db_get_best(const char *name, struct db_score *res);
+
+/* Write out anything queued, close the database, and forget
+ * db_info->file_loc. Returns 1 if everything queued since db_start() was
+ * written, -1 if something wasn't or the database never opened.
+ */
+int db_close(void);
 
 #endif				/* DB_H_ */
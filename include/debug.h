@@ -21,27 +21,82 @@
 
 #include <stdio.h>
 
+/* Log levels. Macros, not an enum, #if needs to see them */
+#define LOG_ERR		0
+#define LOG_WARN	1
+#define LOG_INFO	2
+#define LOG_DEBUG	3
+
+/* Messages above this level are compiled out, calls and arguments and all.
+ * Build with -DLOG_LEVEL=LOG_WARN (or 1) for a quieter binary.
+ */
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LOG_DEBUG
+#else
+#define LOG_LEVEL LOG_INFO
+#endif
+#endif				/* LOG_LEVEL */
+
+/* Per thread ring size, in messages, and the longest message we keep */
+#define LOG_RING_LEN	128
+#define LOG_MSG_LEN	240
+
+/* Most threads that may log, past this they log synchronously */
+#define LOG_MAX_THREADS	16
+
 /* Prints messages to stderr of the form:
  * [TIME/DATE] message
+ *
+ * Once debug_start() has been called messages are formatted into a ring
+ * owned by the calling thread, and a writer thread takes it from there.
+ * Logging never waits on the disk or on another thread. If a thread's ring
+ * is full the message is dropped and counted.
+ *
+ * Errors are the exception: they are written and flushed before debug_log()
+ * returns, after whatever the rings held, as we may be about to exit().
  */
-void debug_log(const char *fmt, ...);
+void debug_log(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
 
-#ifdef DEBUG
-#define debug(M, ...)	 debug_log("[DEBUG] " M, ##__VA_ARGS__)
-#else
-#define debug(M, ...)
-#endif				/* DEBUG */
+/* Start the writer thread */
+int debug_start(void);
+
+/* Write out everything logged so far and stop the writer. Logging after
+ * this is synchronous again.
+ */
+void debug_stop(void);
 
-#define log_err(M, ...)  do { \
-	debug_log("[ERR] " M " (%s:%d)", \
-		##__VA_ARGS__, __FILE__, __LINE__); \
-	fflush(NULL); \
+/* Compiled out, but the compiler still checks the format */
+#define LOG_NOTHING(M, ...) do { \
+	if (0) debug_log(LOG_DEBUG, M, ##__VA_ARGS__); \
 	} while(0)
 
-#define log_warn(M, ...) debug_log("[WARN] " M " (%s:%d)", ##__VA_ARGS__, \
-		__FILE__, __LINE__)
+#if LOG_LEVEL >= LOG_DEBUG
+#define debug(M, ...)	 debug_log(LOG_DEBUG, "[DEBUG] " M, ##__VA_ARGS__)
+#else
+#define debug(M, ...)	 LOG_NOTHING(M, ##__VA_ARGS__)
+#endif
 
-#define log_info(M, ...) debug_log("[INFO] " M " (%s:%d)", ##__VA_ARGS__, \
-		__FILE__, __LINE__)
+#if LOG_LEVEL >= LOG_ERR
+#define log_err(M, ...)  debug_log(LOG_ERR, "[ERR] " M " (%s:%d)", \
+		##__VA_ARGS__, __FILE__, __LINE__)
+#else
+#define log_err(M, ...)  LOG_NOTHING(M, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_WARN
+#define log_warn(M, ...) debug_log(LOG_WARN, "[WARN] " M " (%s:%d)", \
+		##__VA_ARGS__, __FILE__, __LINE__)
+#else
+#define log_warn(M, ...) LOG_NOTHING(M, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_INFO
+#define log_info(M, ...) debug_log(LOG_INFO, "[INFO] " M " (%s:%d)", \
+		##__VA_ARGS__, __FILE__, __LINE__)
+#else
+#define log_info(M, ...) LOG_NOTHING(M, ##__VA_ARGS__)
+#endif
 
 #endif				/* DEBUG_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define INPUT_BUF_LEN 64
+
+/* Or'd into a key on terminals that report key events */
+#define INPUT_REPEAT	(1 << 24)	/* auto repeat from the terminal */
+#define INPUT_RELEASE	(1 << 25)	/* key went up */
+#define INPUT_KEY(k)	((k) & ~(INPUT_REPEAT | INPUT_RELEASE))
+
+/* Raw terminal input. We read(2) whatever is waiting on the file descriptor
+ * and decode every key in one go, instead of one getch() per key.
+ *
+ * Decoded keys use the same values as ncurses getch(): plain characters are
+ * returned as-is, function keys as KEY_F(n) and arrows as KEY_UP, etc.
+ *
+ * Terminals that speak the kitty keyboard protocol also tell us when a key
+ * is released, which is the only way to know how long a key is held.
+ */
+struct input {
+	int fd;
+	bool events;				/* terminal sends key releases */
+	size_t len;				/* bytes waiting in buf */
+	unsigned char buf[INPUT_BUF_LEN];	/* may hold a partial sequence */
+};
+
+void input_init(struct input *, int fd);
+
+/* Ask the terminal on @fd for press/repeat/release events, and put it back
+ * the way it was. Call disable before handing the terminal back to ncurses.
+ */
+void input_events_enable(int fd);
+void input_events_disable(int fd);
+
+/* Blocks until at least one key is available, then decodes up to @len keys
+ * into @keys. Returns the number of keys, or -1 on EOF or read error.
+ */
+ssize_t input_read(struct input *, int *keys, size_t len);
+
+#endif				/* INPUT_H_ */
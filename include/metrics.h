@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+/*
+ * Counters and gauges, served in Prometheus text format over a Unix domain
+ * socket. Counters are per thread: the owner bumps its own copy with a plain
+ * store, no lock and no atomic add, and they are only summed when scraped.
+ */
+
+/* Threads that get counters of their own. Any more share one set, and pay
+ * for an atomic add.
+ */
+#define METRICS_MAX_THREADS	16
+
+enum metric {
+	METRIC_TICKS,			/* gravity ticks */
+	METRIC_PIECES,			/* pieces locked in place */
+	METRIC_LINES,			/* lines cleared */
+	METRIC_TERM_BYTES,		/* bytes written to the terminal */
+	METRIC_SENT_BYTES,		/* bytes sent to blocks-server clients */
+	METRIC_FRAMES_SENT,		/* frames sent to blocks-server clients */
+	METRIC_RESYNCS,			/* spectators too slow for deltas */
+	METRIC_LEN
+};
+
+/* Prometheus histograms, in nsec */
+enum metric_hist {
+	METRIC_FRAME,			/* screen_draw_game() */
+	METRIC_DB,			/* database reads, write batches */
+	METRIC_HIST_LEN
+};
+
+enum metric_gauge {
+	METRIC_LEVEL,
+	METRIC_SCORE,
+	METRIC_SESSIONS,		/* blocks-server clients */
+	METRIC_VIEWERS,			/* blocks-server spectators */
+	METRIC_GAUGE_LEN
+};
+
+void metrics_add(enum metric, uint64_t n);
+void metrics_observe(enum metric_hist, uint64_t nsec);
+
+/* Gauges are global, last writer wins */
+void metrics_set(enum metric_gauge, int64_t value);
+
+/* Serve metrics on the socket at @path from a thread of their own. Any old
+ * socket at @path is replaced.
+ */
+int metrics_start(const char *path);
+
+/* Stop serving and remove the socket, if we started */
+void metrics_stop(void);
+
+#endif				/* METRICS_H_ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+/* A cache line. Slots start on one and are a whole number of them, so two
+ * threads working on neighbouring slots never write to the same line.
+ */
+#define POOL_ALIGN	64
+
+/* Slots are carved out of slabs this big, mmap()ed as they're needed */
+#define POOL_SLAB	(1 << 20)
+
+/* Fixed size slots for lots of small things that come and go, like games.
+ * There's no header per slot and no malloc() bookkeeping, a slot costs its
+ * size rounded up to POOL_ALIGN. Slots are handed out from the end of the
+ * newest slab, so pages nobody has used yet are never touched, and free ones
+ * are kept in a list through the slots themselves.
+ *
+ * Not thread safe. Give each thread its own, which also keeps their slots
+ * on pages of their own.
+ */
+struct pool {
+	size_t size;			/* of a slot */
+	void *free;			/* put back, linked by their first word */
+	char *next, *end;		/* not handed out yet, newest slab */
+	struct pool_slab *slabs;
+	size_t used, nslabs;
+};
+
+void pool_init(struct pool *, size_t size);
+
+/* A zeroed slot, or NULL if we're out of memory */
+void *pool_get(struct pool *);
+
+void pool_put(struct pool *, void *);
+
+/* Unmaps every slab, whether all their slots were put back or not */
+void pool_destroy(struct pool *);
+
+#endif				/* POOL_H_ */
@@ -22,7 +22,8 @@
 #include "blocks.h"
 #include "db.h"
 
-void screen_init(void);
+/* With @count_bytes, for metrics, ncurses draws through a pty of our own */
+void screen_init(bool count_bytes);
 void screen_cleanup(void);
 
 /* Get user id, filename, etc */
@@ -31,7 +32,10 @@ void screen_draw_menu(void);
 /* Update screen */
 void screen_draw_game(void);
 
-/* Game over! prints high scores if the player lost */
-void screen_draw_over(void);
+/* Game over! prints high scores if the player lost. Saves the score, or
+ * the game if it was quit, and returns what the save did: 1 if it's queued
+ * for the database, 0 if there's nothing to save or nowhere to, -1 on error.
+ */
+int screen_draw_over(void);
 
 #endif				/* SCREEN_H_ */
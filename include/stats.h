@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-linear histogram, in the style of HdrHistogram. Values under
+ * HIST_SUB are exact; above that each power of two is split in HIST_SUB
+ * buckets, so any value is off by at most 1/HIST_SUB (~6%). Covers all of
+ * uint64_t in a fixed HIST_LEN counters, recording is a few instructions.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_LEN	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count, max;
+	uint64_t buckets[HIST_LEN];
+};
+
+/* Not thread safe, whoever owns the histogram serializes */
+void hist_record(struct hist *, uint64_t value);
+
+/* Value at each of the @n percentiles in @p (0-100, ascending) */
+void hist_percentiles(const struct hist *, const double *p, uint64_t *res,
+		      size_t n);
+
+/* Write count, p50/p99/p999 and max to the log, values in nsec */
+void hist_log(const struct hist *, const char *name);
+
+/* Wait and hold times for one user of a mutex. Record with the mutex held,
+ * each user has its own.
+ */
+struct lock_stats {
+	uint64_t taken;			/* when we got the lock */
+	struct hist wait, hold;
+};
+
+/* CLOCK_MONOTONIC in nsec. Stats are about real time, even when the game
+ * runs on a virtual clock.
+ */
+uint64_t stats_now(void);
+
+/* Just got the lock, having asked for it at @asked */
+void lock_stats_taken(struct lock_stats *, uint64_t asked);
+
+/* Got the lock back from a condition variable. The wait is part of the
+ * sleep, so only the hold time is tracked.
+ */
+void lock_stats_resumed(struct lock_stats *);
+
+/* About to let the lock go */
+void lock_stats_release(struct lock_stats *);
+
+#endif				/* STATS_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TICK_H_
+#define TICK_H_
+
+#include <stdint.h>
+
+/* Jitter histogram: bucket i counts wakeups that were late by
+ * [2^(i-1), 2^i) microseconds, bucket 0 is under a microsecond.
+ */
+#define TICK_HIST_LEN		16
+
+/* Never run more than this many ticks back to back after a stall */
+#define TICK_MAX_CATCHUP	4
+
+/* Fixed timestep scheduler. Deadlines are absolute times on the game clock,
+ * so time spent drawing or waiting on the lock doesn't push the next tick
+ * back. The caller does the sleeping, see clock.h.
+ */
+struct tick {
+	uint64_t next;			/* next deadline (nsec) */
+};
+
+/* How the ticks went, for the log. Apart from struct tick, which is part of
+ * the game, so one can add up any number of games.
+ */
+struct tick_stats {
+	uint64_t ticks;			/* ticks handed out */
+	uint64_t skipped;		/* ticks dropped after long stalls */
+	uint64_t jitter[TICK_HIST_LEN];	/* wakeup lateness */
+};
+
+/* First deadline is one @interval after @now */
+void tick_start(struct tick *, uint64_t now, uint32_t interval);
+
+/* Returns the number of ticks due at @now, 0 if the deadline hasn't passed
+ * yet, and moves the deadline forward by that many intervals. Counted in
+ * @stats.
+ */
+unsigned tick_due(struct tick *, struct tick_stats *stats, uint64_t now,
+		  uint32_t interval);
+
+/* Write tick counts and the jitter histogram to the log */
+void tick_log_stats(const struct tick_stats *);
+
+#endif				/* TICK_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* Tracepoints. Build with -DTRACE (make trace) and every TRACE_BEGIN/END
+ * pair becomes a span in a Chrome trace (chrome://tracing, or Perfetto),
+ * written on exit and whenever we get SIGUSR1. Without -DTRACE they're
+ * nothing at all.
+ */
+
+/* Events kept per thread. The ring wraps, so a dump has the most recent. */
+#define TRACE_RING_LEN		16384
+#define TRACE_MAX_THREADS	16
+
+#ifdef TRACE
+
+struct trace_event {
+	uint64_t ts;			/* trace_clock() */
+	const char *name;		/* string literal, never copied */
+	char phase;			/* 'B'egin or 'E'nd */
+};
+
+struct trace_ring {
+	uint64_t head;			/* events written, ever */
+	int tid;
+	struct trace_event ev[TRACE_RING_LEN];
+};
+
+extern __thread struct trace_ring *trace_self;
+
+/* Slow path, the first event in a thread */
+struct trace_ring *trace_ring_new(void);
+
+/* The TSC where there is one, trace_dump() converts to time */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void trace_event(const char *name, char phase)
+{
+	struct trace_ring *ring = trace_self;
+	struct trace_event *ev;
+
+	if (!ring && !(ring = trace_ring_new()))
+		return;
+
+	ev = &ring->ev[ring->head % TRACE_RING_LEN];
+	ev->ts = trace_clock();
+	ev->name = name;
+	ev->phase = phase;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_BEGIN(name)	trace_event((name), 'B')
+#define TRACE_END(name)		trace_event((name), 'E')
+
+/* Call first thing in main(), before any threads. Traces go to @path. */
+int trace_start(const char *path);
+
+/* Write every ring out as Chrome trace JSON */
+void trace_dump(void);
+
+#else
+
+#define TRACE_BEGIN(name)	do { } while (0)
+#define TRACE_END(name)		do { } while (0)
+
+#define trace_start(path)	((void) 0)
+#define trace_dump()		((void) 0)
+
+#endif				/* TRACE */
+
+#endif				/* TRACE_H_ */
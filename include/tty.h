@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TTY_H_
+#define TTY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "wire.h"
+
+/*
+ * Terminal sessions for blocks-server -a. `blocks -a socket` puts its
+ * terminal in raw mode and hands it over, with a struct tty_hello, as
+ * SCM_RIGHTS on the socket. The server plays the game right on that
+ * terminal and hangs up the socket when it's over; the client puts the
+ * terminal back and exits.
+ *
+ * No curses on the server side: the screen is drawn with plain ANSI escapes,
+ * and after the first frame only the cells and numbers that changed since
+ * the last one, worked out from the same struct wire_state the binary
+ * protocol diffs. The layout follows screen.c.
+ */
+
+/* Biggest frame, a whole board redrawn with a color change per cell */
+#define TTY_FRAME_MAX	8192
+
+struct tty_hello {
+	char name[16];			/* for the leaderboard */
+};
+
+struct db_score;
+
+/* Clear the screen and draw everything that never changes, and the game as
+ * in an all zero struct wire_state. Returns the length.
+ */
+size_t tty_start(char *buf);
+
+/* Redraw what changed from @shown to @now, and make @shown @now. Returns
+ * the length.
+ */
+size_t tty_draw(char *buf, struct wire_state *shown,
+		const struct wire_state *now);
+
+/* After the last tty_draw(): the @n leaderboard rows in @top under the
+ * board, then the cursor back for the shell
+ */
+size_t tty_over(char *buf, const struct db_score *top, ssize_t n);
+
+/* Terminal bytes to blocks_keys() keys, @in and @keys the same length.
+ * F3 and ^C are KEY_F(3), quit. Returns the number of keys.
+ */
+size_t tty_keys(const uint8_t *in, size_t len, int *keys);
+
+#endif				/* TTY_H_ */
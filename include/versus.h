@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef VERSUS_H_
+#define VERSUS_H_
+
+#include <stdint.h>
+
+#include "blocks.h"
+#include "clock.h"
+#include "stats.h"
+
+/*
+ * Two player versus, in lockstep. Both peers run both games, on the same
+ * fixed timestep, from the same seed, with the same keys, so they come out
+ * the same; only keys cross the network. Clearing 2, 3 or 4 lines sends 1,
+ * 2 or 4 rows of garbage to the other board.
+ *
+ * Waiting for the other side's keys would put the round trip on every
+ * frame, so we don't: their keys are predicted (none), every frame's state
+ * is kept in a ring, and when the real keys turn out different we rewind to
+ * that frame and run it and everything after it again, all within the
+ * frame. Their board may jump a little, ours never does.
+ */
+#define VERSUS_FPS		60
+#define VERSUS_FRAME_NSEC	(NSEC_PER_SEC / VERSUS_FPS)
+
+/* Furthest we run ahead of the other side's keys before waiting for them,
+ * so also the most frames one rollback runs again.
+ */
+#define VERSUS_MAX_ROLLBACK	8
+
+/* Frames of keys and state kept. A power of two, over twice the above: the
+ * other side can be that far ahead of us too.
+ */
+#define VERSUS_RING		32
+
+/* One frame's keys, a bit per enum blocks_input_cmd */
+#define VERSUS_KEY(cmd)		(1U << (cmd))
+
+/* Sent every frame. Keys are sent again until the other side has them, so
+ * a lost packet costs a little latency and nothing else.
+ */
+struct versus_packet {
+	uint32_t frame;			/* of keys[0] */
+	uint32_t ack;			/* got all your keys before this */
+	uint8_t n;
+	uint8_t keys[VERSUS_RING];
+};
+
+enum versus_result {
+	VERSUS_PLAYING,
+	VERSUS_WON,
+	VERSUS_LOST,
+	VERSUS_DRAW,
+};
+
+/* Both games as they were before a frame */
+struct versus_frame {
+	struct blocks_snapshot games[2];
+	uint32_t rng;
+};
+
+struct versus {
+	struct blocks_game *games[2];		/* ours, theirs */
+	struct blocks_host host;		/* for both, on ->clock */
+	struct clock_virtual clock;
+	uint32_t rng;				/* garbage holes, xorshift32 */
+	int side;				/* which player we are, 0 or 1 */
+
+	uint32_t frame;				/* next one to run */
+	uint32_t confirmed;			/* have their keys before this */
+	uint32_t acked;				/* they have ours before this */
+	uint32_t rollback;			/* first frame predicted wrong */
+	uint32_t over;				/* frame + 1 someone lost on */
+
+	/* By frame % VERSUS_RING */
+	uint8_t keys[2][VERSUS_RING];
+	uint32_t known[VERSUS_RING];		/* frame + 1 if theirs is real */
+	struct versus_frame saved[VERSUS_RING];
+
+	/* What it costs, in real time */
+	uint64_t stalls, rollbacks, replayed, replay_nsec;
+	struct hist frame_time, rollback_time;	/* nsec */
+};
+
+/* New match. Both sides need the same @seed, and one @side each: 0 for one
+ * of them, 1 for the other. Leaves pgame alone.
+ */
+int versus_init(struct versus *, uint32_t seed, int side);
+void versus_cleanup(struct versus *);
+
+/* Run the next frame, with our @keys. Returns 0 without running it if we're
+ * VERSUS_MAX_ROLLBACK frames ahead of the other side, 1 if it ran.
+ */
+int versus_advance(struct versus *, uint8_t keys);
+
+/* Take in a packet from the other side, rolling back if it has to */
+void versus_receive(struct versus *, const struct versus_packet *);
+
+/* The packet to send them now */
+void versus_packet(const struct versus *, struct versus_packet *);
+
+/* Settled once every frame up to the first loss ran on real keys. The
+ * games stop there.
+ */
+enum versus_result versus_result(const struct versus *);
+
+/* Checksum of game @i as of now, see blocks_snapshot_checksum() */
+uint32_t versus_checksum(const struct versus *, int i);
+
+#endif				/* VERSUS_H_ */
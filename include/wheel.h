@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "clock.h"
+
+/* Timers go off on the first tick at or after their deadline, never early */
+#define WHEEL_TICK	NSEC_PER_MSEC
+
+/* Hierarchical timing wheel, as in Varghese and Lauck. Each level has
+ * WHEEL_SLOTS slots, each slot WHEEL_SLOTS times the span of one a level
+ * down: 1ms, 1.024s and 17.5min. Level 0 timers sit in the slot for their
+ * tick. Further out they sit in a coarser slot until the wheel gets there,
+ * then move down a level ("cascade"), at most WHEEL_LEVELS - 1 times each.
+ * Anything past the top level (12 days) waits at its far end.
+ *
+ * Level 0 covers a second so nothing a game sets (gravity, lock delay, DAS)
+ * ever cascades.
+ */
+#define WHEEL_BITS	10
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	3
+#define WHEEL_WORDS	(WHEEL_SLOTS / 64)
+
+/* Lots of timers that keep moving, like every game's next gravity tick.
+ * Setting, moving, cancelling and expiring one is O(1) and allocates
+ * nothing; the timer lives in whatever it times. A bitmap of busy slots per
+ * level finds the next one due in O(WHEEL_LEVELS).
+ */
+struct wheel_timer {
+	uint64_t expires;			/* tick */
+	LIST_ENTRY(wheel_timer) entries;
+	uint16_t slot;				/* level * WHEEL_SLOTS + slot */
+};
+
+struct wheel {
+	uint64_t now;				/* next tick to look at */
+	size_t armed;
+	uint64_t busy[WHEEL_LEVELS][WHEEL_WORDS]; /* bit per non-empty slot */
+	LIST_HEAD(, wheel_timer) slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	LIST_HEAD(, wheel_timer) expired;	/* due, not handed out */
+};
+
+/* Starting at @now (nsec, like all times here) */
+void wheel_init(struct wheel *, uint64_t now);
+
+/* Set @t to go off at @deadline, whether it was set or not */
+void wheel_add(struct wheel *, struct wheel_timer *t, uint64_t deadline);
+
+/* Doesn't mind if @t isn't set */
+void wheel_del(struct wheel *, struct wheel_timer *t);
+
+/* Next timer due at @now, taken off the wheel. NULL once there are none. */
+struct wheel_timer *wheel_expire(struct wheel *, uint64_t now);
+
+/* When the next timer may go off, or UINT64_MAX if none are set. Can be
+ * early, never late.
+ */
+uint64_t wheel_next(const struct wheel *);
+
+#endif				/* WHEEL_H_ */
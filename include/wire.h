@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "blocks.h"
+
+/*
+ * blocks-server's binary protocol. Everything is framed: a varint length,
+ * then that many bytes. Integers are LEB128 varints, signed ones zigzagged.
+ *
+ * Server frames carry what changed since the last frame, as records:
+ *	WIRE_CLEAR	varint row mask. Those rows go, the ones above move
+ *			down, empty rows come in at the top.
+ *	WIRE_ROWS	varint row mask, then for each row (top down) a varint
+ *			XOR of its spaces and a varint of the colors of the
+ *			cells that filled, COLOR_BITS each, lowest column
+ *			first. Cells that emptied have no color.
+ *	WIRE_PIECE	block type, then its 4 cells, one byte each
+ *	WIRE_MOVE	zigzag varint, added to every cell of the piece
+ *	WIRE_QUEUE	varint, hold then next block types, COLOR_BITS each
+ *	WIRE_SHIFT	block type. The first next block came into play, the
+ *			rest moved up, this one came in last.
+ *	WIRE_SCORE	zigzag varints, change in level then in score
+ *	WIRE_OVER	game over, nothing more comes
+ *	WIRE_RESET	forget the game so far, the rest of the frame starts
+ *			from nothing. Spectators get these on joining, and
+ *			when they fall too far behind to catch up on deltas.
+ *
+ * Client frames are keys, each a varint, as many as were typed since the
+ * last frame.
+ */
+
+/* Biggest frame either way, length included */
+#define WIRE_FRAME_MAX	256
+
+/* Most keys in one client frame, even 5 byte ones fit */
+#define WIRE_KEYS_MAX	48
+
+/* A cell is row * BLOCKS_MAX_COLUMNS + column */
+#define WIRE_CELL(y, x)	((y) * BLOCKS_MAX_COLUMNS + (x))
+
+enum wire_tag {
+	WIRE_CLEAR = 1,
+	WIRE_ROWS,
+	WIRE_PIECE,
+	WIRE_MOVE,
+	WIRE_QUEUE,
+	WIRE_SHIFT,
+	WIRE_SCORE,
+	WIRE_OVER,
+	WIRE_RESET,
+};
+
+/* What a client sees. The board is only the locked cells, the falling
+ * block travels on its own.
+ */
+struct wire_state {
+	uint32_t level, score;
+	uint16_t spaces[BLOCKS_MAX_ROWS];
+	uint32_t colors[BLOCKS_MAX_ROWS];	/* 0 for empty cells */
+	uint8_t type;				/* falling block */
+	uint8_t cells[4];			/* where it is, WIRE_CELL() */
+	uint8_t queue[NEXT_BLOCKS_LEN + 1];	/* hold, then next */
+	bool over;
+};
+
+/* Frame taking a client from @sent to @now into @buf (WIRE_FRAME_MAX bytes)
+ * and make @sent a copy of @now. Returns the length, 0 if nothing changed.
+ */
+size_t wire_encode(uint8_t *buf, struct wire_state *sent,
+		   const struct wire_state *now);
+
+/* Frame with all of @now, starting with WIRE_RESET, into @buf
+ * (WIRE_FRAME_MAX bytes). Returns the length.
+ */
+size_t wire_encode_key(uint8_t *buf, const struct wire_state *now);
+
+/* Apply the frame at the start of @buf to @st. Returns its length, 0 if
+ * it's not all there yet, -1 if it's malformed.
+ */
+ssize_t wire_decode(const uint8_t *buf, size_t len, struct wire_state *st);
+
+/* Frame up @n keys (at most WIRE_KEYS_MAX) into @buf. Returns its length. */
+size_t wire_encode_keys(uint8_t *buf, const int *keys, size_t n);
+
+/* Keys from the frame at the start of @buf, into @keys (WIRE_KEYS_MAX) and
+ * @n. Returns the frame's length, 0 if incomplete, -1 if malformed.
+ */
+ssize_t wire_decode_keys(const uint8_t *buf, size_t len, int *keys,
+			 size_t *n);
+
+#endif				/* WIRE_H_ */
@@ -17,12 +17,32 @@
  */
 
 #include "bag.h"
+#include "blocks.h"
+#include "debug.h"
 
 #define FILL_BIT 0x80
 #define DIRTY_BIT FILL_BIT
 
-static int bag_bag7[] = { DIRTY_BIT, DIRTY_BIT, DIRTY_BIT,
-			  DIRTY_BIT, DIRTY_BIT, DIRTY_BIT, DIRTY_BIT };
+/* xorshift32. rand() would do, but we can't save and restore its state. */
+static uint32_t bag_rand(struct bag *bag)
+{
+	uint32_t x = bag->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return bag->rng = x;
+}
+
+void bag_init(struct bag *bag, uint32_t seed)
+{
+	for (int i = 0; i < BAG_LEN; i++)
+		bag->pieces[i] = DIRTY_BIT;
+
+	bag->index = 0;
+	bag->rng = seed ? seed : 1;
+}
 
 /* This is the "Random Generator" algorithm.
  * Create a 'bag' of all seven pieces, then one by one remove an element from
@@ -30,7 +50,7 @@ static int bag_bag7[] = { DIRTY_BIT, DIRTY_BIT, DIRTY_BIT,
  *
  * This helps to reduce the length of sequential pieces.
  */
-void bag_random_generator(void) {
+void bag_random_generator(struct bag *bag) {
 	uint8_t rng_block, avail_blocks[] = {
 		O_BLOCK,
 		I_BLOCK,
@@ -47,13 +67,13 @@ void bag_random_generator(void) {
 	 * First piece is never the O, S, or Z blocks.
 	 */
 retry:
-	rng_block = rand() % NUM_BLOCKS;
+	rng_block = bag_rand(bag) % NUM_BLOCKS;
 	if (rng_block == O_BLOCK ||
 	    rng_block == S_BLOCK ||
 	    rng_block == Z_BLOCK)
 		goto retry;
 
-	bag_bag7[0] = avail_blocks[rng_block];
+	bag->pieces[0] = avail_blocks[rng_block];
 	avail_blocks[rng_block] |= FILL_BIT; // Mark dirty
 
 
@@ -64,30 +84,29 @@ retry:
 
 		/* Keep trying until we find a block that hasn't been used */
 		do {
-			rng_block = rand() % NUM_BLOCKS;
+			rng_block = bag_rand(bag) % NUM_BLOCKS;
 		} while (avail_blocks[rng_block] >= FILL_BIT);
 
-		bag_bag7[i] = avail_blocks[rng_block];
+		bag->pieces[i] = avail_blocks[rng_block];
 		avail_blocks[rng_block] |= FILL_BIT;
 	}
 }
 
-int bag_next_piece(void) {
-	static size_t index = 0;
-	int tmp = bag_bag7[index];
+int bag_next_piece(struct bag *bag) {
+	int tmp = bag->pieces[bag->index];
 
 	/* Mark bag location dirty */
-	bag_bag7[index] |= DIRTY_BIT;
+	bag->pieces[bag->index] |= DIRTY_BIT;
 
-	if (++index == NUM_BLOCKS)
-		index = 0;
+	if (++bag->index == BAG_LEN)
+		bag->index = 0;
 
 	return tmp;
 }
 
-int bag_is_empty(void) {
-	for (int i = 0; i < 7; i++)
-		if (bag_bag7[i] < DIRTY_BIT)
+int bag_is_empty(const struct bag *bag) {
+	for (int i = 0; i < BAG_LEN; i++)
+		if (bag->pieces[i] < DIRTY_BIT)
 			return 0;
 
 	return 1;
@@ -18,6 +18,7 @@
 
 #include <ctype.h>
 #include <math.h>
+#include <stddef.h>
 #include <ncurses.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -29,10 +30,49 @@
 
 #include "bag.h"
 #include "blocks.h"
+#include "checkpoint.h"
 #include "debug.h"
+#include "input.h"
+#include "metrics.h"
 #include "screen.h"
+#include "tick.h"
+#include "trace.h"
 
-struct blocks_game *pgame;
+__thread struct blocks_game *pgame;
+__thread struct blocks_host *phost;
+
+/* Games stay small enough to keep by the million, see blocks.h */
+typedef char blocks_game_size_check[sizeof(struct blocks_game) <= 256 ? 1 : -1];
+
+/* Current time on the game clock */
+static uint64_t game_now(void)
+{
+	return phost->clock->now(phost->clock);
+}
+
+static void draw_game(void)
+{
+	if (phost->draw)
+		phost->draw();
+}
+
+/* pthread_mutex_lock(&phost->lock), keeping score in @ls */
+static void game_lock(struct lock_stats *ls)
+{
+	uint64_t asked = stats_now();
+
+	TRACE_BEGIN("lock");
+	pthread_mutex_lock(&phost->lock);
+	TRACE_END("lock");
+
+	lock_stats_taken(ls, asked);
+}
+
+static void game_unlock(struct lock_stats *ls)
+{
+	lock_stats_release(ls);
+	pthread_mutex_unlock(&phost->lock);
+}
 
 /*
  * Resets the block to its default positional state
@@ -44,11 +84,14 @@ static void reset_block(struct blocks *block)
 	block->col_off = BLOCKS_MAX_COLUMNS / 2;
 	block->row_off = 1;
 
-	block->lock_delay = 0;
+	block->lock_delay = LOCK_DELAY;
+	block->lock_resets = 0;
 	block->soft_drop = 0;
 	block->hard_drop = 0;
-	block->t_spin = false;
+	block->t_spin = T_SPIN_NONE;
+	block->kick = 0;
 	block->hold = false;
+	block->rot = 0;
 
 	/* The piece at (0, 0) is the pivot when we rotate */
 	switch (block->type) {
@@ -99,51 +142,167 @@ static void reset_block(struct blocks *block)
 	}
 }
 
+void blocks_piece(struct blocks *block, int type)
+{
+	block->type = type;
+	reset_block(block);
+}
+
+/* The next piece from the bag */
+static uint8_t deal_block(void)
+{
+	/* Create a new bag if necessary, then pull the next piece from it */
+	if (bag_is_empty(&pgame->bag))
+		bag_random_generator(&pgame->bag);
+
+	return bag_next_piece(&pgame->bag);
+}
+
 /*
  * randomizes block and sets the initial positions of the pieces
  */
 static void randomize_block(struct blocks *block)
 {
-	/* Create a new bag if necessary, then pull the next piece from it */
-	if (bag_is_empty())
-		bag_random_generator();
-
-	block->type = bag_next_piece();
-
-	reset_block(block);
+	blocks_piece(block, deal_block());
 }
 
 /*
- * To prevent an additional free/malloc we recycle the allocated memory.
- *
- * First remove it from its current state, causing the next block to 'fall'
- * into place. Then we randomize it(WHICH WIPES ALL DATA, INCLUDING PREVIOUS
- * POINTERS) and reinstall it at the end of the list.
+ * The first of the next blocks 'falls' into place, everything behind it
+ * moves up, and the bag deals a new one onto the end.
  */
 static void update_cur_block()
 {
-	struct blocks *last, *np = CURRENT_BLOCK();
+	TRACE_BEGIN("update_cur_block");
+
+	blocks_piece(CURRENT_BLOCK(), pgame->next[0]);
+
+	memmove(pgame->next, pgame->next + 1, NEXT_BLOCKS_LEN - 1);
+	pgame->next[NEXT_BLOCKS_LEN - 1] = deal_block();
+
+	TRACE_END("update_cur_block");
+}
+
+/* A kick, in columns and rows (down) */
+struct kick {
+	int8_t x, y;
+};
 
-	LIST_REMOVE(np, entries);
+#define SRS_KICKS	5
 
-	randomize_block(np);
+/* SRS the way the guideline defines it: every rotation state has five
+ * offsets, and turning from state a to b tries a's offsets minus b's, in
+ * order. The I piece turns about a cell here like the rest, so its offsets
+ * also move it back to where SRS turns it, about its middle.
+ */
+static const struct kick srs_offsets[2][4][SRS_KICKS] = {
+	{	/* J, L, S, T, Z */
+		{ { 0,  0 }, {  0,  0 }, {  0,  0 }, { 0,  0 }, {  0,  0 } },
+		{ { 0,  0 }, {  1,  0 }, {  1,  1 }, { 0, -2 }, {  1, -2 } },
+		{ { 0,  0 }, {  0,  0 }, {  0,  0 }, { 0,  0 }, {  0,  0 } },
+		{ { 0,  0 }, { -1,  0 }, { -1,  1 }, { 0, -2 }, { -1, -2 } },
+	}, {	/* I */
+		{ {  0,  0 }, { -1,  0 }, {  2,  0 }, { -1,  0 }, {  2,  0 } },
+		{ { -1,  0 }, {  0,  0 }, {  0,  0 }, {  0, -1 }, {  0,  2 } },
+		{ { -1, -1 }, {  1, -1 }, { -2, -1 }, {  1,  0 }, { -2,  0 } },
+		{ {  0, -1 }, {  0, -1 }, {  0, -1 }, {  0,  1 }, {  0, -2 } },
+	},
+};
+
+/* Classic: turn in place, or failing that a column left or right */
+static const struct kick classic_kicks[] = {
+	{ 0, 0 }, { -1, 0 }, { 1, 0 },
+};
+static const struct kick no_kicks[LEN(classic_kicks)];
+
+/* Each piece turned clockwise 0-3 times about its pivot, as a bitboard: 16
+ * bits a row from ->top down, column x at bit x + 2, and how far it
+ * reaches left and right of the pivot. The O block doesn't turn.
+ */
+#define SHAPE(a, b, c, d) \
+	((uint64_t) (a) | (uint64_t) (b) << 16 | \
+	 (uint64_t) (c) << 32 | (uint64_t) (d) << 48)
+
+static const struct shape {
+	uint64_t rows;
+	int8_t top, height, left, right;
+} shapes[NUM_BLOCKS][4] = {
+	[O_BLOCK] = {
+		{ SHAPE(0x06, 0x06, 0, 0), -1, 2, -1, 0 },
+		{ SHAPE(0x06, 0x06, 0, 0), -1, 2, -1, 0 },
+		{ SHAPE(0x06, 0x06, 0, 0), -1, 2, -1, 0 },
+		{ SHAPE(0x06, 0x06, 0, 0), -1, 2, -1, 0 },
+	},
+	[I_BLOCK] = {
+		{ SHAPE(0x1e, 0, 0, 0),          0, 1, -1, 2 },
+		{ SHAPE(0x04, 0x04, 0x04, 0x04), -1, 4, 0, 0 },
+		{ SHAPE(0x0f, 0, 0, 0),          0, 1, -2, 1 },
+		{ SHAPE(0x04, 0x04, 0x04, 0x04), -2, 4, 0, 0 },
+	},
+	[T_BLOCK] = {
+		{ SHAPE(0x04, 0x0e, 0, 0),    -1, 2, -1, 1 },
+		{ SHAPE(0x04, 0x0c, 0x04, 0), -1, 3, 0, 1 },
+		{ SHAPE(0x0e, 0x04, 0, 0),     0, 2, -1, 1 },
+		{ SHAPE(0x04, 0x06, 0x04, 0), -1, 3, -1, 0 },
+	},
+	[L_BLOCK] = {
+		{ SHAPE(0x08, 0x0e, 0, 0),    -1, 2, -1, 1 },
+		{ SHAPE(0x04, 0x04, 0x0c, 0), -1, 3, 0, 1 },
+		{ SHAPE(0x0e, 0x02, 0, 0),     0, 2, -1, 1 },
+		{ SHAPE(0x06, 0x04, 0x04, 0), -1, 3, -1, 0 },
+	},
+	[J_BLOCK] = {
+		{ SHAPE(0x02, 0x0e, 0, 0),    -1, 2, -1, 1 },
+		{ SHAPE(0x0c, 0x04, 0x04, 0), -1, 3, 0, 1 },
+		{ SHAPE(0x0e, 0x08, 0, 0),     0, 2, -1, 1 },
+		{ SHAPE(0x04, 0x04, 0x06, 0), -1, 3, -1, 0 },
+	},
+	[Z_BLOCK] = {
+		{ SHAPE(0x06, 0x0c, 0, 0),    -1, 2, -1, 1 },
+		{ SHAPE(0x08, 0x0c, 0x04, 0), -1, 3, 0, 1 },
+		{ SHAPE(0x06, 0x0c, 0, 0),     0, 2, -1, 1 },
+		{ SHAPE(0x04, 0x06, 0x02, 0), -1, 3, -1, 0 },
+	},
+	[S_BLOCK] = {
+		{ SHAPE(0x0c, 0x06, 0, 0),    -1, 2, -1, 1 },
+		{ SHAPE(0x04, 0x0c, 0x08, 0), -1, 3, 0, 1 },
+		{ SHAPE(0x0c, 0x06, 0, 0),     0, 2, -1, 1 },
+		{ SHAPE(0x02, 0x06, 0x04, 0), -1, 3, -1, 0 },
+	},
+};
+
+/* Does @shape fit with its pivot at (@col, @row)? Past the walls or floor
+ * is a compare each, then the four rows of the board it covers go in a
+ * word like its own, and it's one AND. Near the floor the rows under the
+ * piece are shifted out rather than read past the end.
+ */
+static bool shape_fits(const struct shape *shape, int col, int row)
+{
+	const uint16_t *spaces;
+	uint64_t board;
+	int y = row + shape->top, base;
+
+	if (col + shape->left < 0 || col + shape->right >= BLOCKS_MAX_COLUMNS ||
+	    y < 0 || y + shape->height > BLOCKS_MAX_ROWS)
+		return false;
 
-	/* Find last block in list */
-	for (last = FIRST_NEXT_BLOCK();
-	     last && last->entries.le_next;
-	     last = last->entries.le_next)
-		;
+	base = y < BLOCKS_MAX_ROWS - 4 ? y : BLOCKS_MAX_ROWS - 4;
+	spaces = pgame->spaces + base;
+	board = SHAPE(spaces[0], spaces[1], spaces[2], spaces[3]);
+	board >>= (y - base) * 16;
 
-	LIST_INSERT_AFTER(last, np, entries);
+	return !((shape->rows << col) & (board << 2));
 }
 
-/* rotate pieces in blocks by either 90^ or -90^ around (0, 0) pivot */
+/*
+ * Rotate pieces in blocks by either 90^ or -90^ around (0, 0) pivot, then
+ * kick it to the first place that fits, if any. Each is one shape_fits().
+ */
 static int rotate_block(struct blocks *block, enum blocks_input_cmd cmd)
 {
-	int new_x, new_y;
-	int bounds_x, bounds_y;
-	int dir = 1;
-	size_t i;
+	const struct kick *from, *to;
+	const struct shape *shape;
+	int dir = 1, rot, x, y;
+	size_t i, k, n;
 
 	if (!block)
 		return -1;
@@ -155,28 +314,41 @@ static int rotate_block(struct blocks *block, enum blocks_input_cmd cmd)
 	if (cmd == ROT_LEFT)
 		dir = -1;
 
-	/* Check each piece for a collision before we write any changes */
-	for (i = 0; i < LEN(block->p); i++) {
-		bounds_x = block->p[i].y * (-dir) + block->col_off;
-		bounds_y = block->p[i].x * (dir) + block->row_off;
-
-		/* Check for out of bounds on each piece */
-		if (bounds_x < 0 || bounds_x >= BLOCKS_MAX_COLUMNS ||
-		    bounds_y < 0 || bounds_y >= BLOCKS_MAX_ROWS ||
-		    /* Also check if a piece already exists here */
-		    blocks_at_yx(bounds_y, bounds_x))
-			return 0;
+	rot = (block->rot + dir) & 3;
+	shape = &shapes[block->type][rot];
+
+	if (pgame->rotation == ROTATION_CLASSIC) {
+		from = classic_kicks;
+		to = no_kicks;
+		n = LEN(classic_kicks);
+	} else {
+		from = srs_offsets[block->type == I_BLOCK][block->rot];
+		to = srs_offsets[block->type == I_BLOCK][rot];
+		n = SRS_KICKS;
 	}
 
-	/* No collisions, so update the block position. */
+	for (k = 0; k < n; k++)
+		if (shape_fits(shape, block->col_off + from[k].x - to[k].x,
+			       block->row_off + from[k].y - to[k].y))
+			break;
+
+	if (k == n)
+		return 0;
+
+	/* It fits, so update the block position */
 	for (i = 0; i < LEN(block->p); i++) {
-		new_x = block->p[i].y * (-dir);
-		new_y = block->p[i].x * (dir);
+		x = block->p[i].y * (-dir);
+		y = block->p[i].x * (dir);
 
-		block->p[i].x = new_x;
-		block->p[i].y = new_y;
+		block->p[i].x = x;
+		block->p[i].y = y;
 	}
 
+	block->col_off += from[k].x - to[k].x;
+	block->row_off += from[k].y - to[k].y;
+	block->rot = rot;
+	block->kick = k + 1;
+
 	return 1;
 }
 
@@ -210,28 +382,47 @@ static int translate_block(struct blocks *block, enum blocks_input_cmd cmd)
 	return 1;
 }
 
+/* The corners around a T block's pivot are a bit each, clockwise from the
+ * top left. Its front two are either side of the point, by ->rot.
+ */
+static const uint8_t t_front[4] = { 0x3, 0x6, 0xc, 0x9 };
+
+/* Bit n set if n has three or four corners in it */
+#define THREE_CORNERS	0xe880
+
 /*
- * Tetris Guidlines say wallkicks first try to move left, attempt rotation
- * again. Then if that fails, we try again but by moving to the right.
+ * A T block that turned into place with three of its corners filled is a
+ * T-spin; a mini if one of the front two is open, unless it took the last
+ * SRS kick to get there. The walls and floor count as filled, and a corner
+ * is a bit from each of the rows above and below.
  */
-static int try_wall_kick(struct blocks *block, enum blocks_input_cmd cmd)
+static uint8_t find_t_spin(const struct blocks *block)
 {
-	/* Try to move left and rotate again. */
-	if (translate_block(block, MOVE_LEFT) == 1) {
-		if (rotate_block(block, cmd) == 1)
-			return 1;
-	}
+	const uint32_t walls = ~(((1U << BLOCKS_MAX_COLUMNS) - 1) << 1);
+	uint32_t above, below;
+	unsigned corners;
+	int y = block->row_off;
 
-	/* undo previous translation */
-	translate_block(block, MOVE_RIGHT);
+	if (block->type != T_BLOCK || !block->kick)
+		return T_SPIN_NONE;
 
-	/* Try to move right and rotate again. */
-	if (translate_block(block, MOVE_RIGHT) == 1) {
-		if (rotate_block(block, cmd) == 1)
-			return 1;
-	}
+	above = y > 0 ? (uint32_t) pgame->spaces[y - 1] << 1 | walls : walls;
+	below = y < BLOCKS_MAX_ROWS - 1 ?
+		(uint32_t) pgame->spaces[y + 1] << 1 | walls : ~0U;
+
+	/* Column col_off - 1 is bit 0 now */
+	above >>= block->col_off;
+	below >>= block->col_off;
+	corners = (above & 1) | (above >> 1 & 2) | (below & 4) | (below << 3 & 8);
 
-	return 0;
+	if (!(THREE_CORNERS >> corners & 1))
+		return T_SPIN_NONE;
+
+	if ((corners & t_front[block->rot]) == t_front[block->rot] ||
+	    block->kick == SRS_KICKS)
+		return T_SPIN;
+
+	return T_SPIN_MINI;
 }
 
 /*
@@ -248,6 +439,15 @@ static void update_tick_speed(void)
 	pgame->nsec = (uint32_t) ((double)1E9 / speed) - 1;
 }
 
+/* Points for a lock, by enum blocks_t_spin and lines cleared, times the
+ * level. A T can't clear four; those are a tetris's.
+ */
+static const uint16_t clear_points[3][5] = {
+	{   0, 100,  300,  500, 800 },
+	{ 100, 200,  400,  500, 800 },
+	{ 400, 800, 1200, 1600, 800 },
+};
+
 /*
  * We first check each row for a full line, and shift all rows above this down.
  * We currently implement naive gravity.
@@ -269,10 +469,11 @@ static int destroy_lines(void)
 	/* point modifier, "difficult" line clears earn more over time.
 	 * a tetris (4 line clears) counts for 1 difficult move.
 	 *
-	 * difficult values >1 boost points by 3/2
+	 * pgame->difficult values >1 boost points by 3/2
 	 */
-	static size_t difficult = 0;
-	uint32_t point_mod = 0;
+	uint32_t point_mod;
+
+	TRACE_BEGIN("destroy_lines");
 
 	/* Fill in all bits below bit BLOCKS_MAX_COLUMNS. Row populations are
 	 * stored in a bit field, so we can check for a full row by comparing
@@ -295,15 +496,18 @@ static int destroy_lines(void)
 		if (pgame->spaces[i] != full_row)
 			continue;
 
-		/* Move lines above destroyed line down */
-		for (j = i; j > 0; j--)
+		/* Move lines above destroyed line down, colors too */
+		for (j = i; j > 0; j--) {
 			pgame->spaces[j] = pgame->spaces[j - 1];
+			pgame->colors[j] = pgame->colors[j - 1];
+		}
 
 		/* Lines are moved down, so we recheck this row. */
 		i++;
 		destroyed++;
 	}
 
+	pgame->lines += destroyed;
 	pgame->lines_destroyed += destroyed;
 	if (pgame->lines_destroyed >= (pgame->level * 2 + 2)) {
 		pgame->lines_destroyed -= (pgame->level * 2 + 2);
@@ -311,56 +515,39 @@ static int destroy_lines(void)
 		update_tick_speed();
 	}
 
-	/* We lose our difficulty multipliers on easy moves */
-	if ((destroyed && destroyed != 4) && !CURRENT_BLOCK()->t_spin)
-		difficult = 0;
+	/* Tetrises and T-spins that clear lines are difficult, and earn half
+	 * again when the last one was too. Any other clear ends the run.
+	 */
+	if (destroyed == 4 || (destroyed && CURRENT_BLOCK()->t_spin))
+		pgame->difficult++;
+	else if (destroyed)
+		pgame->difficult = 0;
 
-	if (CURRENT_BLOCK()->t_spin)
-		difficult++;
+	point_mod = clear_points[CURRENT_BLOCK()->t_spin][destroyed];
 
-	/* Number of lines destroyed in move */
-	switch (destroyed) {
-		case 1:
-			point_mod = 100;
-			break;
-		case 2:
-			point_mod = 300;
-			break;
-		case 3:
-			point_mod = 500;
-			break;
-		case 4:
-			difficult++;
-			point_mod = 800;
-			break;
-	}
-
-	if (difficult > 1)
+	if (pgame->difficult > 1 && destroyed)
 		point_mod = (point_mod * 3) /2;
 
 	pgame->score += point_mod * pgame->level
 		+ CURRENT_BLOCK()->soft_drop
 		+ (CURRENT_BLOCK()->hard_drop * 2);
 
+	TRACE_END("destroy_lines");
+
 	return destroyed;
 }
 
 /*
  * Remove the currently falling block from the board.
- * NOT THE LINKED LIST. The block still exists in memory. We are literally just
- * erasing the bits from the actual game board. This is used before operating
- * on a game piece(e.g. before rotation or translation).
+ * The block still exists in pgame->cur. We are literally just erasing the
+ * bits from the actual game board. This is used before operating on a game
+ * piece(e.g. before rotation or translation).
  */
 static void unwrite_cur_block(void)
 {
-	struct blocks *block;
+	struct blocks *block = CURRENT_BLOCK();
 	size_t i, x, y;
 
-	if (!CURRENT_BLOCK())
-		return;
-
-	block = CURRENT_BLOCK();
-
 	for (i = 0; i < LEN(block->p); i++) {
 		y = block->row_off + block->p[i].y;
 		x = block->col_off + block->p[i].x;
@@ -376,15 +563,10 @@ static void unwrite_cur_block(void)
  */
 static void write_cur_block(void)
 {
-	struct blocks *block;
+	struct blocks *block = CURRENT_BLOCK();
 	int px[4], py[4];
 	size_t i;
 
-	if (!CURRENT_BLOCK())
-		return;
-
-	block = CURRENT_BLOCK();
-
 	for (i = 0; i < LEN(block->p); i++) {
 		py[i] = block->row_off + block->p[i].y;
 		px[i] = block->col_off + block->p[i].x;
@@ -398,7 +580,9 @@ static void write_cur_block(void)
 	for (i = 0; i < LEN(block->p); i++) {
 		/* Set the bit where the block exists */
 		pgame->spaces[py[i]] |= (1 << px[i]);
-		pgame->colors[py[i]][px[i]] = block->type;
+
+		pgame->colors[py[i]] &= ~(COLOR_MASK << (px[i] * COLOR_BITS));
+		pgame->colors[py[i]] |= block->type << (px[i] * COLOR_BITS);
 	}
 }
 
@@ -410,121 +594,377 @@ static void write_cur_block(void)
 static int drop_block(struct blocks *block)
 {
 	size_t i, bounds_x, bounds_y;
+	int ret = 1;
 
 	if (!pgame || !block)
 		return -1;
 
+	TRACE_BEGIN("drop_block");
+
 	for (i = 0; i < LEN(block->p); i++) {
 		bounds_y = block->p[i].y + block->row_off + 1;
 		bounds_x = block->p[i].x + block->col_off;
 
 		if (bounds_y >= BLOCKS_MAX_ROWS ||
-		    blocks_at_yx(bounds_y, bounds_x))
-			return 0;
+		    blocks_at_yx(bounds_y, bounds_x)) {
+			ret = 0;
+			break;
+		}
 	}
 
-	block->row_off++;
+	if (ret)
+		block->row_off++;
 
-	return 1;
+	TRACE_END("drop_block");
+
+	return ret;
+}
+
+/* Would the block fall a row? Leaves it where it is. */
+static int can_drop(struct blocks *block)
+{
+	int ret = drop_block(block);
+
+	if (ret > 0)
+		block->row_off--;
+
+	return ret;
+}
+
+/*
+ * The block moved or rotated. If it's resting on the stack the lock delay
+ * starts over, but only LOCK_RESETS times per block so it can't be stalled
+ * forever.
+ */
+static void touch_lock(uint64_t now)
+{
+	struct blocks *block = CURRENT_BLOCK();
+
+	if (!pgame->lock_at || block->lock_resets >= LOCK_RESETS)
+		return;
+
+	block->lock_resets++;
+	pgame->lock_at = now + block->lock_delay;
+}
+
+/*
+ * Counterpart of unwrite_cur_block() for the game threads. Writes the block
+ * back to the board, unless its lock delay has run out. Then it becomes part
+ * of the board, we remove full lines and bring in the next block.
+ */
+/* The gauges are for one game, a host with more would mix theirs up */
+static void set_gauges(void)
+{
+	if (phost->many_games)
+		return;
+
+	metrics_set(METRIC_LEVEL, pgame->level);
+	metrics_set(METRIC_SCORE, pgame->score);
+}
+
+static void place_cur_block(uint64_t now)
+{
+	if (pgame->lock_at && !pgame->pause) {
+		/* Slid off a ledge, gravity takes over again */
+		if (can_drop(CURRENT_BLOCK()) > 0) {
+			pgame->lock_at = 0;
+		} else if (now >= pgame->lock_at) {
+			CURRENT_BLOCK()->t_spin = find_t_spin(CURRENT_BLOCK());
+			write_cur_block();
+			metrics_add(METRIC_LINES, destroy_lines());
+			update_cur_block();
+			pgame->lock_at = 0;
+
+			metrics_add(METRIC_PIECES, 1);
+			set_gauges();
+
+			/* The new block isn't on the board yet, a good time
+			 * to take a snapshot */
+			if (!pgame->lose)
+				checkpoint_piece();
+			return;
+		}
+	}
+
+	write_cur_block();
+}
+
+/* Horizontal move, by key or by auto shift */
+static void shift_block(enum blocks_input_cmd cmd, uint64_t now)
+{
+	if (translate_block(CURRENT_BLOCK(), cmd) == 1) {
+		CURRENT_BLOCK()->kick = 0;
+		touch_lock(now);
+	}
+}
+
+static void turn_block(enum blocks_input_cmd cmd, uint64_t now)
+{
+	if (rotate_block(CURRENT_BLOCK(), cmd) == 1)
+		touch_lock(now);
+}
+
+void blocks_host_init(struct blocks_host *host)
+{
+	memset(host, 0, sizeof *host);
+
+	pool_init(&host->games, sizeof(struct blocks_game));
+	pthread_mutex_init(&host->lock, NULL);
+	clock_real_init(&host->real_clock);
+	host->clock = &host->real_clock.clock;
+	host->draw = screen_draw_game;
+}
+
+void blocks_host_destroy(struct blocks_host *host)
+{
+	/* mutex_destroy() is undefined if mutex is locked.
+	 * So try to lock it then unlock it before we destroy it
+	 */
+	pthread_mutex_trylock(&host->lock);
+	pthread_mutex_unlock(&host->lock);
+
+	pthread_mutex_destroy(&host->lock);
+	clock_real_destroy(&host->real_clock);
+	pool_destroy(&host->games);
+}
+
+/* Hold, current, then the next blocks, the order games have always been
+ * dealt in
+ */
+static void deal_blocks(void)
+{
+	size_t i;
+
+	randomize_block(HOLD_BLOCK());
+	randomize_block(CURRENT_BLOCK());
+
+	for (i = 0; i < NEXT_BLOCKS_LEN; i++)
+		pgame->next[i] = deal_block();
 }
 
 /*
  * Setup the game structure for use.
- * Here we create the initial game pieces for the game (5 'next' pieces, plus
- * the current piece and the 'hold' piece(total 7 game pieces).
- * We also allocate memory for the board colors, and set some initial
- * variables.
+ * Here we deal the initial game pieces for the game (5 'next' pieces, plus
+ * the current piece and the 'hold' piece(total 7 game pieces), and set some
+ * initial variables.
  */
 int blocks_init(void)
 {
-	size_t i;
+	debug("Initializing game data");
 
-	log_info("Initializing game data");
-	pgame = calloc(1, sizeof *pgame);
+	/* Zeroed padding too, so snapshots compare byte for byte */
+	pgame = pool_get(&phost->games);
 	if (!pgame) {
 		log_err("Out of memory");
 		exit(EXIT_FAILURE);
 	}
 
-	pthread_mutex_init(&pgame->lock, NULL);
-
 	pgame->level = 1;
 	pgame->nsec = 1E9 - 1;
 	pgame->pause_ticks = 1000;
 
-	LIST_INIT(&pgame->blocks_head);
+	bag_init(&pgame->bag, rand());
+	deal_blocks();
 
-	/* We need a head of the list to properly add new blocks, so manually
-	 * add the head. Then use a loop to add the rest of the starting
-	 * blocks.
-	 */
-	for (i = 0; i < NEXT_BLOCKS_LEN +2; i++) {
-		struct blocks *last, *np = malloc(sizeof *np);
-		if (!np) {
-			log_err("Out of memory");
-			exit(EXIT_FAILURE);
-		}
+	return 1;
+}
 
-		randomize_block(np);
+void blocks_seed(uint32_t seed)
+{
+	bag_init(&pgame->bag, seed);
+	deal_blocks();
+}
 
-		debug("Randomized new block: %d", i);
+void blocks_rotation(enum blocks_rotation rotation)
+{
+	pgame->rotation = rotation;
+}
 
-		/* Manually add the head, then continue adding the others */
-		if (i == 0) {
-			LIST_INSERT_HEAD(&pgame->blocks_head, np, entries);
-			continue;
-		}
+/*
+ * The inverse of the init() function. Give the game back to the pool.
+ */
+int blocks_cleanup()
+{
+	debug("Cleaning game data");
+
+	pool_put(&phost->games, pgame);
+
+	return 1;
+}
+
+/* The save layout must not change behind our back, see blocks.h */
+typedef char blocks_save_size_check[sizeof(struct blocks_save) == 176 ? 1 : -1];
+
+/* FNV-1a */
+static uint32_t checksum(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	return hash;
+}
+
+static uint32_t save_checksum(const struct blocks_save *save)
+{
+	return checksum(save, offsetof(struct blocks_save, checksum));
+}
+
+void blocks_save(struct blocks_save *save)
+{
+	size_t i;
+
+	memset(save, 0, sizeof *save);
+
+	save->magic = BLOCKS_SAVE_MAGIC;
+	save->version = BLOCKS_SAVE_VERSION;
+	save->level = pgame->level;
+	save->score = pgame->score;
+	save->difficult = pgame->difficult;
+	save->bag = pgame->bag;
+	save->lines = pgame->lines_destroyed;
+	memcpy(save->colors, pgame->colors, sizeof save->colors);
+	memcpy(save->spaces, pgame->spaces, sizeof save->spaces);
+
+	/* Blocks in the order they used to be listed in, hold first */
+	save->blocks[0] = HOLD_BLOCK()->type;
+	save->blocks[1] = CURRENT_BLOCK()->type;
+	for (i = 0; i < NEXT_BLOCKS_LEN; i++)
+		save->blocks[i + 2] = pgame->next[i];
 
-		/* Skip to end of list */
-		for (last = HOLD_BLOCK();
-		     last->entries.le_next;
-		     last = last->entries.le_next)
-			;
+	save->hold = HOLD_BLOCK()->hold | CURRENT_BLOCK()->hold << 1;
 
-		LIST_INSERT_AFTER(last, np, entries);
+	save->checksum = save_checksum(save);
+}
+
+int blocks_save_check(const struct blocks_save *save)
+{
+	size_t i;
+
+	if (save->magic != BLOCKS_SAVE_MAGIC ||
+	    save->version != BLOCKS_SAVE_VERSION) {
+		log_warn("Unknown save format (version %d)", save->version);
+		return -1;
 	}
 
-	/* Allocate memory for colors */
-	for (i = 0; i < BLOCKS_MAX_ROWS; i++) {
-		pgame->colors[i] = malloc(BLOCKS_MAX_COLUMNS *
-					  sizeof(*pgame->colors[i]));
-		if (!pgame->colors[i]) {
-			log_err("Out of memory");
-			exit(EXIT_FAILURE);
-		}
+	if (save->checksum != save_checksum(save)) {
+		log_warn("Save is damaged, checksum doesn't match");
+		return -1;
 	}
 
+	/* The checksum only catches accidents */
+	for (i = 0; i < LEN(save->blocks); i++)
+		if (save->blocks[i] >= NUM_BLOCKS)
+			return -1;
+
+	if (save->bag.index >= BAG_LEN)
+		return -1;
+
 	return 1;
 }
 
-/*
- * The inverse of the init() function. Free all allocated memory.
+int blocks_restore(const struct blocks_save *save)
+{
+	size_t i;
+
+	if (blocks_save_check(save) < 0)
+		return -1;
+
+	pgame->level = save->level;
+	pgame->score = save->score;
+	pgame->difficult = save->difficult;
+	pgame->bag = save->bag;
+	pgame->lines_destroyed = save->lines;
+	memcpy(pgame->colors, save->colors, sizeof pgame->colors);
+	memcpy(pgame->spaces, save->spaces, sizeof pgame->spaces);
+
+	blocks_piece(HOLD_BLOCK(), save->blocks[0]);
+	HOLD_BLOCK()->hold = save->hold & 1;
+	blocks_piece(CURRENT_BLOCK(), save->blocks[1]);
+	CURRENT_BLOCK()->hold = (save->hold >> 1) & 1;
+
+	for (i = 0; i < NEXT_BLOCKS_LEN; i++)
+		pgame->next[i] = save->blocks[i + 2];
+
+	pgame->lock_at = 0;
+
+	return 1;
+}
+
+/* memcpy(), not assignment, so the padding comes along and checksums of
+ * equal games are equal
  */
-int blocks_cleanup()
+void blocks_snapshot(struct blocks_snapshot *snap)
 {
-	log_info("Cleaning game data");
+	memcpy(&snap->game, pgame, sizeof snap->game);
+}
 
-	/* mutex_destroy() is undefined if mutex is locked.
-	 * So try to lock it then unlock it before we destroy it
-	 */
-	pthread_mutex_trylock(&pgame->lock);
-	pthread_mutex_unlock(&pgame->lock);
+void blocks_rewind(const struct blocks_snapshot *snap)
+{
+	memcpy(pgame, &snap->game, sizeof snap->game);
+}
+
+uint32_t blocks_snapshot_checksum(const struct blocks_snapshot *snap)
+{
+	return checksum(snap, sizeof *snap);
+}
 
-	pthread_mutex_destroy(&pgame->lock);
+/* Is the falling block on top of anything? Off the board counts. */
+static bool block_collides(struct blocks *block)
+{
+	int x, y;
+	size_t i;
+
+	for (i = 0; i < LEN(block->p); i++) {
+		y = block->row_off + block->p[i].y;
+		x = block->col_off + block->p[i].x;
 
-	/* Remove each piece in the linked list */
-	while (HOLD_BLOCK()) {
-		struct blocks *np = HOLD_BLOCK();
-		LIST_REMOVE(np, entries);
-		free(np);
+		if (y < 0 || y >= BLOCKS_MAX_ROWS || blocks_at_yx(y, x))
+			return true;
 	}
 
-	for (int i = 0; i < BLOCKS_MAX_ROWS; i++)
-		free(pgame->colors[i]);
+	return false;
+}
 
-	free(pgame);
+void blocks_garbage(unsigned rows, unsigned hole)
+{
+	struct blocks *block = CURRENT_BLOCK();
+	uint16_t full_row = (1 << BLOCKS_MAX_COLUMNS) - 1;
+	size_t i;
 
-	return 1;
+	if (!rows)
+		return;
+
+	if (rows > BLOCKS_MAX_ROWS)
+		rows = BLOCKS_MAX_ROWS;
+
+	unwrite_cur_block();
+
+	/* Whatever ends up in the top two rows loses, as in destroy_lines() */
+	for (i = 0; i < rows + 2 && i < BLOCKS_MAX_ROWS; i++)
+		if (pgame->spaces[i])
+			pgame->lose = true;
+
+	memmove(pgame->spaces, pgame->spaces + rows,
+		(BLOCKS_MAX_ROWS - rows) * sizeof *pgame->spaces);
+	memmove(pgame->colors, pgame->colors + rows,
+		(BLOCKS_MAX_ROWS - rows) * sizeof *pgame->colors);
+
+	for (i = BLOCKS_MAX_ROWS - rows; i < BLOCKS_MAX_ROWS; i++) {
+		pgame->spaces[i] = full_row & ~(1 << (hole % BLOCKS_MAX_COLUMNS));
+		pgame->colors[i] = 0;
+	}
+
+	while (block_collides(block) && block->row_off > 0)
+		block->row_off--;
+
+	if (block_collides(block))
+		pgame->lose = true;
+	else
+		write_cur_block();
 }
 
 /*
@@ -533,60 +973,130 @@ int blocks_cleanup()
  */
 
 /*
- * Controls the game gravity, and (attempts to)remove lines when a block
- * reaches the bottom. Indirectly creates new blocks, and updates points,
- * level, etc.
- *
- * Game is over when this function returns.
+ * A single gravity tick, with the current block off the board. Drops the
+ * block by a row, or if it can't fall any further starts its lock delay.
  */
-void *blocks_loop(void *vp)
+static void gravity_tick(uint64_t now)
 {
-	(void) vp; /* unused*/
-
 	int hit;
-	struct timespec ts;
 
-	ts.tv_sec = 0;
-	ts.tv_nsec = 0;
+	if (pgame->pause && pgame->pause_ticks) {
+		pgame->pause_ticks--;
+		return;
+	}
+
+	/* Unpause the game if we're out of pause ticks */
+	pgame->pause = (pgame->pause && pgame->pause_ticks);
+
+	metrics_add(METRIC_TICKS, 1);
+
+	hit = drop_block(CURRENT_BLOCK());
+	if (hit < 0)
+		exit(EXIT_FAILURE);
+	if (hit > 0)
+		CURRENT_BLOCK()->kick = 0;
 
+	if (hit == 0 && !pgame->lock_at)
+		pgame->lock_at = now + CURRENT_BLOCK()->lock_delay;
+}
+
+/* Earliest of the next gravity tick, auto shift and block lock */
+uint64_t blocks_deadline(void)
+{
+	uint64_t deadline = pgame->tick.next, t;
+
+	if (pgame->pause)
+		return deadline;
+
+	t = das_deadline(&pgame->das);
+	if (t && t < deadline)
+		deadline = t;
+
+	if (pgame->lock_at && pgame->lock_at < deadline)
+		deadline = pgame->lock_at;
+
+	return deadline;
+}
+
+void blocks_start(void)
+{
 	/* When we read in from the database, it sets the current level
 	 * for the game. Update the tick delay so we resume at proper
 	 * difficulty.
 	 */
 	update_tick_speed();
+	set_gauges();
 
-	while (1) {
-		ts.tv_nsec = pgame->nsec;
-		nanosleep(&ts, NULL);
+	tick_start(&pgame->tick, game_now(), pgame->nsec);
+}
 
-		if (pgame->lose || pgame->quit)
-			break;
+/*
+ * Controls the game gravity, auto shift and lock delay. Removes lines when a
+ * block locks. Indirectly creates new blocks, and updates points, level, etc.
+ *
+ * Ticks are scheduled against absolute deadlines, so drawing and lock waits
+ * don't slow the game down. If we fall behind we run the missed ticks in one
+ * go before drawing.
+ */
+void blocks_step(uint64_t now)
+{
+	unsigned due, shifts;
 
-		pthread_mutex_lock(&pgame->lock);
+	due = tick_due(&pgame->tick, &phost->ticks, now, pgame->nsec);
+	shifts = das_update(&pgame->das, now);
 
-		if (pgame->pause && pgame->pause_ticks) {
-			pgame->pause_ticks--;
-			goto draw_game;
-		}
+	if (pgame->pause)
+		shifts = 0;
 
-		/* Unpause the game if we're out of pause ticks */
-		pgame->pause = (pgame->pause && pgame->pause_ticks);
+	/* Woken early, nothing to do yet */
+	if (!due && !shifts &&
+	    !(pgame->lock_at && now >= pgame->lock_at && !pgame->pause))
+		return;
 
-		unwrite_cur_block();
-		hit = drop_block(CURRENT_BLOCK());
-		write_cur_block();
+	TRACE_BEGIN("frame");
 
-		if (hit == 0) {
-			destroy_lines();
-			update_cur_block();
-		} else if (hit < 0) {
-			exit(EXIT_FAILURE);
-		}
+	unwrite_cur_block();
+
+	while (shifts-- > 0)
+		shift_block(pgame->das.dir < 0 ? MOVE_LEFT : MOVE_RIGHT, now);
+
+	while (due-- > 0)
+		gravity_tick(now);
+
+	place_cur_block(now);
+
+	draw_game();
 
-		draw_game:
+	TRACE_END("frame");
+}
 
-		screen_draw_game();
-		pthread_mutex_unlock(&pgame->lock);
+/*
+ * Runs the game on its clock. In between steps we sleep until the earliest
+ * deadline; the input thread wakes us when it moves one.
+ *
+ * Game is over when this function returns.
+ */
+void *blocks_loop(void *vp)
+{
+	(void) vp; /* unused*/
+
+	game_lock(&phost->loop_lock);
+
+	blocks_start();
+
+	while (1) {
+		/* Includes taking the lock back when we wake */
+		TRACE_BEGIN("sleep");
+		lock_stats_release(&phost->loop_lock);
+		phost->clock->sleep(phost->clock, &phost->lock,
+				    blocks_deadline());
+		lock_stats_resumed(&phost->loop_lock);
+		TRACE_END("sleep");
+
+		if (pgame->lose || pgame->quit)
+			break;
+
+		blocks_step(game_now());
 	}
 
 	/* remove the current piece from the board, when we write to the
@@ -594,15 +1104,27 @@ void *blocks_loop(void *vp)
 	 * We can't restore from blocks like that, so just remove it.
 	 */
 	unwrite_cur_block();
+	game_unlock(&phost->loop_lock);
+
+	tick_log_stats(&phost->ticks);
+
+	/* Input thread's numbers are as of now, it may still be going */
+	hist_log(&phost->loop_lock.wait, "Lock wait, game loop");
+	hist_log(&phost->loop_lock.hold, "Lock hold, game loop");
+	hist_log(&phost->input_lock.wait, "Lock wait, input");
+	hist_log(&phost->input_lock.hold, "Lock hold, input");
+	hist_log(&phost->input_latency, "Key to screen");
 
 	return NULL;
 }
 
 /*
- * User input. Hopefully self explanatory.
+ * Apply a single key to the game. Must be called with the lock held and the
+ * current block removed from the board.
  *
  * Input keys are currently:
  * 	F1 pause
+ * 	F2 latency stats
  * 	F3 quit
  *
  * 	wasdqe
@@ -613,100 +1135,179 @@ void *blocks_loop(void *vp)
  *
  * 	- space is used to hold the currently falling block.
  */
-void *blocks_input(void *vp)
+static void apply_key(int ch, uint64_t now)
 {
-	(void) vp; /* unused */
-	
-	int ch;
-
-	if (!CURRENT_BLOCK())
-		return NULL;
+	switch (ch) {
+	case KEY_F(1):
+		pgame->pause = !pgame->pause;
+		return;
+	case KEY_F(2):
+		phost->show_stats = !phost->show_stats;
+		return;
+	case KEY_F(3):
+		pgame->pause = false;
+		pgame->quit = true;
+		return;
+	}
 
-	while ((ch = getch())) {
-		/* prevent modification of the game from blocks_loop in the
-		 * other thread */
-		pthread_mutex_lock(&pgame->lock);
-
-		switch (ch) {
-		case KEY_F(1):
-			pgame->pause = !pgame->pause;
-			goto draw_game;
-		case KEY_F(3):
-			pgame->pause = false;
-			pgame->quit = true;
-			goto draw_game;
+	switch (ch < 0x80 ? toupper(ch) : ch) {
+	case 'A':
+		shift_block(MOVE_LEFT, now);
+		break;
+	case 'D':
+		shift_block(MOVE_RIGHT, now);
+		break;
+	case 'S':
+		if (drop_block(CURRENT_BLOCK()) > 0) {
+			CURRENT_BLOCK()->soft_drop++;
+			CURRENT_BLOCK()->kick = 0;
+		}
+		break;
+	case 'W':
+		/* drop the block to the bottom of the game, and lock it
+		 * right away */
+		while (drop_block(CURRENT_BLOCK()) > 0) {
+			CURRENT_BLOCK()->hard_drop++;
+			CURRENT_BLOCK()->kick = 0;
 		}
 
-		/* remove the current piece from the board */
-		unwrite_cur_block();
+		CURRENT_BLOCK()->lock_delay = 0;
+		pgame->lock_at = now;
+		break;
+	case 'Q':
+		turn_block(ROT_LEFT, now);
+		break;
+	case 'E':
+		turn_block(ROT_RIGHT, now);
+		break;
+	case ' ': {
+		struct blocks tmp;
 
-		/* modify it */
-		switch (toupper(ch)) {
-		case 'A':
-			translate_block(CURRENT_BLOCK(), MOVE_LEFT);
-			break;
-		case 'D':
-			translate_block(CURRENT_BLOCK(), MOVE_RIGHT);
-			break;
-		case 'S':
-			if (drop_block(CURRENT_BLOCK()))
-				CURRENT_BLOCK()->soft_drop++;
-			else
-				CURRENT_BLOCK()->lock_delay = 1E9 -1;
+		/* We can hold each block exactly once */
+		if (CURRENT_BLOCK()->hold == true)
 			break;
-		case 'W':
-			/* drop the block to the bottom of the game */
-			while (drop_block(CURRENT_BLOCK()))
-				CURRENT_BLOCK()->hard_drop++;
 
-			/* XXX */
-			CURRENT_BLOCK()->lock_delay = 1E9 -1;
-			break;
-		case 'Q':
-			if (!rotate_block(CURRENT_BLOCK(), ROT_LEFT))
-			{
-				try_wall_kick(CURRENT_BLOCK(), ROT_LEFT);
-			}
-			break;
-		case 'E':
-			if (!rotate_block(CURRENT_BLOCK(), ROT_RIGHT))
-			{
-				try_wall_kick(CURRENT_BLOCK(), ROT_RIGHT);
-			}
-			break;
-		case ' ': {
-			struct blocks *tmp;
+		/* Swap the current and the hold block */
+		tmp = *CURRENT_BLOCK();
+		*CURRENT_BLOCK() = *HOLD_BLOCK();
+		*HOLD_BLOCK() = tmp;
 
-			/* We can hold each block exactly once */
-			if (CURRENT_BLOCK()->hold == true)
-				break;
+		reset_block(HOLD_BLOCK());
+		HOLD_BLOCK()->hold = true;
 
-			tmp = CURRENT_BLOCK();
+		/* The block coming out of hold starts in the air */
+		pgame->lock_at = 0;
 
-			/* Effectively swap the first and second elements in
-			 * the linked list. The "Current Block" is element 2.
-			 * And the "Hold Block" is element 1. So we remove the
-			 * current block and reinstall it at the head, pushing
-			 * the hold block to the current position.
-			 */
-			LIST_REMOVE(tmp, entries);
-			LIST_INSERT_HEAD(&pgame->blocks_head, tmp, entries);
+		break;
+		}
+	}
+}
 
-			reset_block(HOLD_BLOCK());
-			HOLD_BLOCK()->hold = true;
+/*
+ * Terminals that report key releases let us time a held left/right
+ * ourselves: the first press moves once, then DAS_DELAY/DAS_REPEAT take over
+ * and the terminal's own key repeat is ignored. Everywhere else each key is a
+ * plain press, as it always was.
+ */
+static void apply_event(int key, bool events, uint64_t now)
+{
+	int ch = INPUT_KEY(key), dir = 0;
 
-			break;
-			}
-		}
+	if (ch == 'a' || ch == 'A')
+		dir = -1;
+	else if (ch == 'd' || ch == 'D')
+		dir = 1;
 
-		/* then rewrite it */
-		write_cur_block();
+	if (key & INPUT_RELEASE) {
+		if (dir)
+			das_release(&pgame->das, dir, now);
+		return;
+	}
+
+	if (dir && events) {
+		if (key & INPUT_REPEAT)
+			return;
+
+		das_press(&pgame->das, dir, now);
+	}
+
+	apply_key(ch, now);
+}
+
+/* blocks_keys() for keys we read at @read_at (stats_now() time) */
+static void apply_keys(const int *keys, size_t n, bool events,
+		       uint64_t read_at)
+{
+	uint64_t now, drawn;
+	size_t i;
+
+	/* prevent modification of the game from blocks_loop in the
+	 * other thread */
+	game_lock(&phost->input_lock);
+
+	TRACE_BEGIN("keys");
 
-		draw_game:
+	now = game_now();
 
-		screen_draw_game();
-		pthread_mutex_unlock(&pgame->lock);
+	/* remove the current piece from the board, modify it, then
+	 * rewrite it */
+	unwrite_cur_block();
+
+	for (i = 0; i < n; i++)
+		apply_event(keys[i], events, now);
+
+	place_cur_block(now);
+
+	draw_game();
+
+	if (phost->draw) {
+		drawn = stats_now();
+		for (i = 0; i < n; i++)
+			hist_record(&phost->input_latency, drawn - read_at);
 	}
 
+	/* We may have moved a deadline (auto shift, lock delay) */
+	phost->clock->wake(phost->clock);
+
+	TRACE_END("keys");
+	game_unlock(&phost->input_lock);
+}
+
+void blocks_keys(const int *keys, size_t n, bool events)
+{
+	apply_keys(keys, n, events, stats_now());
+}
+
+/*
+ * User input. We read every key the terminal has waiting, then apply them
+ * all under one lock and draw once. Fast sequences (finesse, a held 'a' or
+ * 'd') cost one read(2) and one redraw instead of one per key.
+ */
+void *blocks_input(void *vp)
+{
+	/* pgame and phost are per thread, this is the game we play */
+	phost = vp;
+	pgame = phost->game;
+
+	struct input in;
+	int keys[INPUT_BUF_LEN];
+	ssize_t n;
+
+	if (!pgame)
+		return NULL;
+
+	input_init(&in, fileno(stdin));
+	input_events_enable(fileno(stdout));
+
+	/* Latency counts from the moment read(2) hands us the keys */
+	while ((n = input_read(&in, keys, LEN(keys))) > 0)
+		apply_keys(keys, n, in.events, stats_now());
+
+	/* Lost our terminal, quit so the game is saved */
+	game_lock(&phost->input_lock);
+	pgame->quit = true;
+	phost->clock->wake(phost->clock);
+	game_unlock(&phost->input_lock);
+
 	return NULL;
 }
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broadcast.h"
+#include "debug.h"
+
+/*
+ * Frames
+ */
+
+static struct bcast_frame *frame_new(const uint8_t *buf, size_t len)
+{
+	struct bcast_frame *f;
+
+	if (!(f = malloc(sizeof *f + len)))
+		return NULL;
+
+	f->refs = 1;
+	f->len = len;
+	memcpy(f->data, buf, len);
+
+	return f;
+}
+
+void bcast_frame_ref(struct bcast_frame *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void bcast_frame_unref(struct bcast_frame *f)
+{
+	if (f && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(f);
+}
+
+/*
+ * Channels
+ */
+
+struct bcast_channel *bcast_channel_new(void)
+{
+	struct bcast_channel *ch;
+
+	if (!(ch = calloc(1, sizeof *ch))) {
+		log_err("Out of memory");
+		return NULL;
+	}
+
+	ch->refs = 1;
+	pthread_mutex_init(&ch->lock, NULL);
+
+	return ch;
+}
+
+void bcast_channel_ref(struct bcast_channel *ch)
+{
+	__atomic_add_fetch(&ch->refs, 1, __ATOMIC_RELAXED);
+}
+
+void bcast_channel_unref(struct bcast_channel *ch)
+{
+	size_t i;
+
+	if (__atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 0; i < BCAST_BACKLOG; i++) {
+		bcast_frame_unref(ch->ring[i].delta);
+		bcast_frame_unref(ch->ring[i].key);
+	}
+
+	pthread_mutex_destroy(&ch->lock);
+	free(ch);
+}
+
+bool bcast_channel_alone(struct bcast_channel *ch)
+{
+	return __atomic_load_n(&ch->refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+uint64_t bcast_publish(struct bcast_channel *ch, const struct wire_state *now)
+{
+	struct bcast_frame *delta, *key, *old_delta, *old_key;
+	uint8_t buf[WIRE_FRAME_MAX];
+	uint64_t wake;
+	size_t len, slot;
+
+	/* Only we touch ->state, the lock is just for the ring */
+	if (!(len = wire_encode(buf, &ch->state, now)))
+		return 0;
+
+	delta = frame_new(buf, len);
+	len = wire_encode_key(buf, &ch->state);
+	key = frame_new(buf, len);
+
+	/* Spectators can't do without a frame, start them over */
+	if (!delta || !key) {
+		log_err("Out of memory");
+		bcast_frame_unref(delta);
+		bcast_frame_unref(key);
+		delta = NULL;
+		key = NULL;
+	}
+
+	pthread_mutex_lock(&ch->lock);
+
+	slot = ch->seq++ % BCAST_BACKLOG;
+	old_delta = ch->ring[slot].delta;
+	old_key = ch->ring[slot].key;
+	ch->ring[slot].delta = delta;
+	ch->ring[slot].key = key;
+	wake = ch->subscribers;
+
+	pthread_mutex_unlock(&ch->lock);
+
+	bcast_frame_unref(old_delta);
+	bcast_frame_unref(old_key);
+
+	return wake;
+}
+
+uint64_t bcast_close(struct bcast_channel *ch)
+{
+	uint64_t wake;
+
+	pthread_mutex_lock(&ch->lock);
+	ch->over = true;
+	wake = ch->subscribers;
+	pthread_mutex_unlock(&ch->lock);
+
+	return wake;
+}
+
+void bcast_subscribe(struct bcast_channel *ch, unsigned bit)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->subscribers |= UINT64_C(1) << bit;
+	pthread_mutex_unlock(&ch->lock);
+}
+
+void bcast_unsubscribe(struct bcast_channel *ch, unsigned bit)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->subscribers &= ~(UINT64_C(1) << bit);
+	pthread_mutex_unlock(&ch->lock);
+}
+
+void bcast_catchup(struct bcast_channel *ch, uint64_t *seq,
+		   struct bcast_catchup *c)
+{
+	struct bcast_frame *f;
+	uint64_t i;
+
+	c->n = 0;
+	c->key = NULL;
+	c->skipped = false;
+
+	pthread_mutex_lock(&ch->lock);
+
+	c->over = ch->over;
+
+	if (*seq == ch->seq) {
+		pthread_mutex_unlock(&ch->lock);
+		return;
+	}
+
+	/* A hole from running out of memory is as good as a gap */
+	c->skipped = ch->seq - *seq > BCAST_BACKLOG;
+	for (i = *seq; i < ch->seq && !c->skipped; i++) {
+		if (!(f = ch->ring[i % BCAST_BACKLOG].delta)) {
+			c->skipped = true;
+			break;
+		}
+		bcast_frame_ref(f);
+		c->deltas[c->n++] = f;
+	}
+
+	if ((c->key = ch->ring[(ch->seq - 1) % BCAST_BACKLOG].key))
+		bcast_frame_ref(c->key);
+
+	*seq = ch->seq;
+
+	pthread_mutex_unlock(&ch->lock);
+
+	if (c->skipped)
+		bcast_catchup_done(c);
+}
+
+void bcast_catchup_done(struct bcast_catchup *c)
+{
+	while (c->n)
+		bcast_frame_unref(c->deltas[--c->n]);
+}
+
+/*
+ * Send queues
+ */
+
+int bcast_queue_push(struct bcast_queue *q, struct bcast_frame *f)
+{
+	if (q->len == BCAST_QUEUE_LEN)
+		return -1;
+
+	bcast_frame_ref(f);
+	q->frames[(q->head + q->len++) % BCAST_QUEUE_LEN] = f;
+
+	return 1;
+}
+
+size_t bcast_queue_resync(struct bcast_queue *q, struct bcast_frame *key)
+{
+	size_t keep = q->off ? 1 : 0, dropped = q->len - keep;
+
+	/* Half a frame out has to be finished, or the stream is garbage */
+	while (q->len > keep) {
+		q->len--;
+		bcast_frame_unref(q->frames[(q->head + q->len) %
+					    BCAST_QUEUE_LEN]);
+	}
+
+	if (key)
+		bcast_queue_push(q, key);
+
+	return dropped;
+}
+
+int bcast_queue_send(struct bcast_queue *q, int fd, size_t *sent)
+{
+	struct iovec iov[BCAST_QUEUE_LEN];
+	struct msghdr msg = { .msg_iov = iov };
+	struct bcast_frame *f;
+	ssize_t n;
+	size_t i;
+
+	if (!q->len)
+		return 1;
+
+	for (i = 0; i < q->len; i++) {
+		f = q->frames[(q->head + i) % BCAST_QUEUE_LEN];
+		iov[i].iov_base = f->data + (i ? 0 : q->off);
+		iov[i].iov_len = f->len - (i ? 0 : q->off);
+	}
+	msg.msg_iovlen = q->len;
+
+	n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	*sent += n;
+
+	/* Done with whole frames, partway into the next */
+	n += q->off;
+	while (q->len && n >= (f = q->frames[q->head])->len) {
+		n -= f->len;
+		bcast_frame_unref(f);
+		q->head = (q->head + 1) % BCAST_QUEUE_LEN;
+		q->len--;
+	}
+	q->off = n;
+
+	return !q->len;
+}
+
+void bcast_queue_clear(struct bcast_queue *q)
+{
+	while (q->len) {
+		bcast_frame_unref(q->frames[q->head]);
+		q->head = (q->head + 1) % BCAST_QUEUE_LEN;
+		q->len--;
+	}
+	q->off = 0;
+}
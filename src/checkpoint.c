@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <bsd/string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "debug.h"
+
+/*
+ * Crash-safe game state. The database only hears about a game when it's
+ * over, a crash or a dropped ssh session before that would lose it. So
+ * every few pieces we copy the game into a shared mapping of a small file.
+ * The kernel owns those pages: if we're killed they still make it to the
+ * file, without a write(2) or fsync(2) in the game loop.
+ */
+
+#define CHECKPOINT_SLOTS 2
+
+static struct {
+	struct checkpoint_slot *slot;	/* CHECKPOINT_SLOTS of them, mmap'd */
+	uint64_t seq;			/* newest written */
+	unsigned pieces;		/* since the last checkpoint */
+	char game_slot[16];
+} cp;
+
+static const size_t checkpoint_len = CHECKPOINT_SLOTS *
+				     sizeof(struct checkpoint_slot);
+
+/* Newest slot with a good save, NULL if none */
+static struct checkpoint_slot *newest(void)
+{
+	struct checkpoint_slot *best = NULL;
+	size_t i;
+
+	for (i = 0; i < CHECKPOINT_SLOTS; i++) {
+		if (!cp.slot[i].seq || (best && best->seq > cp.slot[i].seq))
+			continue;
+
+		if (blocks_save_check(&cp.slot[i].save) > 0)
+			best = &cp.slot[i];
+	}
+
+	return best;
+}
+
+int checkpoint_open(const char *path, const char *game_slot)
+{
+	struct checkpoint_slot *slot;
+	void *map;
+	int fd;
+
+	if (cp.slot)
+		return 1;
+
+	fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		log_err("Cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	/* New files are all zeros, two empty slots */
+	if (ftruncate(fd, checkpoint_len) < 0) {
+		log_err("Cannot size %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, checkpoint_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		log_err("Cannot map %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	cp.slot = map;
+	cp.pieces = 0;
+
+	/* A game in another save slot never ended either. It's not ours to
+	 * resume, or to write over.
+	 */
+	slot = newest();
+	if (slot && strncmp(slot->game_slot, game_slot,
+			    sizeof slot->game_slot)) {
+		log_warn("%s has a game for slot \"%.*s\", not checkpointing",
+			 path, (int) sizeof slot->game_slot, slot->game_slot);
+		munmap(cp.slot, checkpoint_len);
+		cp.slot = NULL;
+		return -1;
+	}
+
+	strlcpy(cp.game_slot, game_slot, sizeof cp.game_slot);
+	cp.seq = slot ? slot->seq : 0;
+
+	return 1;
+}
+
+int checkpoint_recover(void)
+{
+	struct checkpoint_slot *slot;
+
+	if (!cp.slot || !(slot = newest()) ||
+	    strncmp(slot->game_slot, cp.game_slot, sizeof cp.game_slot))
+		return -1;
+
+	log_info("Recovering game from checkpoint %llu",
+		 (unsigned long long) slot->seq);
+
+	return blocks_restore(&slot->save);
+}
+
+void checkpoint_piece(void)
+{
+	struct checkpoint_slot *slot;
+
+	if (!cp.slot || ++cp.pieces < CHECKPOINT_PIECES)
+		return;
+
+	cp.pieces = 0;
+
+	/* Overwrite the older slot. The save goes straight into the mapping,
+	 * then seq says it's there. The release store keeps the compiler
+	 * from publishing seq before the save.
+	 */
+	slot = &cp.slot[(cp.seq + 1) % CHECKPOINT_SLOTS];
+	memcpy(slot->game_slot, cp.game_slot, sizeof slot->game_slot);
+	blocks_save(&slot->save);
+	__atomic_store_n(&slot->seq, ++cp.seq, __ATOMIC_RELEASE);
+}
+
+void checkpoint_close(bool clear)
+{
+	if (!cp.slot)
+		return;
+
+	if (clear) {
+		memset(cp.slot, 0, checkpoint_len);
+		msync(cp.slot, checkpoint_len, MS_SYNC);
+	}
+
+	munmap(cp.slot, checkpoint_len);
+	cp.slot = NULL;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <time.h>
+
+#include "clock.h"
+
+/*
+ * Real time
+ */
+
+static uint64_t real_now(struct blocks_clock *clock)
+{
+	struct timespec ts;
+
+	(void) clock; /* unused */
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Absolute deadline, so time spent between sleeps doesn't add up */
+static void real_sleep(struct blocks_clock *clock, pthread_mutex_t *lock,
+		       uint64_t deadline)
+{
+	struct clock_real *real = (struct clock_real *) clock;
+	struct timespec ts;
+
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+	pthread_cond_timedwait(&real->cond, lock, &ts);
+}
+
+static void real_wake(struct blocks_clock *clock)
+{
+	struct clock_real *real = (struct clock_real *) clock;
+
+	pthread_cond_signal(&real->cond);
+}
+
+void clock_real_init(struct clock_real *real)
+{
+	pthread_condattr_t attr;
+
+	real->clock.now = real_now;
+	real->clock.sleep = real_sleep;
+	real->clock.wake = real_wake;
+
+	/* Time out against CLOCK_MONOTONIC, not the wall clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&real->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void clock_real_destroy(struct clock_real *real)
+{
+	pthread_cond_destroy(&real->cond);
+}
+
+/*
+ * Virtual time
+ */
+
+static uint64_t virtual_now(struct blocks_clock *clock)
+{
+	return ((struct clock_virtual *) clock)->now;
+}
+
+static void virtual_sleep(struct blocks_clock *clock, pthread_mutex_t *lock,
+			  uint64_t deadline)
+{
+	struct clock_virtual *virt = (struct clock_virtual *) clock;
+
+	if (virt->idle) {
+		pthread_mutex_unlock(lock);
+		virt->idle(virt, deadline);
+		pthread_mutex_lock(lock);
+	}
+
+	/* New input may have moved the deadline up, let the caller look
+	 * again before we skip ahead.
+	 */
+	if (virt->woken) {
+		virt->woken = false;
+		return;
+	}
+
+	if (deadline > virt->now)
+		virt->now = deadline;
+}
+
+static void virtual_wake(struct blocks_clock *clock)
+{
+	((struct clock_virtual *) clock)->woken = true;
+}
+
+void clock_virtual_init(struct clock_virtual *virt, uint64_t start)
+{
+	virt->clock.now = virtual_now;
+	virt->clock.sleep = virtual_sleep;
+	virt->clock.wake = virtual_wake;
+
+	virt->now = start;
+	virt->woken = false;
+	virt->idle = NULL;
+	virt->arg = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "das.h"
+
+void das_press(struct das *das, int dir, uint64_t now)
+{
+	if (dir < 0)
+		das->left = true;
+	else
+		das->right = true;
+
+	/* Last key pressed wins, and has to charge from scratch */
+	das->dir = dir;
+	das->next = now + DAS_DELAY;
+}
+
+void das_release(struct das *das, int dir, uint64_t now)
+{
+	if (dir < 0)
+		das->left = false;
+	else
+		das->right = false;
+
+	if (das->dir != dir)
+		return;
+
+	das->dir = 0;
+	das->next = 0;
+
+	/* Fall back to the other key if it's still held */
+	if (das->left)
+		das_press(das, -1, now);
+	else if (das->right)
+		das_press(das, 1, now);
+}
+
+unsigned das_update(struct das *das, uint64_t now)
+{
+	uint64_t n;
+
+	if (!das->dir || now < das->next)
+		return 0;
+
+	n = 1 + (now - das->next) / DAS_REPEAT;
+	das->next += n * DAS_REPEAT;
+
+	return n > DAS_MAX_SHIFTS ? DAS_MAX_SHIFTS : n;
+}
+
+uint64_t das_deadline(const struct das *das)
+{
+	return das->dir ? das->next : 0;
+}
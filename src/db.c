@@ -17,59 +17,156 @@
  */
 
 #include <bsd/string.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 #include <time.h>
 #include <sqlite3.h>
 
 #include "db.h"
 #include "debug.h"
 #include "blocks.h"
+#include "metrics.h"
+#include "stats.h"
 
 static struct db_info save;
 struct db_info *psave = &save;
 
-/* Scores: name, level, score, date */
-const char create_scores[] =
-	"CREATE TABLE Scores(name TEXT,level INT,score INT,date INT);";
-
-const char insert_scores[] =
-	"INSERT INTO Scores VALUES(\"%s\",%d,%d,%lu);";
-
-const char select_scores[] =
-	"SELECT * FROM Scores ORDER BY score DESC;";
-
-/* State: name, score, lines, level, date, spaces */
-const char create_state[] =
-	"CREATE TABLE State(name TEXT,score INT,lines INT,level INT,"
-	"date INT,spaces BLOB);";
-
-const char insert_state[] =
-	"INSERT INTO State VALUES(\"%s\",%d,%d,%d,%lu,?);";
-
-const char select_state[] =
-	"SELECT * FROM State ORDER BY date DESC;";
-
-/* Find the entry we just pulled from the database.
- * There's probably a simpler way than using two SELECT calls, but I'm a total
- * SQL noob, so ... */
-const char select_state_rowid[] =
-	"SELECT ROWID,date FROM State ORDER BY date DESC;";
-
-/* Remove the entry pulled from the database. This lets us have multiple saves
- * in the database concurently.
+/* Every statement we run, prepared once when the database is opened and
+ * kept for the life of the process. Index with enum db_stmt.
  */
-const char delete_state_rowid[] =
-	"DELETE FROM State WHERE ROWID = ?;";
-
-#define db_close() do { \
-	log_info("Closing database %s", psave->file_loc); \
-	sqlite3_close(psave->db); \
-	} while (0)
+enum db_stmt {
+	BEGIN,
+	COMMIT,
+	INSERT_SCORES,
+	SELECT_SCORES,
+	SELECT_SCORES_AFTER,
+	SELECT_BEST,
+	FIND_SCORE,
+	INSERT_STATE,
+	TAKE_STATE,
+	DB_STMT_LEN,
+};
+
+/* Run once per connection. WAL lets readers and the writer overlap, and with
+ * it synchronous=NORMAL only syncs at checkpoints, not on every commit.
+ */
+static const char db_setup[] =
+	"PRAGMA journal_mode=WAL;"
+	"PRAGMA synchronous=NORMAL;"
+	DB_SCORES_TABLE
+	DB_SCORES_INDEXES
+	/* Saves: name, slot, date, state (struct blocks_save). Replaces the
+	 * old State table, which didn't keep enough to carry on a game.
+	 */
+	"CREATE TABLE IF NOT EXISTS Saves(name TEXT,slot TEXT,date INT,"
+	"state BLOB);"
+	"CREATE INDEX IF NOT EXISTS SavesBySlot ON Saves(name,slot,date);";
+
+static const char *db_sql[DB_STMT_LEN] = {
+	[BEGIN] =
+		"BEGIN;",
+
+	[COMMIT] =
+		"COMMIT;",
+
+	[INSERT_SCORES] =
+		DB_INSERT_SCORE,
+
+	/* Leaderboard pages. Each page starts after the last row of the one
+	 * before (keyset pagination), so deep pages cost the same as the
+	 * first: a walk down ScoresByScore, no sort, no OFFSET.
+	 */
+	[SELECT_SCORES] =
+		"SELECT ROWID,name,level,score,date FROM Scores "
+		"ORDER BY score DESC,ROWID DESC LIMIT ?;",
+
+	[SELECT_SCORES_AFTER] =
+		"SELECT ROWID,name,level,score,date FROM Scores "
+		"WHERE (score,ROWID) < (?,?) "
+		"ORDER BY score DESC,ROWID DESC LIMIT ?;",
+
+	[SELECT_BEST] =
+		"SELECT ROWID,name,level,score,date FROM Scores WHERE name = ? "
+		"ORDER BY score DESC,ROWID DESC LIMIT 1;",
+
+	/* Where a row saved as pending ended up, by ScoresByName */
+	[FIND_SCORE] =
+		"SELECT ROWID FROM Scores WHERE name = ? AND score = ? "
+		"AND date = ? ORDER BY ROWID DESC LIMIT 1;",
+
+	[INSERT_STATE] =
+		"INSERT INTO Saves VALUES(?,?,?,?);",
+
+	/* Pull the newest save out of a player's slot: one seek down
+	 * SavesBySlot finds it, and it's gone once we have it. Older saves
+	 * in the slot are next in line.
+	 */
+	[TAKE_STATE] =
+		"DELETE FROM Saves WHERE ROWID = (SELECT ROWID FROM Saves "
+		"WHERE name = ? AND slot = ? "
+		"ORDER BY date DESC,ROWID DESC LIMIT 1) "
+		"RETURNING ROWID,state;",
+};
+
+static sqlite3_stmt *db_stmts[DB_STMT_LEN];
+
+/* Held while using the connection. Only db_worker() writes, but the game
+ * may read a save back at startup.
+ */
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A score or a game save on its way to the database */
+struct db_record {
+	enum { RECORD_SCORE, RECORD_STATE } type;
+	char id[16];
+	char slot[16];
+	uint16_t level;
+	uint32_t score;
+	time_t date;
+	struct blocks_save save;	/* RECORD_STATE, written as is */
+};
+
+/* Write-behind queue. The game hands records over and moves on,
+ * db_worker() writes them out in batches, one transaction per batch.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t more;		/* records waiting */
+	pthread_cond_t room;		/* space freed up */
+	struct db_record rec[DB_QUEUE_LEN];
+	size_t head, len;
+	bool running, stop;
+	bool failed;			/* a record didn't make it */
+	pthread_t thread;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.more = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+};
+
+/* The first page of the leaderboard, in leaderboard order. Read once at
+ * startup and kept up to date as scores are saved, so it never waits on the
+ * disk.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct db_score top[DB_TOP_LEN];
+	size_t len;
+} board = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 static int db_open(void)
 {
+	char *errmsg = NULL;
 	int status;
+	size_t i;
+
+	if (psave->db)
+		return 1;
 
 	if (!psave->file_loc)
 		return -1;
@@ -79,213 +176,520 @@ static int db_open(void)
 	status = sqlite3_open(psave->file_loc, &psave->db);
 	if (status != SQLITE_OK) {
 		log_err("DB cannot be opened. Error occured (%d)", status);
-		return -1;
+		goto error;
+	}
+
+	/* Make sure the db has the proper tables */
+	status = sqlite3_exec(psave->db, db_setup, NULL, NULL, &errmsg);
+	if (status != SQLITE_OK) {
+		log_err("DB setup failed: %s", errmsg);
+		sqlite3_free(errmsg);
+		goto error;
+	}
+
+	for (i = 0; i < DB_STMT_LEN; i++) {
+		status = sqlite3_prepare_v2(psave->db, db_sql[i], -1,
+					    &db_stmts[i], NULL);
+		if (status != SQLITE_OK) {
+			log_err("Unable to prepare \"%s\": %s", db_sql[i],
+				sqlite3_errmsg(psave->db));
+			goto error;
+		}
 	}
 
 	return 1;
+
+ error:
+	for (i = 0; i < DB_STMT_LEN; i++) {
+		sqlite3_finalize(db_stmts[i]);
+		db_stmts[i] = NULL;
+	}
+
+	sqlite3_close(psave->db);
+	psave->db = NULL;
+
+	return -1;
 }
 
-int db_save_score(void)
+/* Prepared statement @id, ready to bind and step. NULL if the database
+ * isn't open.
+ */
+static sqlite3_stmt *db_stmt(enum db_stmt id)
 {
-	sqlite3_stmt *stmt;
-	char *insert = NULL;
-	int len = -1;
+	if (!psave->db)
+		return NULL;
 
-	if (!psave->id || pgame->score == 0)
-		return 0;
+	return db_stmts[id];
+}
 
-	log_info("Trying to insert scores to database");
+/* Done with a statement, make it ready for next time */
+static void db_done(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
 
-	if (db_open() < 0)
-		return -1;
+/* Step a statement that returns no rows */
+static int db_exec(enum db_stmt id)
+{
+	sqlite3_stmt *stmt = db_stmts[id];
+	int ret = 1;
 
-	/* Make sure the db has the proper tables */
-	sqlite3_prepare_v2(psave->db, create_scores,
-			   sizeof create_scores, &stmt, NULL);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_err("\"%s\" failed: %s", db_sql[id],
+			sqlite3_errmsg(psave->db));
+		ret = -1;
+	}
 
-	len = asprintf(&insert, insert_scores,
-			   psave->id, pgame->level, pgame->score,
-			   (uint64_t) time(NULL));
+	db_done(stmt);
 
-	if (len < 0) {
-		log_err("Out of memory");
-	} else {
-		sqlite3_prepare_v2(psave->db, insert, strlen(insert),
-				   &stmt, NULL);
-		free(insert);
-		sqlite3_step(stmt);
-		sqlite3_finalize(stmt);
+	return ret;
+}
+
+/* Leaderboard order: higher score first, then newer (higher ROWID) */
+static bool ranks_above(const struct db_score *a, const struct db_score *b)
+{
+	return a->score > b->score ||
+		(a->score == b->score && a->rowid > b->rowid);
+}
+
+/* Add a score to the cached leaderboard, if it makes the cut */
+static void board_insert(const struct db_score *res)
+{
+	size_t i;
+
+	pthread_mutex_lock(&board.lock);
+
+	for (i = board.len; i > 0 && ranks_above(res, &board.top[i - 1]); i--)
+		if (i < DB_TOP_LEN)
+			board.top[i] = board.top[i - 1];
+
+	if (i < DB_TOP_LEN) {
+		board.top[i] = *res;
+		if (board.len < DB_TOP_LEN)
+			board.len++;
 	}
 
-	db_close();
+	pthread_mutex_unlock(&board.lock);
+}
+
+/* A queued score made it to disk, give its cached copy the real ROWID */
+static void board_written(const struct db_record *rec, int64_t rowid)
+{
+	size_t i;
 
-	return 1;
+	pthread_mutex_lock(&board.lock);
+
+	for (i = 0; i < board.len; i++) {
+		if (board.top[i].rowid == DB_ROWID_PENDING &&
+		    board.top[i].score == rec->score &&
+		    board.top[i].date == rec->date &&
+		    !strcmp(board.top[i].id, rec->id)) {
+			board.top[i].rowid = rowid;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&board.lock);
 }
 
-int db_save_state(void)
+static void read_score(sqlite3_stmt *stmt, struct db_score *res)
+{
+	const char *name = (const char *) sqlite3_column_text(stmt, 1);
+
+	memset(res, 0, sizeof *res);
+	strlcpy(res->id, name ? name : "", sizeof res->id);
+
+	res->rowid = sqlite3_column_int64(stmt, 0);
+	res->level = sqlite3_column_int(stmt, 2);
+	res->score = sqlite3_column_int(stmt, 3);
+	res->date = sqlite3_column_int64(stmt, 4);
+}
+
+/* Run a score query, copy up to @len rows into @res */
+static ssize_t read_scores(sqlite3_stmt *stmt, struct db_score *res,
+			   size_t len)
+{
+	int status = SQLITE_DONE;
+	size_t n = 0;
+
+	while (n < len && (status = sqlite3_step(stmt)) == SQLITE_ROW)
+		read_score(stmt, &res[n++]);
+
+	if (n < len && status != SQLITE_DONE) {
+		log_err("Unable to read scores: %s", sqlite3_errmsg(psave->db));
+		db_done(stmt);
+		return -1;
+	}
+
+	db_done(stmt);
+
+	return n;
+}
+
+/* Fill the cached leaderboard from disk */
+static void board_load(void)
+{
+	sqlite3_stmt *stmt = db_stmts[SELECT_SCORES];
+	ssize_t n;
+
+	sqlite3_bind_int(stmt, 1, DB_TOP_LEN);
+	n = read_scores(stmt, board.top, DB_TOP_LEN);
+
+	board.len = n > 0 ? n : 0;
+}
+
+static int write_record(const struct db_record *rec)
 {
 	sqlite3_stmt *stmt;
-	char *insert, *data = NULL;
-	int len, ret = 0, data_len = 0;
+	int ret = -1;
+
+	switch (rec->type) {
+	case RECORD_SCORE:
+		stmt = db_stmts[INSERT_SCORES];
+		sqlite3_bind_text(stmt, 1, rec->id, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 2, rec->level);
+		sqlite3_bind_int(stmt, 3, rec->score);
+		sqlite3_bind_int64(stmt, 4, rec->date);
+		if ((ret = db_exec(INSERT_SCORES)) > 0)
+			board_written(rec, sqlite3_last_insert_rowid(psave->db));
+		break;
+	case RECORD_STATE:
+		stmt = db_stmts[INSERT_STATE];
+		sqlite3_bind_text(stmt, 1, rec->id, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, rec->slot, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 3, rec->date);
+		sqlite3_bind_blob(stmt, 4, &rec->save, sizeof rec->save,
+				  SQLITE_STATIC);
+		ret = db_exec(INSERT_STATE);
+		break;
+	}
 
-	if (db_open() < 0)
-		return 0;
+	return ret;
+}
 
-	/* Create table if it doesn't exist */
-	sqlite3_prepare_v2(psave->db, create_state,
-			   sizeof create_state, &stmt, NULL);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+/*
+ * Persistence thread. Takes everything in the queue, writes it in one
+ * transaction, repeat. Exits once told to stop and the queue is empty.
+ */
+static void *db_worker(void *vp)
+{
+	(void) vp; /* unused */
 
-	len = asprintf(&insert, insert_state,
-			   psave->id, pgame->score, pgame->lines_destroyed,
-			   pgame->level, (uint64_t) time(NULL));
+	static struct db_record batch[DB_QUEUE_LEN];
+	uint64_t start;
+	size_t i, n;
+	bool ok;
 
-	if (len < 0) {
-		log_err("Out of memory");
-	} else {
-		data_len = (BLOCKS_MAX_ROWS - 2) * sizeof(*pgame->spaces);
-		data = malloc(data_len);
+	pthread_mutex_lock(&queue.lock);
 
-		if (!data) {
-			/* Non-fatal, we just don't save to database */
-			log_err("Unable to acquire memory, %d bytes", data_len);
-			goto error;
+	while (1) {
+		while (!queue.len && !queue.stop)
+			pthread_cond_wait(&queue.more, &queue.lock);
+
+		if (!queue.len)
+			break;
+
+		for (n = 0; queue.len; n++, queue.len--) {
+			batch[n] = queue.rec[queue.head];
+			queue.head = (queue.head + 1) % DB_QUEUE_LEN;
 		}
 
-		memcpy(data, &pgame->spaces[2], data_len);
-		sqlite3_prepare_v2(psave->db, insert, strlen(insert),
-				   &stmt, NULL);
+		pthread_cond_broadcast(&queue.room);
+		pthread_mutex_unlock(&queue.lock);
 
-		/* NOTE sqlite will free the @data block for us */
-		sqlite3_bind_blob(stmt, 1, data, data_len, free);
-		sqlite3_step(stmt);
-		sqlite3_finalize(stmt);
+		pthread_mutex_lock(&db_lock);
+		start = stats_now();
+		ok = db_exec(BEGIN) > 0;
+		for (i = 0; i < n; i++)
+			ok = write_record(&batch[i]) > 0 && ok;
+		ok = db_exec(COMMIT) > 0 && ok;
+		metrics_observe(METRIC_DB, stats_now() - start);
+		pthread_mutex_unlock(&db_lock);
 
-		ret = 1;
+		/* db_close() reads it once we're joined */
+		if (!ok)
+			queue.failed = true;
+
+		debug("Wrote %zu records", n);
+
+		pthread_mutex_lock(&queue.lock);
 	}
 
- error:
-	if (len > 0)
-		free(insert);
+	pthread_mutex_unlock(&queue.lock);
 
-	db_close();
-	return ret;
+	return NULL;
 }
 
-/* Queries database for newest game state information and copies it to pgame.
- */
-int db_resume_state(void)
+/* Hand a record to db_worker(). Only blocks if the queue is full. */
+static int enqueue(const struct db_record *rec)
 {
-	sqlite3_stmt *stmt, *delete;
-	int ret, rowid, i, j;
-	const char *blob;
+	pthread_mutex_lock(&queue.lock);
 
-	if (db_open() < 0)
-		return -1;
+	while (queue.running && queue.len == DB_QUEUE_LEN)
+		pthread_cond_wait(&queue.room, &queue.lock);
 
-	log_info("Trying to restore saved game");
+	if (!queue.running) {
+		pthread_mutex_unlock(&queue.lock);
+		log_warn("Database isn't open, record dropped");
+		return 0;
+	}
 
-	/* Look for newest entry in table */
-	sqlite3_prepare_v2(psave->db, select_state,
-			   sizeof select_state, &stmt, NULL);
+	queue.rec[(queue.head + queue.len) % DB_QUEUE_LEN] = *rec;
+	queue.len++;
 
-	if (sqlite3_step(stmt) == SQLITE_ROW) {
-		strlcpy(psave->id, (const char *)
-			sqlite3_column_text(stmt, 0), sizeof psave->id);
+	pthread_cond_signal(&queue.more);
+	pthread_mutex_unlock(&queue.lock);
 
-		pgame->score = sqlite3_column_int(stmt, 1);
-		pgame->lines_destroyed = sqlite3_column_int(stmt, 2);
-		pgame->level = sqlite3_column_int(stmt, 3);
+	return 1;
+}
 
-		blob = sqlite3_column_blob(stmt, 5);
-		memcpy(&pgame->spaces[2], &blob[0],
-		       (BLOCKS_MAX_ROWS - 2) * sizeof(*pgame->spaces));
+int db_start(void)
+{
+	int ret;
 
-		/* Set block spaces to random colors, we don't really need to
-		 * save them ... */
-		for (i = 0; i < BLOCKS_MAX_ROWS; i++)
-			for (j = 0; j < BLOCKS_MAX_COLUMNS; j++)
-				pgame->colors[i][j] = rand();
-		ret = 1;
-	} else {
-		log_warn("No game saves found");
+	pthread_mutex_lock(&db_lock);
+
+	ret = db_open();
+	if (ret > 0)
+		board_load();
+
+	pthread_mutex_unlock(&db_lock);
+
+	if (ret < 0)
+		return -1;
+
+	queue.stop = false;
+	if (pthread_create(&queue.thread, NULL, db_worker, NULL) != 0) {
+		log_err("Unable to start database thread");
+		return -1;
+	}
+
+	queue.running = true;
+
+	return 1;
+}
+
+int db_close(void)
+{
+	int ret = queue.running ? 1 : -1;
+	size_t i;
+
+	/* Let the worker write out everything it has, then stop it */
+	if (queue.running) {
+		pthread_mutex_lock(&queue.lock);
+		queue.stop = true;
+		queue.running = false;
+		pthread_cond_signal(&queue.more);
+		pthread_cond_broadcast(&queue.room);
+		pthread_mutex_unlock(&queue.lock);
+
+		pthread_join(queue.thread, NULL);
+	}
+
+	if (queue.failed)
 		ret = -1;
+	queue.failed = false;
+
+	if (psave->db) {
+		log_info("Closing database %s", psave->file_loc);
+
+		/* Move the WAL into the database file and sync it, so
+		 * everything we queued is on disk before we go.
+		 */
+		sqlite3_wal_checkpoint_v2(psave->db, NULL,
+					  SQLITE_CHECKPOINT_TRUNCATE,
+					  NULL, NULL);
+
+		for (i = 0; i < DB_STMT_LEN; i++) {
+			sqlite3_finalize(db_stmts[i]);
+			db_stmts[i] = NULL;
+		}
+
+		sqlite3_close(psave->db);
+		psave->db = NULL;
 	}
 
-	sqlite3_finalize(stmt);
+	free(psave->file_loc);
+	psave->file_loc = NULL;
 
-	sqlite3_prepare_v2(psave->db, select_state_rowid,
-			   sizeof select_state_rowid, &stmt, NULL);
+	return ret;
+}
 
-	if (sqlite3_step(stmt) == SQLITE_ROW) {
-		rowid = sqlite3_column_int(stmt, 0);
+int db_save_score(void)
+{
+	return db_save_score_as(psave->id);
+}
 
-		/* delete from table */
-		sqlite3_prepare_v2(psave->db, delete_state_rowid,
-				   sizeof delete_state_rowid, &delete, NULL);
+int db_save_score_as(const char *id)
+{
+	struct db_record rec;
+	struct db_score res;
 
-		sqlite3_bind_int(delete, 1, rowid);
-		sqlite3_step(delete);
-		sqlite3_finalize(delete);
+	if (pgame->score == 0)
+		return 0;
+
+	log_info("Queueing score for the database");
+
+	rec.type = RECORD_SCORE;
+	strlcpy(rec.id, id, sizeof rec.id);
+	rec.level = pgame->level;
+	rec.score = pgame->score;
+	rec.date = time(NULL);
+
+	memset(&res, 0, sizeof res);
+	strlcpy(res.id, rec.id, sizeof res.id);
+	res.rowid = DB_ROWID_PENDING;
+	res.level = rec.level;
+	res.score = rec.score;
+	res.date = rec.date;
+	board_insert(&res);
+
+	return enqueue(&rec);
+}
+
+int db_save_state(void)
+{
+	struct db_record rec;
+
+	log_info("Queueing game state for the database");
+
+	rec.type = RECORD_STATE;
+	strlcpy(rec.id, psave->id, sizeof rec.id);
+	strlcpy(rec.slot, psave->slot, sizeof rec.slot);
+	rec.date = time(NULL);
+	blocks_save(&rec.save);
+
+	return enqueue(&rec);
+}
+
+/* Takes the player's newest save in their slot out of the database, and
+ * copies it to pgame. The save is gone either way, one we can't read would
+ * only come back next time.
+ */
+int db_resume_state(void)
+{
+	struct blocks_save save;
+	sqlite3_stmt *stmt;
+	uint64_t start;
+	int ret = -1;
+
+	pthread_mutex_lock(&db_lock);
+	start = stats_now();
+
+	if (!(stmt = db_stmt(TAKE_STATE))) {
+		pthread_mutex_unlock(&db_lock);
+		return -1;
 	}
 
-	sqlite3_finalize(stmt);
+	log_info("Trying to restore saved game from slot \"%s\"", psave->slot);
+
+	sqlite3_bind_text(stmt, 1, psave->id, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, psave->slot, -1, SQLITE_STATIC);
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		log_warn("No game saves found");
+	} else if (sqlite3_column_bytes(stmt, 1) != sizeof save) {
+		log_warn("Save %lld is the wrong size",
+			 (long long) sqlite3_column_int64(stmt, 0));
+	} else {
+		/* Blobs needn't be aligned, so it's copied once */
+		memcpy(&save, sqlite3_column_blob(stmt, 1), sizeof save);
+		ret = blocks_restore(&save);
+	}
+
+	db_done(stmt);
+	metrics_observe(METRIC_DB, stats_now() - start);
+
+	pthread_mutex_unlock(&db_lock);
 
-	db_close();
 	return ret;
 }
 
-/* Returns a pointer to the first element of a tail queue, of @results length.
- * This list can be iterated over to extract the fields:
- * name, level, score, date.
- *
- * NOTE Be sure to call db_clean_scores after this to free memory.
+/* ROWID to page on from @row. A pending row that's been written since has
+ * a real one by now. Paging past DB_ROWID_PENDING would start above it,
+ * and show it again.
  */
-struct db_results *db_get_scores(size_t results)
+static int64_t cursor_rowid(const struct db_score *row)
+{
+	sqlite3_stmt *stmt = db_stmts[FIND_SCORE];
+	int64_t rowid = row->rowid;
+
+	if (rowid != DB_ROWID_PENDING)
+		return rowid;
+
+	sqlite3_bind_text(stmt, 1, row->id, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, row->score);
+	sqlite3_bind_int64(stmt, 3, row->date);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		rowid = sqlite3_column_int64(stmt, 0);
+	db_done(stmt);
+
+	return rowid;
+}
+
+/* The first page comes straight from the cached leaderboard. Anything
+ * further down asks the database, starting after the last row the caller
+ * has.
+ */
+ssize_t db_get_scores(struct db_score *res, size_t len,
+		      const struct db_score *after)
 {
 	sqlite3_stmt *stmt;
-	struct db_results *np;
+	uint64_t start;
+	ssize_t n = 0;
 
-	if (db_open() < 0)
-		return NULL;
+	if (!after && len <= DB_TOP_LEN) {
+		pthread_mutex_lock(&board.lock);
+		for (n = 0; (size_t) n < len && (size_t) n < board.len; n++)
+			res[n] = board.top[n];
+		pthread_mutex_unlock(&board.lock);
 
-	sqlite3_prepare_v2(psave->db, select_scores,
-			   sizeof select_scores, &stmt, NULL);
-	TAILQ_INIT(&results_head);
+		return n;
+	}
 
-	while (results-- > 0 && sqlite3_step(stmt) == SQLITE_ROW) {
-		if (sqlite3_column_count(stmt) != 4)
-			break; /* improperly formatted row */
+	pthread_mutex_lock(&db_lock);
+	start = stats_now();
 
-		np = malloc(sizeof *np);
-		if (!np) {
-			log_warn("Out of memory, %d bytes.", sizeof *np);
-			break;
-		}
+	if (!after) {
+		if (!(stmt = db_stmt(SELECT_SCORES)))
+			goto done;
 
-		memset(np->id, 0, sizeof np->id);
-		strlcpy(np->id, (const char *)
-			sqlite3_column_text(stmt, 0), sizeof np->id);
-		np->id[sizeof(np->id) - 1] = '\0';
+		sqlite3_bind_int64(stmt, 1, len);
+	} else {
+		if (!(stmt = db_stmt(SELECT_SCORES_AFTER)))
+			goto done;
 
-		np->level = sqlite3_column_int(stmt, 1);
-		np->score = sqlite3_column_int(stmt, 2);
-		np->date = sqlite3_column_int(stmt, 3);
+		sqlite3_bind_int64(stmt, 1, after->score);
+		sqlite3_bind_int64(stmt, 2, cursor_rowid(after));
+		sqlite3_bind_int64(stmt, 3, len);
+	}
 
-		if (!np->score || !np->level || !np->date) {
-			free(np);
-			break;
-		}
+	n = read_scores(stmt, res, len);
+	metrics_observe(METRIC_DB, stats_now() - start);
+
+ done:
+	pthread_mutex_unlock(&db_lock);
+
+	return n;
+}
+
+int db_get_best(const char *name, struct db_score *res)
+{
+	sqlite3_stmt *stmt;
+	uint64_t start;
+	ssize_t n = 0;
+
+	pthread_mutex_lock(&db_lock);
 
-		TAILQ_INSERT_TAIL(&results_head, np, entries);
-		np = NULL;
+	if ((stmt = db_stmt(SELECT_BEST))) {
+		start = stats_now();
+		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+		n = read_scores(stmt, res, 1);
+		metrics_observe(METRIC_DB, stats_now() - start);
 	}
 
-	sqlite3_finalize(stmt);
-	db_close();
+	pthread_mutex_unlock(&db_lock);
 
-	return results_head.tqh_first;
+	return n;
 }
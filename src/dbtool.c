@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * blocks-db: move leaderboards between hosts.
+ *
+ * Scores are streamed in and out of the Scores table as CSV
+ * (name,level,score,date) or as a compact binary format. An import is one
+ * transaction, inserting BATCH rows a statement. The leaderboard indexes are dropped
+ * in it and built once over the whole table at the end, so a failed import
+ * rolls back to the table, indexes and all, as it was. A bad row fails it
+ * too, unless -s says to skip bad CSV rows.
+ *
+ * Binary format, all integers little endian:
+ *	"BLDB" 4 byte magic, 1 byte version (DBTOOL_VERSION)
+ *	then per row: 1 byte name length, name, 4 byte level,
+ *	4 byte score, 8 byte date
+ * Version 1 had a 1 byte level. We still read it, but only write 2.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "db.h"
+#include "debug.h"
+
+#define DBTOOL_VERSION	2
+#define DBTOOL_MAGIC	"BLDB"		/* not BLOCKS_SAVE_MAGIC's "BLKS" */
+#define NAME_LEN	sizeof ((struct db_info *) 0)->id
+
+/* Rows per INSERT, 4 variables each */
+#define BATCH		64
+
+static const char select_scores[] =
+	"SELECT name,level,score,date FROM Scores;";
+
+struct row {
+	char name[NAME_LEN];
+	int level;
+	uint32_t score;
+	int64_t date;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "%s-%s usage:\n"
+		"\t%s [-b] [-s] [-f database] import < scores\n"
+		"\t%s [-b] [-f database] export > scores\n"
+		"\t[-b] binary format instead of CSV\n"
+		"\t[-s] skip bad CSV rows instead of failing the import\n"
+		"\t[-f database] default ~/.local/share/tetris/saves\n",
+		__progname, VERSION, __progname, __progname);
+
+	exit(EXIT_FAILURE);
+}
+
+static int exec(sqlite3 *db, const char *sql)
+{
+	char *errmsg = NULL;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_err("\"%s\" failed: %s", sql, errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * CSV
+ */
+
+/* Lines of any length, getline() grows it */
+static char *csv_line;
+static size_t csv_cap;
+
+/*
+ * name,level,score,date and a newline. The name may be "quoted", with ""
+ * for a quote, and a quoted name goes on over newlines like csv_write()
+ * leaves them. A name too long for the game is a bad row, not cut short.
+ */
+static int csv_read(FILE *fp, struct row *row)
+{
+	char *p, *end;
+	size_t n = 0;
+
+	if (getline(&csv_line, &csv_cap, fp) < 0)
+		return 0;
+
+	p = csv_line;
+	if (*p == '"') {
+		for (p++;;) {
+			/* The newline was part of the name, read on */
+			if (!*p) {
+				if (getline(&csv_line, &csv_cap, fp) < 0)
+					return -1;
+				p = csv_line;
+				continue;
+			}
+			if (*p == '"' && *++p != '"')
+				break;
+			if (n == NAME_LEN - 1)
+				return -1;
+			row->name[n++] = *p++;
+		}
+	} else {
+		for (; *p && *p != ','; p++) {
+			if (n == NAME_LEN - 1)
+				return -1;
+			row->name[n++] = *p;
+		}
+	}
+	row->name[n] = '\0';
+
+	if (*p++ != ',')
+		return -1;
+
+	row->level = strtol(p, &end, 10);
+	if (end == p || *end != ',')
+		return -1;
+
+	p = end + 1;
+	row->score = strtoul(p, &end, 10);
+	if (end == p || *end != ',')
+		return -1;
+
+	p = end + 1;
+	row->date = strtoll(p, &end, 10);
+	if (end == p)
+		return -1;
+
+	/* Anything after the date, or no newline at all, and it's not ours */
+	if (*end == '\r')
+		end++;
+	if (*end != '\n')
+		return -1;
+
+	return 1;
+}
+
+static void csv_write(FILE *fp, const struct row *row)
+{
+	const char *c;
+
+	if (strpbrk(row->name, ",\"\n")) {
+		putc('"', fp);
+		for (c = row->name; *c; c++) {
+			if (*c == '"')
+				putc('"', fp);
+			putc(*c, fp);
+		}
+		putc('"', fp);
+	} else {
+		fputs(row->name, fp);
+	}
+
+	fprintf(fp, ",%d,%u,%lld\n", row->level, row->score,
+		(long long) row->date);
+}
+
+/*
+ * Binary
+ */
+
+static uint64_t get_le(const unsigned char *p, size_t len)
+{
+	uint64_t v = 0;
+
+	while (len--)
+		v = (v << 8) | p[len];
+
+	return v;
+}
+
+static void put_le(unsigned char *p, uint64_t v, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+/* Version of the file being read */
+static int bin_version;
+
+static int bin_header_read(FILE *fp)
+{
+	unsigned char hdr[5];
+
+	if (fread(hdr, 1, sizeof hdr, fp) != sizeof hdr ||
+	    memcmp(hdr, DBTOOL_MAGIC, 4) != 0) {
+		log_err("Not a blocks-db binary file");
+		return -1;
+	}
+
+	if (hdr[4] != 1 && hdr[4] != DBTOOL_VERSION) {
+		log_err("Unknown binary version %d", hdr[4]);
+		return -1;
+	}
+
+	bin_version = hdr[4];
+
+	return 1;
+}
+
+static void bin_header_write(FILE *fp)
+{
+	fwrite(DBTOOL_MAGIC, 1, 4, fp);
+	putc(DBTOOL_VERSION, fp);
+}
+
+static int bin_read(FILE *fp, struct row *row)
+{
+	unsigned char buf[16];
+	size_t level = bin_version == 1 ? 1 : 4;
+	int len;
+
+	if ((len = getc(fp)) == EOF)
+		return 0;
+
+	if ((size_t) len >= NAME_LEN ||
+	    fread(row->name, 1, len, fp) != (size_t) len ||
+	    fread(buf, 1, level + 12, fp) != level + 12)
+		return -1;
+
+	row->name[len] = '\0';
+	row->level = (int32_t) get_le(buf, level);
+	row->score = get_le(&buf[level], 4);
+	row->date = get_le(&buf[level + 4], 8);
+
+	return 1;
+}
+
+static void bin_write(FILE *fp, const struct row *row)
+{
+	unsigned char buf[1 + NAME_LEN + 16];
+	size_t len = strnlen(row->name, NAME_LEN - 1);
+
+	buf[0] = len;
+	memcpy(&buf[1], row->name, len);
+	put_le(&buf[len + 1], (uint32_t) row->level, 4);
+	put_le(&buf[len + 5], row->score, 4);
+	put_le(&buf[len + 9], row->date, 8);
+
+	fwrite(buf, 1, len + 17, fp);
+}
+
+/*
+ * Import/export
+ */
+
+/* DB_INSERT_SCORE, but @n rows at a time */
+static sqlite3_stmt *prepare_insert(sqlite3 *db, int n)
+{
+	static const char row[] = ",(?,?,?,?)";
+	sqlite3_stmt *stmt;
+	char sql[sizeof DB_INSERT_SCORE + BATCH * (sizeof row - 1)];
+	size_t len = strlen(DB_INSERT_SCORE) - 1;	/* ';' */
+
+	memcpy(sql, DB_INSERT_SCORE, len);
+	for (; n > 1; n--, len += sizeof row - 1)
+		memcpy(&sql[len], row, sizeof row - 1);
+	strcpy(&sql[len], ";");
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		log_err("Cannot prepare insert: %s", sqlite3_errmsg(db));
+		return NULL;
+	}
+
+	return stmt;
+}
+
+/* One step for a whole batch, the statement's per row overhead is most
+ * of what an insert costs
+ */
+static int insert(sqlite3 *db, sqlite3_stmt *stmt, const struct row *rows,
+		  int n)
+{
+	int i, v = 1;
+
+	for (i = 0; i < n; i++) {
+		sqlite3_bind_text(stmt, v++, rows[i].name, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, v++, rows[i].level);
+		sqlite3_bind_int64(stmt, v++, rows[i].score);
+		sqlite3_bind_int64(stmt, v++, rows[i].date);
+	}
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_err("Insert failed: %s", sqlite3_errmsg(db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	sqlite3_reset(stmt);
+
+	return 1;
+}
+
+static int import(sqlite3 *db, FILE *fp, bool binary, bool skip)
+{
+	static struct row batch[BATCH];
+	sqlite3_stmt *stmt = NULL, *one = NULL;
+	uint64_t rows = 0, skipped = 0, line = 0;
+	double start = now(), t;
+	bool failed = false;
+	int ret, n = 0, i;
+
+	if (binary && bin_header_read(fp) < 0)
+		return -1;
+
+	if (exec(db, "BEGIN;") < 0)
+		return -1;
+
+	if (exec(db, DB_SCORES_DROP_INDEXES) < 0)
+		failed = true;
+
+	if (!failed && (!(stmt = prepare_insert(db, BATCH)) ||
+			!(one = prepare_insert(db, 1))))
+		failed = true;
+
+	while (!failed && (line++, (ret = binary ? bin_read(fp, &batch[n])
+						 : csv_read(fp, &batch[n])) != 0)) {
+		/* Binary rows can't be skipped, we'd lose our place */
+		if (ret < 0 && (binary || !skip)) {
+			log_err("Bad row %llu", (unsigned long long) line);
+			failed = true;
+			break;
+		}
+
+		if (ret < 0) {
+			log_warn("Skipping bad row %llu",
+				 (unsigned long long) line);
+			skipped++;
+			continue;
+		}
+
+		if (++n < BATCH)
+			continue;
+
+		if (insert(db, stmt, batch, n) < 0) {
+			log_err("In the %d rows up to row %llu", n,
+				(unsigned long long) line);
+			failed = true;
+			break;
+		}
+
+		rows += n;
+		n = 0;
+	}
+
+	/* The last few */
+	for (i = 0; !failed && i < n; i++, rows++)
+		if (insert(db, one, &batch[i], 1) < 0)
+			failed = true;
+
+	if (!failed && ferror(fp)) {
+		log_err("Read failed: %s", strerror(errno));
+		failed = true;
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(one);
+	free(csv_line);
+	csv_line = NULL;
+
+	t = now() - start;
+	if (!failed)
+		log_info("Inserted %llu rows in %.3fs (%.0f rows/s)",
+			 (unsigned long long) rows, t, rows / t);
+
+	/* One pass over the whole table beats updating both indexes on
+	 * every insert */
+	start = now();
+	if (!failed && (exec(db, DB_SCORES_INDEXES) < 0 ||
+			exec(db, "COMMIT;") < 0))
+		failed = true;
+
+	if (failed) {
+		if (!sqlite3_get_autocommit(db))
+			exec(db, "ROLLBACK;");
+		log_err("Import failed, nothing imported");
+		return -1;
+	}
+
+	log_info("Rebuilt indexes in %.3fs", now() - start);
+
+	/* We were told to, so it's not a failure */
+	if (skipped)
+		log_warn("Skipped %llu bad rows", (unsigned long long) skipped);
+
+	return 1;
+}
+
+static int export(sqlite3 *db, FILE *fp, bool binary)
+{
+	sqlite3_stmt *stmt;
+	struct row row;
+	uint64_t rows = 0;
+	double start = now(), t;
+	const char *name;
+	int ret;
+
+	if (sqlite3_prepare_v2(db, select_scores, -1, &stmt, NULL) !=
+	    SQLITE_OK) {
+		log_err("Cannot prepare select: %s", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	if (binary)
+		bin_header_write(fp);
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		name = (const char *) sqlite3_column_text(stmt, 0);
+		strncpy(row.name, name ? name : "", NAME_LEN - 1);
+		row.name[NAME_LEN - 1] = '\0';
+
+		row.level = sqlite3_column_int(stmt, 1);
+		row.score = sqlite3_column_int64(stmt, 2);
+		row.date = sqlite3_column_int64(stmt, 3);
+
+		if (binary)
+			bin_write(fp, &row);
+		else
+			csv_write(fp, &row);
+
+		rows++;
+	}
+
+	if (ret != SQLITE_DONE) {
+		log_err("Select failed: %s", sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	sqlite3_finalize(stmt);
+
+	if (fflush(fp) != 0) {
+		log_err("Write failed: %s", strerror(errno));
+		return -1;
+	}
+
+	t = now() - start;
+	log_info("Exported %llu rows in %.3fs (%.0f rows/s)",
+		 (unsigned long long) rows, t, rows / t);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static char inbuf[1 << 20], outbuf[1 << 20];
+	char path[256];
+	const char *file = NULL, *home;
+	bool binary = false, skip = false;
+	sqlite3 *db;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "bf:hs")) != -1) {
+		switch (opt) {
+		case 'b':
+			binary = true;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 's':
+			skip = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	if (!file) {
+		if (!(home = getenv("HOME"))) {
+			fprintf(stderr, "Environment variable $HOME does not "
+					"exist, use -f\n");
+			exit(EXIT_FAILURE);
+		}
+
+		snprintf(path, sizeof path, "%s/.local/share/tetris/saves",
+			 home);
+		file = path;
+	}
+
+	if (sqlite3_open(file, &db) != SQLITE_OK) {
+		log_err("Cannot open %s: %s", file, sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	/* The game's own connection uses WAL too. Skipping syncs only lasts
+	 * as long as this connection does, and we checkpoint at the end.
+	 * A bigger cache_size only made the index sort slower.
+	 */
+	exec(db, "PRAGMA journal_mode=WAL;"
+		 "PRAGMA synchronous=OFF;");
+
+	if (exec(db, DB_SCORES_TABLE) < 0)
+		exit(EXIT_FAILURE);
+
+	setvbuf(stdin, inbuf, _IOFBF, sizeof inbuf);
+	setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+
+	if (!strcmp(argv[optind], "import"))
+		ret = import(db, stdin, binary, skip);
+	else if (!strcmp(argv[optind], "export"))
+		ret = export(db, stdout, binary);
+	else
+		usage();
+
+	/* Sync everything before we say we're done */
+	exec(db, "PRAGMA synchronous=FULL;");
+	sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+				  NULL, NULL);
+	sqlite3_close(db);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -16,37 +16,278 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "debug.h"
 
-/* Prints a log message of the form:
- * "[time] message"
+/* How often the writer wakes up on its own */
+#define LOG_FLUSH_NSEC	100000000L
+
+struct log_record {
+	uint64_t seq;			/* global order, across threads */
+	time_t time;
+	char msg[LOG_MSG_LEN];
+};
+
+/* Single producer (the thread that owns it), single consumer (the writer).
+ * head and tail only ever grow, index with % LOG_RING_LEN.
+ */
+struct log_ring {
+	uint64_t head;			/* written by the owner */
+	uint64_t tail;			/* written by the writer */
+	uint64_t dropped;		/* messages lost to a full ring */
+	struct log_record rec[LOG_RING_LEN];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	bool running, stop;
+
+	uint64_t seq;			/* next message number */
+	unsigned nrings;		/* rings handed out, may be > than */
+	struct log_ring *rings[LOG_MAX_THREADS];	/* never freed */
+
+	time_t date_time;		/* date below is for this second, */
+	char date[32];			/* both under flockfile(stderr) */
+} logger = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct log_ring *my_ring;
+static __thread bool no_ring;		/* too many threads, don't retry */
+
+/* "[time]" for @t. Only redone once a second, not per line. */
+static const char *log_date(time_t t)
+{
+	if (t != logger.date_time || !logger.date[0]) {
+		strftime(logger.date, sizeof logger.date, "[%F %H:%M]",
+			 localtime(&t));
+		logger.date_time = t;
+	}
+
+	return logger.date;
+}
+
+static void log_line(time_t t, const char *msg)
+{
+	size_t len = strlen(msg);
+
+	/* We add our own newline */
+	if (len && msg[len - 1] == '\n')
+		len--;
+
+	fprintf(stderr, "%s %.*s\n", log_date(t), (int) len, msg);
+}
+
+/* The calling thread's ring, made on first use */
+static struct log_ring *log_ring(void)
+{
+	unsigned i;
+
+	if (my_ring || no_ring)
+		return my_ring;
+
+	i = __atomic_fetch_add(&logger.nrings, 1, __ATOMIC_RELAXED);
+	if (i >= LOG_MAX_THREADS) {
+		no_ring = true;
+		return NULL;
+	}
+
+	if (!(my_ring = calloc(1, sizeof *my_ring))) {
+		no_ring = true;
+		return NULL;
+	}
+
+	__atomic_store_n(&logger.rings[i], my_ring, __ATOMIC_RELEASE);
+
+	return my_ring;
+}
+
+/* Write out every record waiting, oldest first across all rings. Whoever
+ * holds flockfile(stderr) is the one consumer.
  */
-void debug_log(const char *fmt, ...)
+static void log_drain_locked(void)
 {
-	time_t s = time(NULL);
-	char *msg, date[32];
+	struct log_ring *ring, *best;
+	uint64_t dropped;
+	unsigned i, n;
+	char msg[64];
+
+	n = __atomic_load_n(&logger.nrings, __ATOMIC_RELAXED);
+	if (n > LOG_MAX_THREADS)
+		n = LOG_MAX_THREADS;
+
+	while (1) {
+		best = NULL;
+
+		for (i = 0; i < n; i++) {
+			ring = __atomic_load_n(&logger.rings[i],
+					       __ATOMIC_ACQUIRE);
+			if (!ring || ring->tail ==
+			    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+				continue;
+
+			if (!best || ring->rec[ring->tail % LOG_RING_LEN].seq <
+			    best->rec[best->tail % LOG_RING_LEN].seq)
+				best = ring;
+		}
+
+		if (!best)
+			break;
+
+		log_line(best->rec[best->tail % LOG_RING_LEN].time,
+			 best->rec[best->tail % LOG_RING_LEN].msg);
+
+		__atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; i < n; i++) {
+		ring = __atomic_load_n(&logger.rings[i], __ATOMIC_ACQUIRE);
+		if (!ring)
+			continue;
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0,
+					      __ATOMIC_RELAXED);
+		if (!dropped)
+			continue;
+
+		snprintf(msg, sizeof msg, "[WARN] Log ring full, %llu "
+			 "messages dropped", (unsigned long long) dropped);
+		log_line(time(NULL), msg);
+	}
+}
+
+static void log_drain(void)
+{
+	flockfile(stderr);
+	log_drain_locked();
+	fflush(stderr);
+	funlockfile(stderr);
+}
+
+void debug_log(int level, const char *fmt, ...)
+{
+	struct log_ring *ring;
+	struct log_record *rec;
+	struct timespec ts;
+	char msg[LOG_MSG_LEN];
 	va_list ap;
-	int ret;
 
-	strftime(date, sizeof date, "[%F %H:%M]", localtime(&s));
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) ||
+	    level == LOG_ERR || !(ring = log_ring())) {
+		/* Straight to the file. stdio locks for us. */
+		va_start(ap, fmt);
+		vsnprintf(msg, sizeof msg, fmt, ap);
+		va_end(ap);
+
+		flockfile(stderr);
+
+		/* Errors may be the last thing we do before exit(). Whatever
+		 * the rings hold goes first, so the order stays right.
+		 */
+		if (level == LOG_ERR)
+			log_drain_locked();
+
+		log_line(ts.tv_sec, msg);
+		funlockfile(stderr);
+
+		if (level == LOG_ERR)
+			fflush(NULL);
+		return;
+	}
+
+	if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+	    LOG_RING_LEN) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->rec[ring->head % LOG_RING_LEN];
+	rec->time = ts.tv_sec;
+	rec->seq = __atomic_fetch_add(&logger.seq, 1, __ATOMIC_RELAXED);
 
 	va_start(ap, fmt);
-	ret = vasprintf(&msg, fmt, ap);
+	vsnprintf(rec->msg, sizeof rec->msg, fmt, ap);
 	va_end(ap);
 
-	if (ret < 0) {
-		msg = NULL;
-	} else {
-		int len = strlen(msg);
-		if (msg[len] == '\n')
-			msg[len] = '\0';
+	/* Hand the record over */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writer thread. Wakes up every LOG_FLUSH_NSEC and writes out everything
+ * the rings have.
+ */
+static void *log_writer(void *vp)
+{
+	(void) vp; /* unused */
+
+	struct timespec ts;
+
+	pthread_mutex_lock(&logger.lock);
+
+	while (!logger.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_NSEC;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&logger.wake, &logger.lock, &ts);
+
+		pthread_mutex_unlock(&logger.lock);
+		log_drain();
+		pthread_mutex_lock(&logger.lock);
 	}
 
-	fprintf(stderr, "%s %s\n", date, msg ? msg : "");
-	free(msg);
+	pthread_mutex_unlock(&logger.lock);
+
+	return NULL;
+}
+
+int debug_start(void)
+{
+	if (logger.running)
+		return 1;
+
+	logger.stop = false;
+	if (pthread_create(&logger.thread, NULL, log_writer, NULL) != 0)
+		return -1;
+
+	__atomic_store_n(&logger.running, true, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+void debug_stop(void)
+{
+	if (!logger.running)
+		return;
+
+	/* New messages go straight to the file from here on */
+	__atomic_store_n(&logger.running, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&logger.lock);
+	logger.stop = true;
+	pthread_cond_signal(&logger.wake);
+	pthread_mutex_unlock(&logger.lock);
+
+	pthread_join(logger.thread, NULL);
+
+	/* Anything that raced with the switch above. The rings stay, their
+	 * threads still point at them.
+	 */
+	log_drain();
 }
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <ncurses.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "input.h"
+
+#define ESC 0x1b
+
+/* Longest CSI sequence we bother with, e.g. "\033[57441;1:3u" */
+#define CSI_MAX_LEN 16
+
+/* Value of a key we don't care about. The bytes are eaten and dropped. */
+#define KEY_UNKNOWN -1
+
+/* Kitty keyboard protocol flags: disambiguate escape codes (1), report
+ * press/repeat/release (2) and send every key as an escape code (8).
+ * Terminals that don't know the protocol ignore all of this.
+ */
+#define KEYBOARD_PUSH	"\033[>11u"
+#define KEYBOARD_QUERY	"\033[?u"
+#define KEYBOARD_POP	"\033[<u"
+
+/* ESC [ <n> ~ style function keys (vt220, xterm, linux console) */
+static int csi_tilde_key(int n)
+{
+	if (n >= 11 && n <= 15)
+		return KEY_F(n - 10);
+	if (n >= 17 && n <= 21)
+		return KEY_F(n - 11);
+	if (n == 23 || n == 24)
+		return KEY_F(n - 12);
+
+	return KEY_UNKNOWN;
+}
+
+/* Final byte of a CSI sequence to a key */
+static int csi_key(unsigned char final, int n)
+{
+	switch (final) {
+	case 'u':		/* kitty: n is the unicode codepoint */
+		return n;
+	case '~':
+		return csi_tilde_key(n);
+	case 'A':
+		return KEY_UP;
+	case 'B':
+		return KEY_DOWN;
+	case 'C':
+		return KEY_RIGHT;
+	case 'D':
+		return KEY_LEFT;
+	case 'P': case 'Q': case 'R': case 'S':
+		/* F1..F4, with modifiers, e.g. ESC [ 1 ; 2 P */
+		return KEY_F(1 + final - 'P');
+	}
+
+	return KEY_UNKNOWN;
+}
+
+/*
+ * Decode a single key from the start of @s.
+ * Returns the number of bytes used, or 0 if @s ends in the middle of an
+ * escape sequence and we need to read more.
+ */
+static size_t decode(struct input *in, const unsigned char *s, size_t len,
+		     int *key)
+{
+	int param = 0, sub = 0;		/* position in "n[:x];mods[:event]" */
+	int n = 0, event = 0;
+	bool private = false;
+	size_t i;
+
+	*key = KEY_UNKNOWN;
+
+	if (s[0] != ESC) {
+		*key = s[0];
+		return 1;
+	}
+
+	if (len < 2)
+		return 0;
+
+	switch (s[1]) {
+	case 'O':		/* SS3: ESC O P..S are F1..F4 on xterm */
+		if (len < 3)
+			return 0;
+		if (s[2] >= 'P' && s[2] <= 'S')
+			*key = KEY_F(1 + s[2] - 'P');
+		return 3;
+	case '[':		/* CSI */
+		break;
+	default:
+		/* Alt+key or a lone escape; drop the ESC, keep the key */
+		return 1;
+	}
+
+	if (len < 3)
+		return 0;
+
+	/* Linux console: ESC [ [ A..E are F1..F5 */
+	if (s[2] == '[') {
+		if (len < 4)
+			return 0;
+		if (s[3] >= 'A' && s[3] <= 'E')
+			*key = KEY_F(1 + s[3] - 'A');
+		return 4;
+	}
+
+	/* Parameter bytes, then a final byte in 0x40-0x7e. We want the first
+	 * number, and the kitty event type after the modifiers.
+	 */
+	for (i = 2; i < len && i < CSI_MAX_LEN; i++) {
+		if (s[i] >= '0' && s[i] <= '9') {
+			if (param == 0 && sub == 0)
+				n = n * 10 + (s[i] - '0');
+			else if (param == 1 && sub == 1)
+				event = event * 10 + (s[i] - '0');
+			continue;
+		}
+
+		switch (s[i]) {
+		case '?':
+			private = true;
+			continue;
+		case ':':
+			sub++;
+			continue;
+		case ';':
+			param++;
+			sub = 0;
+			continue;
+		}
+
+		/* Reply to KEYBOARD_QUERY, the terminal speaks kitty */
+		if (private) {
+			if (s[i] == 'u')
+				in->events = true;
+			return i + 1;
+		}
+
+		*key = csi_key(s[i], n);
+
+		if (*key != KEY_UNKNOWN && event == 2)
+			*key |= INPUT_REPEAT;
+		else if (*key != KEY_UNKNOWN && event == 3)
+			*key |= INPUT_RELEASE;
+
+		return i + 1;
+	}
+
+	/* Ran out of bytes mid sequence */
+	if (i < CSI_MAX_LEN)
+		return 0;
+
+	/* Garbage, throw it away */
+	return i;
+}
+
+/*
+ * Decode everything currently in the buffer. Any trailing partial escape
+ * sequence is moved to the front of the buffer to be completed by the next
+ * read.
+ */
+static size_t decode_all(struct input *in, int *keys, size_t len)
+{
+	size_t n = 0, off = 0, used;
+	int key;
+
+	while (off < in->len && n < len) {
+		used = decode(in, &in->buf[off], in->len - off, &key);
+
+		if (used == 0) {
+			/* Buffer is full of a sequence we can't finish. */
+			if (off == 0 && in->len == sizeof in->buf)
+				used = 1;
+			else
+				break;
+		}
+
+		off += used;
+
+		if (key != KEY_UNKNOWN)
+			keys[n++] = key;
+	}
+
+	in->len -= off;
+	memmove(in->buf, &in->buf[off], in->len);
+
+	return n;
+}
+
+void input_init(struct input *in, int fd)
+{
+	in->fd = fd;
+	in->len = 0;
+	in->events = false;
+}
+
+/* Only pop what we pushed, the stack may hold the shell's own flags */
+static bool events_pushed = false;
+
+void input_events_enable(int fd)
+{
+	const char seq[] = KEYBOARD_PUSH KEYBOARD_QUERY;
+
+	if (events_pushed)
+		return;
+
+	if (write(fd, seq, sizeof seq - 1) < 0)
+		log_warn("Unable to enable key events: %s", strerror(errno));
+	else
+		events_pushed = true;
+}
+
+void input_events_disable(int fd)
+{
+	const char seq[] = KEYBOARD_POP;
+
+	if (!events_pushed)
+		return;
+
+	if (write(fd, seq, sizeof seq - 1) < 0)
+		log_warn("Unable to disable key events: %s", strerror(errno));
+
+	events_pushed = false;
+}
+
+ssize_t input_read(struct input *in, int *keys, size_t len)
+{
+	ssize_t ret;
+	size_t n;
+
+	if (len == 0)
+		return 0;
+
+	/* Keys left over from last time come first */
+	while ((n = decode_all(in, keys, len)) == 0) {
+		do {
+			ret = read(in->fd, &in->buf[in->len],
+				   sizeof in->buf - in->len);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret == 0)
+			return -1;
+
+		if (ret < 0) {
+			log_err("Unable to read input: %s", strerror(errno));
+			return -1;
+		}
+
+		in->len += ret;
+	}
+
+	return n;
+}
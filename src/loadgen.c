@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * blocks-load: load generator and benchmark for blocks-server.
+ *
+ * Plays -n sessions at once from a single epoll loop. Each presses a random
+ * key every -k msec, spread evenly over the interval so keys arrive at a
+ * steady rate, and sessions that lose are reconnected, so there are always
+ * -n games going. Once every session has connected it measures for -t
+ * seconds: frames and bytes received, and the time from sending a key to
+ * the next frame for that session. Frames are decoded like a real client
+ * would, into a struct wire_state per session; -T talks text instead.
+ *
+ * -v adds spectators on the server's -P or -U listener. They only read,
+ * and come back once the game they watched is over.
+ */
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "debug.h"
+#include "stats.h"
+#include "wire.h"
+
+#define LOAD_EVENTS	256
+
+/* Measure anyway if not every session has connected by then */
+#define LOAD_RAMP_NSEC	(30 * NSEC_PER_SEC)
+
+struct client {
+	int fd;				/* -1 when not connected */
+	bool connected;			/* connect() finished */
+	bool viewer;			/* watches, no keys */
+	bool nl;			/* last byte read was '\n' */
+	uint64_t sent_at;		/* key waiting on a frame, or 0 */
+	uint64_t next_key;
+
+	struct wire_state st;		/* the game, as far as we know */
+	uint8_t in[WIRE_FRAME_MAX];	/* start of a frame */
+	size_t in_len;
+};
+
+struct addr {
+	struct sockaddr_storage ss;
+	socklen_t len;
+};
+
+static struct {
+	struct addr addr, watch;
+	int epfd;
+
+	struct client *clients;
+	size_t n, viewers, connected;
+	bool measuring;
+	bool text;			/* -T */
+
+	/* While measuring */
+	uint64_t frames, bytes, games, errors;
+	uint64_t viewer_frames, viewer_bytes;
+	struct hist latency;
+} load;
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "%s-%s usage:\n"
+		"\t%s [-T] [-n sessions] [-v spectators] [-t secs] [-k msec] "
+		"[-H host]\n\t-p port | -u socket [-P port | -U socket]\n"
+		"\t[-T] the server is in text mode (blocks-server -t)\n"
+		"\t[-n sessions] games at once, default 1000\n"
+		"\t[-v spectators] watching, on -P or -U\n"
+		"\t[-t secs] how long to measure, default 10\n"
+		"\t[-k msec] between each session's keys, default 250\n"
+		"\t[-H host] IPv4 address, default 127.0.0.1\n",
+		__progname, VERSION, __progname);
+
+	exit(EXIT_FAILURE);
+}
+
+static void client_close(struct client *c)
+{
+	if (c->connected)
+		load.connected--;
+
+	close(c->fd);
+	c->fd = -1;
+	c->connected = false;
+	c->sent_at = 0;
+	c->nl = false;
+	c->in_len = 0;
+	memset(&c->st, 0, sizeof c->st);
+}
+
+static void client_connect(struct client *c)
+{
+	struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+	struct addr *a = c->viewer ? &load.watch : &load.addr;
+	int one = 1;
+
+	c->fd = socket(a->ss.ss_family,
+		       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) {
+		load.errors++;
+		return;
+	}
+
+	if (a->ss.ss_family == AF_INET)
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	if ((connect(c->fd, (struct sockaddr *) &a->ss, a->len) < 0 &&
+	     errno != EINPROGRESS) ||
+	    epoll_ctl(load.epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+		load.errors++;
+		client_close(c);
+	}
+}
+
+/* connect() is done, one way or the other */
+static void client_connected(struct client *c)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err || epoll_ctl(load.epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+		load.errors++;
+		client_close(c);
+		return;
+	}
+
+	c->connected = true;
+	load.connected++;
+}
+
+/* A whole frame came in */
+static void client_frame(struct client *c, uint64_t now)
+{
+	if (c->viewer) {
+		if (load.measuring)
+			load.viewer_frames++;
+		return;
+	}
+
+	if (load.measuring) {
+		load.frames++;
+		if (c->sent_at)
+			hist_record(&load.latency, now - c->sent_at);
+	}
+
+	c->sent_at = 0;
+}
+
+/* Frames end in an empty line */
+static void client_text(struct client *c, const uint8_t *buf, size_t n,
+			uint64_t now)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (buf[i] != '\n' || !c->nl) {
+			c->nl = buf[i] == '\n';
+			continue;
+		}
+
+		client_frame(c, now);
+		c->nl = false;
+	}
+}
+
+/* @buf has c->in_len bytes left over from last time, then @n new ones */
+static int client_wire(struct client *c, uint8_t *buf, size_t n,
+		       uint64_t now)
+{
+	size_t off = 0;
+	ssize_t len;
+
+	n += c->in_len;
+	while ((len = wire_decode(buf + off, n - off, &c->st)) > 0) {
+		client_frame(c, now);
+		off += len;
+	}
+
+	if (len < 0)
+		return -1;
+
+	c->in_len = n - off;
+	memcpy(c->in, buf + off, c->in_len);
+
+	return 1;
+}
+
+static void client_read(struct client *c, uint64_t now)
+{
+	static uint8_t buf[WIRE_FRAME_MAX + 16384];
+	ssize_t n;
+
+	memcpy(buf, c->in, c->in_len);
+	n = recv(c->fd, buf + c->in_len, sizeof buf - c->in_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	/* Lost, or the server went away. Back in on the next key. */
+	if (n <= 0) {
+		if (load.measuring && !c->viewer)
+			load.games++;
+		client_close(c);
+		return;
+	}
+
+	if (load.measuring)
+		*(c->viewer ? &load.viewer_bytes : &load.bytes) += n;
+
+	if (load.text) {
+		client_text(c, buf, n, now);
+	} else if (client_wire(c, buf, n, now) < 0) {
+		load.errors++;
+		client_close(c);
+	}
+}
+
+static void client_key(struct client *c, uint64_t now)
+{
+	const char keys[] = "aaddqesw ";
+	int key = keys[rand() % (sizeof keys - 1)];
+	uint8_t buf[WIRE_FRAME_MAX];
+	char ch = key;
+	ssize_t len, n;
+
+	if (c->fd < 0) {
+		client_connect(c);
+		return;
+	}
+
+	if (!c->connected || c->viewer)
+		return;
+
+	if (load.text) {
+		len = 1;
+		n = send(c->fd, &ch, 1, MSG_NOSIGNAL);
+	} else {
+		len = wire_encode_keys(buf, &key, 1);
+		n = send(c->fd, buf, len, MSG_NOSIGNAL);
+	}
+
+	/* Half a key frame would throw the rest off */
+	if (n > 0 && n < len) {
+		load.errors++;
+		client_close(c);
+		return;
+	}
+
+	if (n == len && !c->sent_at)
+		c->sent_at = now;
+}
+
+static int parse_addr(struct addr *a, const char *host, int port,
+		      const char *path)
+{
+	struct sockaddr_in *in = (struct sockaddr_in *) &a->ss;
+	struct sockaddr_un *un = (struct sockaddr_un *) &a->ss;
+
+	if (path) {
+		if (strlen(path) >= sizeof un->sun_path)
+			return -1;
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, path);
+		a->len = sizeof *un;
+		return 1;
+	}
+
+	in->sin_family = AF_INET;
+	in->sin_port = htons(port);
+	a->len = sizeof *in;
+
+	return inet_pton(AF_INET, host, &in->sin_addr) == 1 ? 1 : -1;
+}
+
+static void report(double secs, double cpu)
+{
+	const double p[] = { 50, 99, 99.9 };
+	uint64_t res[3];
+
+	hist_percentiles(&load.latency, p, res, 3);
+
+	printf("%zu sessions (%zu connected), %.1fs\n", load.n,
+	       load.connected, secs);
+	printf("frames %llu (%.0f/s), %.1f MB (%.2f MB/s)\n",
+	       (unsigned long long) load.frames, load.frames / secs,
+	       load.bytes / 1E6, load.bytes / 1E6 / secs);
+	printf("per session %.1f bytes/s, %.0f frames per CPU second here\n",
+	       load.bytes / secs / load.n, cpu > 0 ? load.frames / cpu : 0);
+	if (load.viewers)
+		printf("spectators %zu: frames %llu (%.0f/s), %.2f MB/s, "
+		       "%.1f bytes/s each\n", load.viewers,
+		       (unsigned long long) load.viewer_frames,
+		       load.viewer_frames / secs, load.viewer_bytes / 1E6 / secs,
+		       load.viewer_bytes / secs / load.viewers);
+	printf("games over %llu, connect errors %llu\n",
+	       (unsigned long long) load.games,
+	       (unsigned long long) load.errors);
+	printf("key to frame: %llu, p50 %.1fus, p99 %.1fus, p999 %.1fus, "
+	       "max %.1fus\n", (unsigned long long) load.latency.count,
+	       (double) res[0] / NSEC_PER_USEC, (double) res[1] / NSEC_PER_USEC,
+	       (double) res[2] / NSEC_PER_USEC,
+	       (double) load.latency.max / NSEC_PER_USEC);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *path = NULL, *watch_path = NULL;
+	struct epoll_event ev[LOAD_EVENTS];
+	uint64_t now, interval = 250 * NSEC_PER_MSEC, start = 0, end = 0, ramp;
+	struct timespec cpu_start, cpu_end;
+	double secs = 10;
+	struct client *c;
+	struct rlimit rl;
+	size_t i, total, next = 0;
+	int n, opt, port = 0, watch_port = 0, timeout;
+
+	load.n = 1000;
+
+	while ((opt = getopt(argc, argv, "hH:k:n:p:P:t:Tu:U:v:")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'k':
+			interval = atol(optarg) * NSEC_PER_MSEC;
+			break;
+		case 'n':
+			load.n = atol(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			watch_port = atoi(optarg);
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		case 'T':
+			load.text = true;
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		case 'U':
+			watch_path = optarg;
+			break;
+		case 'v':
+			load.viewers = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((!port && !path) || !load.n || !interval ||
+	    parse_addr(&load.addr, host, port, path) < 0 ||
+	    (load.viewers && ((!watch_port && !watch_path) || load.text ||
+			      parse_addr(&load.watch, host, watch_port,
+					 watch_path) < 0)))
+		usage();
+
+	/* One socket a session */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	srand(time(NULL));
+
+	load.epfd = epoll_create1(EPOLL_CLOEXEC);
+	total = load.n + load.viewers;
+	load.clients = calloc(total, sizeof *load.clients);
+	if (load.epfd < 0 || !load.clients) {
+		perror("blocks-load");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Spread the sessions' keys evenly over one interval. Going through
+	 * them in order is then going through them in time. Spectators are
+	 * last, their "key" is just coming back if they were hung up on.
+	 */
+	now = stats_now();
+	ramp = now + LOAD_RAMP_NSEC;
+	for (i = 0; i < total; i++) {
+		load.clients[i].fd = -1;
+		load.clients[i].viewer = i >= load.n;
+		load.clients[i].next_key = now + interval * i / total;
+	}
+
+	while (!end || now < end) {
+		c = &load.clients[next];
+		while (c->next_key <= now) {
+			client_key(c, now);
+			c->next_key += interval;
+			next = (next + 1) % total;
+			c = &load.clients[next];
+		}
+
+		/* Rounded up, a key a msec late beats spinning until then */
+		timeout = (c->next_key - now + NSEC_PER_MSEC - 1) /
+			NSEC_PER_MSEC;
+		n = epoll_wait(load.epfd, ev, LOAD_EVENTS, timeout);
+		now = stats_now();
+
+		while (n-- > 0) {
+			c = ev[n].data.ptr;
+			if (!c->connected)
+				client_connected(c);
+			else
+				client_read(c, now);
+		}
+
+		if (!start && (load.connected == total || now >= ramp)) {
+			start = now;
+			end = start + secs * NSEC_PER_SEC;
+			load.measuring = true;
+			load.errors = 0;
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+		}
+	}
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+	report((double) (now - start) / NSEC_PER_SEC,
+	       (cpu_end.tv_sec - cpu_start.tv_sec) +
+	       (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1E9);
+
+	return 0;
+}
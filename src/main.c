@@ -19,28 +19,65 @@
 /* Non-standard BSD extensions */
 #include <bsd/string.h>
 
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <locale.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "blocks.h"
+#include "checkpoint.h"
+#include "clock.h"
 #include "db.h"
 #include "debug.h"
+#include "input.h"
+#include "metrics.h"
 #include "screen.h"
+#include "trace.h"
+#include "tty.h"
+#include "versus.h"
+
+/* Drives the game we play, see blocks.h */
+static struct blocks_host game_host;
+
+/* What screen_draw_over() made of saving the game */
+static int saved;
+
+/* -c, for every game we play */
+static enum blocks_rotation rotation = ROTATION_SRS;
 
 /* We can exit() at any point and still safely cleanup */
 static void cleanup(void)
 {
+	bool written;
+
+	input_events_disable(fileno(stdout));
+	metrics_stop();
+	written = db_close() > 0;
+
+	/* A lost game's checkpoint would only bring it back from the dead. A
+	 * quit one is all that's left of the game until its save is in the
+	 * database.
+	 */
+	checkpoint_close(pgame && (pgame->lose ||
+				   (pgame->quit && saved > 0 && written)));
 	screen_cleanup();
 	blocks_cleanup();
+	blocks_host_destroy(&game_host);
+
+	/* Everything still in the log rings, then back to plain writes */
+	debug_stop();
 
 	/* Game separator */
 	fprintf(stderr, "--\n");
@@ -65,7 +102,13 @@ static void usage(void)
 
 	extern const char *__progname;
 	fprintf(stderr, "%s\nBuilt on %s at %s\n"
-		"%s-%s usage:\n\t" "[-h] this help\n",
+		"%s-%s usage:\n\t" "[-h] this help\n"
+		"\t[-a socket] play on a blocks-server -a, on this terminal\n"
+		"\t[-b games] play games with a bot, on a virtual clock\n"
+		"\t[-c] classic rotation, no SRS kicks\n"
+		"\t[-m socket] serve Prometheus metrics on a Unix socket\n"
+		"\t[-r msec[/jitter[/loss]]] bots play versus over a fake link\n"
+		"\t[-s slot] save slot to resume from and save to\n",
 		LICENSE, __DATE__, __TIME__, __progname, VERSION);
 
 	exit(EXIT_FAILURE);
@@ -99,7 +142,7 @@ static int try_mkdir(const char *path, mode_t mode)
 	return 1;
 }
 
-static void init(void)
+static void init(bool metrics)
 {
 	/* Most file systems limit the size of filenames to 255 octets */
 	char *home_env, game_dir[256];
@@ -137,10 +180,19 @@ static void init(void)
 		exit(EXIT_FAILURE);
 	}
 
+	/* From here on the log is written by its own thread */
+	if (debug_start() < 0)
+		fprintf(stderr, "Unable to start the log writer\n");
+
 	srand(time(NULL));
 
 	/* Create game context */
+	blocks_host_init(&game_host);
+	phost = &game_host;
+
 	if (blocks_init() > 0) {
+		blocks_rotation(rotation);
+		game_host.game = pgame;
 		printf("Game successfully initialized\n");
 		printf("Appending logs to file: %s.\n", game_dir);
 	} else {
@@ -149,7 +201,7 @@ static void init(void)
 	}
 
 	/* create ncurses display */
-	screen_init();
+	screen_init(metrics);
 
 	return;
 
@@ -158,33 +210,402 @@ static void init(void)
 	exit(EXIT_FAILURE);
 }
 
+/* How long the bot waits between keys, in game time */
+#define BOT_DELAY (50 * NSEC_PER_MSEC)
+
+/* Random key mashing. Not a good player, but it hits every code path. */
+static void bot_idle(struct clock_virtual *virt, uint64_t deadline)
+{
+	const char bot_keys[] = "aaddqesw ";
+	uint64_t *next = virt->arg;
+	int key;
+
+	(void) deadline; /* unused */
+
+	if (virt->now < *next)
+		return;
+
+	key = bot_keys[rand() % (sizeof bot_keys - 1)];
+	blocks_keys(&key, 1, false);
+
+	*next = virt->now + BOT_DELAY;
+}
+
+/*
+ * Headless games on the virtual clock. The game loop is exactly the one we
+ * play on, but time jumps straight to the next deadline, so a game that
+ * would take minutes is over in milliseconds. Handy for testing, bots and
+ * load generation.
+ */
+static void bot_play(int games)
+{
+	struct clock_virtual virt;
+	struct blocks_host host;
+	struct timespec start, end;
+	uint64_t next;
+	double secs;
+	int i;
+
+	srand(time(NULL));
+
+	for (i = 0; i < games; i++) {
+		clock_virtual_init(&virt, 0);
+		virt.idle = bot_idle;
+		virt.arg = &next;
+		next = 0;
+
+		blocks_host_init(&host);
+		host.clock = &virt.clock;
+		host.draw = NULL;
+		phost = &host;
+
+		if (blocks_init() < 0)
+			exit(EXIT_FAILURE);
+		blocks_rotation(rotation);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		blocks_loop(NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1E9;
+
+		printf("Game %d: level %d, score %d, %.1fs played in %.3fs\n",
+		       i + 1, pgame->level, pgame->score,
+		       (double) virt.now / NSEC_PER_SEC, secs);
+
+		blocks_cleanup();
+		blocks_host_destroy(&host);
+	}
+}
+
+/* A one way link for versus bots: packets take @delay plus up to @jitter,
+ * so they can overtake each other, and @loss percent never arrive.
+ */
+#define LINK_QUEUE 256
+
+struct link {
+	uint64_t delay, jitter;			/* nsec */
+	unsigned loss;
+	size_t len;
+	struct {
+		uint64_t at;
+		struct versus_packet pkt;
+	} queue[LINK_QUEUE];
+};
+
+static void link_send(struct link *l, const struct versus_packet *pkt,
+		      uint64_t now)
+{
+	if ((unsigned) rand() % 100 < l->loss || l->len == LEN(l->queue))
+		return;
+
+	l->queue[l->len].at = now + l->delay +
+		(l->jitter ? (uint64_t) rand() % l->jitter : 0);
+	l->queue[l->len].pkt = *pkt;
+	l->len++;
+}
+
+/* Hand @vs everything that arrived by @now */
+static void link_receive(struct link *l, struct versus *vs, uint64_t now)
+{
+	size_t i = 0;
+
+	while (i < l->len) {
+		if (l->queue[i].at > now) {
+			i++;
+			continue;
+		}
+
+		versus_receive(vs, &l->queue[i].pkt);
+		l->queue[i] = l->queue[--l->len];
+	}
+}
+
+/* Same mix of keys as bot_idle(), one every BOT_DELAY or so */
+static uint8_t bot_keys(void)
+{
+	const enum blocks_input_cmd cmds[] = {
+		MOVE_LEFT, MOVE_LEFT, MOVE_RIGHT, MOVE_RIGHT, ROT_LEFT,
+		ROT_RIGHT, MOVE_DOWN, MOVE_DROP, HOLD,
+	};
+
+	if ((uint64_t) rand() % (BOT_DELAY / VERSUS_FRAME_NSEC))
+		return 0;
+
+	return VERSUS_KEY(cmds[rand() % LEN(cmds)]);
+}
+
+/* Longest a versus match may go on, in frames */
+#define VERSUS_MAX_FRAMES (VERSUS_FPS * 3600)
+
+/*
+ * Two bots play versus over a pair of fake links, both peers in this thread
+ * on one frame clock. Once a match is settled both have to agree on who won
+ * and on every bit of both games, or the lockstep is broken. Reports what
+ * rolling back cost, in real time.
+ */
+static void versus_play(int matches, const char *spec)
+{
+	const double p[] = { 50, 99 };
+	unsigned delay = 0, jitter = 0, loss = 0;
+	uint64_t total_replayed = 0, total_nsec = 0, total_frames = 0;
+	enum versus_result r[2];
+	struct versus_packet pkt;
+	struct versus *peers;
+	struct link *links;
+	uint64_t pct[LEN(p)], fpct[LEN(p)], now;
+	uint32_t frame, end, seed;
+	int i, m;
+
+	if (sscanf(spec, "%u/%u/%u", &delay, &jitter, &loss) < 1 || loss > 100)
+		usage();
+
+	peers = calloc(2, sizeof *peers);
+	links = calloc(2, sizeof *links);
+	if (!peers || !links) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(time(NULL));
+
+	for (m = 0; m < matches; m++) {
+		seed = rand();
+		for (i = 0; i < 2; i++) {
+			if (versus_init(&peers[i], seed, i) < 0)
+				exit(EXIT_FAILURE);
+
+			links[i].delay = delay * NSEC_PER_MSEC;
+			links[i].jitter = jitter * NSEC_PER_MSEC;
+			links[i].loss = loss;
+			links[i].len = 0;
+		}
+
+		end = VERSUS_MAX_FRAMES;
+		for (frame = 0; ; frame++) {
+			now = (uint64_t) frame * VERSUS_FRAME_NSEC;
+
+			for (i = 0; i < 2; i++) {
+				link_receive(&links[i], &peers[i], now);
+
+				/* Catch up after a stall, as a real one would */
+				while (peers[i].frame <= frame &&
+				       peers[i].frame < end &&
+				       versus_advance(&peers[i], bot_keys()))
+					;
+
+				versus_packet(&peers[i], &pkt);
+				link_send(&links[!i], &pkt, now);
+			}
+
+			if (end == VERSUS_MAX_FRAMES &&
+			    (versus_result(&peers[0]) ||
+			     versus_result(&peers[1])))
+				end = peers[0].frame > peers[1].frame ?
+					peers[0].frame : peers[1].frame;
+
+			/* Everyone there and nothing left to roll back */
+			if (peers[0].confirmed >= end &&
+			    peers[1].confirmed >= end &&
+			    peers[0].frame == end && peers[1].frame == end)
+				break;
+		}
+
+		r[0] = versus_result(&peers[0]);
+		r[1] = versus_result(&peers[1]);
+		if (!(r[0] == VERSUS_WON && r[1] == VERSUS_LOST) &&
+		    !(r[0] == VERSUS_LOST && r[1] == VERSUS_WON) &&
+		    !(r[0] == VERSUS_DRAW && r[1] == VERSUS_DRAW))
+			printf("Match %d: peers disagree on who won\n", m + 1);
+
+		for (i = 0; i < 2; i++)
+			if (versus_checksum(&peers[0], i) !=
+			    versus_checksum(&peers[1], !i))
+				printf("Match %d: game %d out of sync\n",
+				       m + 1, i + 1);
+
+		hist_percentiles(&peers[0].rollback_time, p, pct, LEN(p));
+		hist_percentiles(&peers[0].frame_time, p, fpct, LEN(p));
+
+		printf("Match %d: %s after %.1fs, scores %u/%u, %" PRIu64
+		       " rollbacks of %.1f frames, p50 %.1fus p99 %.1fus, "
+		       "frame p50 %.1fus, %" PRIu64 " stalls\n", m + 1,
+		       r[0] == VERSUS_WON ? "won" : r[0] == VERSUS_LOST ? "lost" :
+		       r[0] == VERSUS_DRAW ? "draw" : "unfinished", (double) end / VERSUS_FPS,
+		       peers[0].games[0]->score, peers[0].games[1]->score,
+		       peers[0].rollbacks, peers[0].rollbacks ?
+		       (double) peers[0].replayed / peers[0].rollbacks : 0,
+		       pct[0] / 1E3, pct[1] / 1E3, fpct[0] / 1E3,
+		       peers[0].stalls);
+
+		for (i = 0; i < 2; i++) {
+			total_replayed += peers[i].replayed;
+			total_nsec += peers[i].replay_nsec;
+			total_frames += peers[i].frame;
+			versus_cleanup(&peers[i]);
+		}
+	}
+
+	printf("%" PRIu64 " frames, %" PRIu64 " replayed, %.2fus per "
+	       "replayed frame\n", total_frames, total_replayed,
+	       total_replayed ? total_nsec / 1E3 / total_replayed : 0);
+
+	free(links);
+	free(peers);
+}
+
+/*
+ * The game runs in blocks-server, we hand it our terminal and wait for it
+ * to hang up. Putting the terminal back is up to us, so a server that
+ * goes away can't leave it in raw mode.
+ */
+static int attach(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct tty_hello hello;
+	char cbuf[CMSG_SPACE(sizeof (int))];
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof hello };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof cbuf,
+	};
+	struct cmsghdr *cmsg;
+	struct termios saved, raw;
+	int fd, tty, ret = 1;
+	ssize_t n;
+	char c;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((tty = open("/dev/tty", O_RDWR | O_CLOEXEC)) < 0 ||
+	    tcgetattr(tty, &saved) < 0) {
+		perror("/dev/tty");
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	memset(&hello, 0, sizeof hello);
+	strlcpy(hello.name, getenv("USER") ? getenv("USER") : "Lorem Ipsum",
+		sizeof hello.name);
+
+	memset(cbuf, 0, sizeof cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof tty);
+	memcpy(CMSG_DATA(cmsg), &tty, sizeof tty);
+
+	/* Keys go straight through, ^C included */
+	raw = saved;
+	cfmakeraw(&raw);
+	tcsetattr(tty, TCSAFLUSH, &raw);
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof hello) {
+		perror(path);
+		ret = -1;
+	}
+
+	/* Nothing ever comes, we wait for the hangup */
+	while (ret > 0 && ((n = read(fd, &c, 1)) > 0 ||
+			   (n < 0 && errno == EINTR)))
+		;
+
+	tcsetattr(tty, TCSAFLUSH, &saved);
+	close(fd);
+	close(tty);
+
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	pthread_t input_loop;
+	const char *metrics_path = NULL, *link = NULL, *host = NULL;
+	int opt, games = 0;
 
 	setlocale(LC_ALL, "");
-	if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'h')
-		usage();
+
+	/* Only in trace builds. Dumps on exit and on SIGUSR1. */
+	trace_start(getenv("BLOCKS_TRACE") ? getenv("BLOCKS_TRACE")
+					   : "blocks-trace.json");
+
+	while ((opt = getopt(argc, argv, "a:hb:cm:r:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			host = optarg;
+			break;
+		case 'b':
+			games = atoi(optarg);
+			break;
+		case 'c':
+			rotation = ROTATION_CLASSIC;
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'r':
+			link = optarg;
+			break;
+		case 's':
+			strlcpy(psave->slot, optarg, sizeof psave->slot);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (host)
+		return attach(host) < 0 ? EXIT_FAILURE : 0;
+
+	if (link) {
+		versus_play(games ? games : 1, link);
+		return 0;
+	}
+
+	if (games) {
+		if (metrics_path)
+			metrics_start(metrics_path);
+		bot_play(games);
+		metrics_stop();
+		return 0;
+	}
 
 	/* Quit if we're not attached to a tty */
 	if (!isatty(fileno(stdin)))
 		exit(EXIT_FAILURE);
 
-	init();
+	init(metrics_path != NULL);
 	atexit(cleanup);
 
+	/* After init(), so any errors end up in the log */
+	if (metrics_path)
+		metrics_start(metrics_path);
+
 	screen_draw_menu();
 	screen_draw_game();
 
-	pthread_create(&input_loop, NULL, blocks_input, NULL);
+	pthread_create(&input_loop, NULL, blocks_input, phost);
 
 	blocks_loop(NULL);
 
 	/* when blocks_loop returns, kill the input thread and cleanup */
 	pthread_cancel(input_loop);
+	input_events_disable(fileno(stdout));
 
 	/* Print scores, tell user they're a loser, etc. */
-	screen_draw_over();
+	saved = screen_draw_over();
 
 	return 0;
 }
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "clock.h"
+#include "debug.h"
+#include "metrics.h"
+
+/* How long a client gets to send its request, if it sends one at all */
+#define METRICS_READ_MSEC	100
+
+static const struct {
+	const char *name, *help;
+} counter_info[METRIC_LEN] = {
+	[METRIC_TICKS] = { "blocks_ticks_total", "Gravity ticks" },
+	[METRIC_PIECES] = { "blocks_pieces_total", "Pieces locked in place" },
+	[METRIC_LINES] = { "blocks_lines_cleared_total", "Lines cleared" },
+	[METRIC_TERM_BYTES] = { "blocks_terminal_bytes_total",
+		"Bytes written to the terminal" },
+	[METRIC_SENT_BYTES] = { "blocks_sent_bytes_total",
+		"Bytes sent to network clients" },
+	[METRIC_FRAMES_SENT] = { "blocks_frames_sent_total",
+		"Frames sent to network clients" },
+	[METRIC_RESYNCS] = { "blocks_spectator_resyncs_total",
+		"Spectators sent a keyframe for falling behind" },
+}, hist_info[METRIC_HIST_LEN] = {
+	[METRIC_FRAME] = { "blocks_frame_seconds", "Time to draw a frame" },
+	[METRIC_DB] = { "blocks_db_seconds",
+		"Database reads and write transactions" },
+}, gauge_info[METRIC_GAUGE_LEN] = {
+	[METRIC_LEVEL] = { "blocks_level", "Current level" },
+	[METRIC_SCORE] = { "blocks_score", "Current score" },
+	[METRIC_SESSIONS] = { "blocks_sessions", "Network clients playing" },
+	[METRIC_VIEWERS] = { "blocks_spectators", "Network clients watching" },
+};
+
+/* Histogram bucket upper bounds, nsec. One more bucket for the rest. */
+static const uint64_t bounds[] = {
+	100 * NSEC_PER_USEC, 250 * NSEC_PER_USEC, 500 * NSEC_PER_USEC,
+	1 * NSEC_PER_MSEC, 2500 * NSEC_PER_USEC, 5 * NSEC_PER_MSEC,
+	10 * NSEC_PER_MSEC, 25 * NSEC_PER_MSEC, 50 * NSEC_PER_MSEC,
+	100 * NSEC_PER_MSEC, 250 * NSEC_PER_MSEC, NSEC_PER_SEC,
+};
+
+/* Everything one thread counts. Only its owner writes to it. */
+struct metrics_thread {
+	uint64_t counter[METRIC_LEN];
+	struct {
+		uint64_t sum;
+		uint64_t buckets[LEN(bounds) + 1];
+	} hist[METRIC_HIST_LEN];
+};
+
+static struct {
+	unsigned nthreads;		/* handed out, may be > than */
+	struct metrics_thread *threads[METRICS_MAX_THREADS]; /* never freed */
+	struct metrics_thread shared;	/* for everyone after that */
+	int64_t gauge[METRIC_GAUGE_LEN];
+} metrics;
+
+static struct {
+	pthread_t thread;
+	int fd;
+	bool running;
+	struct sockaddr_un addr;
+} server = {
+	.fd = -1,
+};
+
+static __thread struct metrics_thread *my_metrics;
+
+/* The calling thread's counters, made on first use */
+static struct metrics_thread *metrics_thread(void)
+{
+	unsigned i;
+
+	if (my_metrics)
+		return my_metrics;
+
+	i = __atomic_fetch_add(&metrics.nthreads, 1, __ATOMIC_RELAXED);
+	if (i >= METRICS_MAX_THREADS ||
+	    !(my_metrics = calloc(1, sizeof *my_metrics))) {
+		my_metrics = &metrics.shared;
+		return my_metrics;
+	}
+
+	__atomic_store_n(&metrics.threads[i], my_metrics, __ATOMIC_RELEASE);
+
+	return my_metrics;
+}
+
+/* Only the owner writes, so a load and a store will do. The scraper may
+ * see the old value, never a torn one.
+ */
+static void bump(struct metrics_thread *m, uint64_t *p, uint64_t n)
+{
+	if (m == &metrics.shared)
+		__atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metric id, uint64_t n)
+{
+	struct metrics_thread *m = metrics_thread();
+
+	bump(m, &m->counter[id], n);
+}
+
+void metrics_observe(enum metric_hist id, uint64_t nsec)
+{
+	struct metrics_thread *m = metrics_thread();
+	size_t i;
+
+	for (i = 0; i < LEN(bounds) && nsec > bounds[i]; i++)
+		;
+
+	bump(m, &m->hist[id].buckets[i], 1);
+	bump(m, &m->hist[id].sum, nsec);
+}
+
+void metrics_set(enum metric_gauge id, int64_t value)
+{
+	__atomic_store_n(&metrics.gauge[id], value, __ATOMIC_RELAXED);
+}
+
+/* Add up every thread's counters into @sum */
+static void metrics_sum(struct metrics_thread *sum)
+{
+	const struct metrics_thread *m;
+	unsigned i, n;
+	size_t j, k;
+
+	memset(sum, 0, sizeof *sum);
+
+	n = __atomic_load_n(&metrics.nthreads, __ATOMIC_RELAXED);
+	if (n > METRICS_MAX_THREADS)
+		n = METRICS_MAX_THREADS;
+
+	for (i = 0; i <= n; i++) {
+		m = i < n ? __atomic_load_n(&metrics.threads[i],
+					    __ATOMIC_ACQUIRE)
+			  : &metrics.shared;
+		if (!m)
+			continue;
+
+		for (j = 0; j < METRIC_LEN; j++)
+			sum->counter[j] += __atomic_load_n(&m->counter[j],
+							   __ATOMIC_RELAXED);
+
+		for (j = 0; j < METRIC_HIST_LEN; j++) {
+			sum->hist[j].sum += __atomic_load_n(&m->hist[j].sum,
+							    __ATOMIC_RELAXED);
+			for (k = 0; k <= LEN(bounds); k++)
+				sum->hist[j].buckets[k] += __atomic_load_n(
+					&m->hist[j].buckets[k],
+					__ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Prometheus text format, version 0.0.4 */
+static void metrics_write(FILE *fp)
+{
+	struct metrics_thread sum;
+	uint64_t count;
+	size_t i, j;
+
+	metrics_sum(&sum);
+
+	for (i = 0; i < METRIC_LEN; i++)
+		fprintf(fp, "# HELP %s %s.\n# TYPE %s counter\n%s %llu\n",
+			counter_info[i].name, counter_info[i].help,
+			counter_info[i].name, counter_info[i].name,
+			(unsigned long long) sum.counter[i]);
+
+	for (i = 0; i < METRIC_HIST_LEN; i++) {
+		fprintf(fp, "# HELP %s %s.\n# TYPE %s histogram\n",
+			hist_info[i].name, hist_info[i].help,
+			hist_info[i].name);
+
+		/* Buckets are cumulative, and +Inf is the count */
+		for (j = 0, count = 0; j <= LEN(bounds); j++) {
+			count += sum.hist[i].buckets[j];
+			if (j < LEN(bounds))
+				fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n",
+					hist_info[i].name,
+					(double) bounds[j] / NSEC_PER_SEC,
+					(unsigned long long) count);
+		}
+
+		fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n"
+			"%s_sum %.9f\n%s_count %llu\n",
+			hist_info[i].name, (unsigned long long) count,
+			hist_info[i].name,
+			(double) sum.hist[i].sum / NSEC_PER_SEC,
+			hist_info[i].name, (unsigned long long) count);
+	}
+
+	for (i = 0; i < METRIC_GAUGE_LEN; i++)
+		fprintf(fp, "# HELP %s %s.\n# TYPE %s gauge\n%s %lld\n",
+			gauge_info[i].name, gauge_info[i].help,
+			gauge_info[i].name, gauge_info[i].name,
+			(long long) __atomic_load_n(&metrics.gauge[i],
+						    __ATOMIC_RELAXED));
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		/* A scraper hanging up early mustn't SIGPIPE the game */
+		if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/* Answer one client. HTTP if it asks with a GET, like a Prometheus
+ * scraper, otherwise just the metrics, for socat and friends.
+ */
+static void metrics_serve(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char req[512] = "", head[128], *body = NULL;
+	size_t len = 0;
+	ssize_t n;
+	FILE *fp;
+
+	if (poll(&pfd, 1, METRICS_READ_MSEC) > 0 &&
+	    (n = recv(fd, req, sizeof req - 1, 0)) > 0)
+		req[n] = '\0';
+
+	if (!(fp = open_memstream(&body, &len))) {
+		log_err("Out of memory");
+		return;
+	}
+
+	metrics_write(fp);
+	fclose(fp);
+
+	if (!strncmp(req, "GET ", 4)) {
+		n = snprintf(head, sizeof head, "HTTP/1.0 200 OK\r\n"
+			     "Content-Type: text/plain; version=0.0.4\r\n"
+			     "Content-Length: %zu\r\n\r\n", len);
+		send_all(fd, head, n);
+	}
+
+	send_all(fd, body, len);
+	free(body);
+}
+
+static void *metrics_loop(void *vp)
+{
+	(void) vp; /* unused */
+
+	int fd;
+
+	/* Ends when metrics_stop() shuts the socket down */
+	while ((fd = accept(server.fd, NULL, NULL)) >= 0 || errno == EINTR ||
+	       errno == ECONNABORTED) {
+		if (fd < 0)
+			continue;
+
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int metrics_start(const char *path)
+{
+	struct stat sb;
+
+	if (server.running)
+		return 1;
+
+	if (strlen(path) >= sizeof server.addr.sun_path) {
+		log_err("Metrics socket path too long: %s", path);
+		return -1;
+	}
+
+	server.addr.sun_family = AF_UNIX;
+	strcpy(server.addr.sun_path, path);
+
+	/* A socket left over from an old game, but nothing else */
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode)) {
+			log_err("Not replacing %s, it isn't a socket", path);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if ((server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    bind(server.fd, (struct sockaddr *) &server.addr,
+		 sizeof server.addr) < 0 ||
+	    listen(server.fd, 8) < 0) {
+		log_err("Cannot serve metrics on %s: %s", path,
+			strerror(errno));
+		goto err;
+	}
+
+	if (pthread_create(&server.thread, NULL, metrics_loop, NULL) != 0) {
+		log_err("Cannot start the metrics thread");
+		unlink(path);
+		goto err;
+	}
+
+	server.running = true;
+	log_info("Serving metrics on %s", path);
+
+	return 1;
+
+ err:
+	if (server.fd >= 0)
+		close(server.fd);
+	server.fd = -1;
+	return -1;
+}
+
+void metrics_stop(void)
+{
+	if (!server.running)
+		return;
+
+	/* Wakes accept() up with an error */
+	shutdown(server.fd, SHUT_RDWR);
+	pthread_join(server.thread, NULL);
+
+	close(server.fd);
+	unlink(server.addr.sun_path);
+
+	server.fd = -1;
+	server.running = false;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "debug.h"
+#include "pool.h"
+
+/* Sits in the first slot of its slab */
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+void pool_init(struct pool *pool, size_t size)
+{
+	memset(pool, 0, sizeof *pool);
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	pool->size = (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+}
+
+static int pool_grow(struct pool *pool)
+{
+	struct pool_slab *slab;
+	size_t first;
+
+	/* Zeroed, and page aligned so the slots are cache line aligned */
+	slab = mmap(NULL, POOL_SLAB, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED) {
+		log_err("Cannot map a slab: %s", strerror(errno));
+		return -1;
+	}
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->nslabs++;
+
+	first = (sizeof *slab + pool->size - 1) / pool->size * pool->size;
+	pool->next = (char *) slab + first;
+	pool->end = (char *) slab + POOL_SLAB / pool->size * pool->size;
+
+	return 1;
+}
+
+void *pool_get(struct pool *pool)
+{
+	void *slot;
+
+	if (pool->free) {
+		slot = pool->free;
+		pool->free = *(void **) slot;
+		memset(slot, 0, pool->size);
+	} else {
+		if (pool->next >= pool->end && pool_grow(pool) < 0)
+			return NULL;
+
+		/* Never handed out, still zero from mmap() */
+		slot = pool->next;
+		pool->next += pool->size;
+	}
+
+	pool->used++;
+
+	return slot;
+}
+
+void pool_put(struct pool *pool, void *slot)
+{
+	if (!slot)
+		return;
+
+	*(void **) slot = pool->free;
+	pool->free = slot;
+	pool->used--;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	struct pool_slab *slab;
+
+	if (pool->used)
+		log_warn("Pool destroyed with %zu slots in use", pool->used);
+
+	while ((slab = pool->slabs)) {
+		pool->slabs = slab->next;
+		munmap(slab, POOL_SLAB);
+	}
+
+	pool->free = NULL;
+	pool->next = pool->end = NULL;
+	pool->used = pool->nslabs = 0;
+}
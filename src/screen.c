@@ -17,15 +17,26 @@
  */
 
 #include <bsd/string.h>
+#include <sys/ioctl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <ncurses.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
 
 #include "blocks.h"
+#include "checkpoint.h"
 #include "db.h"
 #include "debug.h"
+#include "metrics.h"
 #include "screen.h"
+#include "trace.h"
 
 #define GAME_Y_OFF 2
 #define GAME_X_OFF 2
@@ -33,6 +44,9 @@
 #define TEXT_Y_OFF 2
 #define TEXT_X_OFF (BLOCKS_MAX_COLUMNS + GAME_X_OFF + 2)
 
+#define STATS_X_OFF (TEXT_X_OFF + 18)
+#define STATS_WIDTH 34
+
 #define BLOCK_CHAR "x"
 
 static WINDOW *board, *pieces;
@@ -41,10 +55,159 @@ static const char colors[] = { COLOR_WHITE, COLOR_RED, COLOR_GREEN,
 	COLOR_YELLOW, COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN
 };
 
-void screen_init(void)
+/* ncurses writes its output buffer with write(2) and has no hook for it. To
+ * count the terminal's bytes, ncurses gets a pty of its own instead, and a
+ * thread copies whatever it draws over to the terminal. ncurses only ever
+ * sets the modes of that pty, so the terminal's are set here, and so is
+ * its size whenever the terminal's changes.
+ */
+static struct {
+	SCREEN *screen;
+	FILE *out;			/* ncurses' side */
+	int master, slave;
+	pthread_t thread;
+	struct termios saved;		/* the terminal's, before us */
+	struct sigaction winch;		/* ncurses' SIGWINCH handler */
+} relay = { .master = -1, .slave = -1 };
+
+/* The terminal was resized. ncurses asks its own side of the pty how big
+ * it is, so that's told first, then ncurses' handler carries on.
+ */
+static void relay_winch(int sig, siginfo_t *info, void *ctx)
+{
+	struct winsize ws;
+	int saved = errno;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+		ioctl(relay.slave, TIOCSWINSZ, &ws);
+	errno = saved;
+
+	if (relay.winch.sa_flags & SA_SIGINFO)
+		relay.winch.sa_sigaction(sig, info, ctx);
+	else if (relay.winch.sa_handler != SIG_DFL &&
+		 relay.winch.sa_handler != SIG_IGN)
+		relay.winch.sa_handler(sig);
+}
+
+static void *relay_loop(void *arg)
+{
+	char buf[4096];
+	ssize_t n, off, w;
+
+	(void) arg;
+
+	/* EIO once ncurses' side is closed */
+	for (;;) {
+		if ((n = read(relay.master, buf, sizeof buf)) < 0 &&
+		    errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		for (off = 0; off < n; off += w)
+			if ((w = write(STDOUT_FILENO, buf + off, n - off)) < 0) {
+				if (errno != EINTR)
+					return NULL;
+				w = 0;
+			}
+
+		metrics_add(METRIC_TERM_BYTES, n);
+	}
+
+	return NULL;
+}
+
+static int relay_start(void)
+{
+	struct sigaction sa = { .sa_sigaction = relay_winch,
+				.sa_flags = SA_SIGINFO | SA_RESTART };
+	char name[64];
+	struct termios t;
+	struct winsize ws;
+	int slave = -1;
+
+	if ((relay.master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+	    grantpt(relay.master) < 0 || unlockpt(relay.master) < 0 ||
+	    ptsname_r(relay.master, name, sizeof name) ||
+	    (slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+	    tcgetattr(STDIN_FILENO, &relay.saved) < 0)
+		goto err;
+
+	/* The pty starts out as the terminal is */
+	tcsetattr(slave, TCSANOW, &relay.saved);
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+		ioctl(slave, TIOCSWINSZ, &ws);
+
+	if (!(relay.out = fdopen(slave, "w")))
+		goto err;
+	relay.slave = slave;
+	slave = -1;
+
+	if (!(relay.screen = newterm(NULL, relay.out, stdin)))
+		goto err;
+
+	/* After newterm(), which sets up ncurses' handler for us to pass on to */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, &relay.winch);
+
+	/* What cbreak(), noecho() and nonl() would do. Output is already
+	 * processed on the pty's side.
+	 */
+	t = relay.saved;
+	t.c_lflag &= ~(ICANON | ECHO);
+	t.c_iflag &= ~ICRNL;
+	t.c_oflag &= ~OPOST;
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &t);
+
+	if (pthread_create(&relay.thread, NULL, relay_loop, NULL)) {
+		sigaction(SIGWINCH, &relay.winch, NULL);
+		tcsetattr(STDIN_FILENO, TCSANOW, &relay.saved);
+		endwin();
+		delscreen(relay.screen);
+		relay.screen = NULL;
+		goto err;
+	}
+
+	return 1;
+
+ err:
+	log_warn("Can't count terminal bytes: %s", strerror(errno));
+	if (relay.out)
+		fclose(relay.out);
+	if (slave >= 0)
+		close(slave);
+	if (relay.master >= 0)
+		close(relay.master);
+	relay.out = NULL;
+	relay.master = -1;
+	relay.slave = -1;
+	return -1;
+}
+
+/* Everything ncurses drew out to the terminal, then the terminal back */
+static void relay_stop(void)
+{
+	if (!relay.screen)
+		return;
+
+	sigaction(SIGWINCH, &relay.winch, NULL);
+	delscreen(relay.screen);
+	fclose(relay.out);
+	pthread_join(relay.thread, NULL);
+	close(relay.master);
+	relay.slave = -1;
+
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &relay.saved);
+	relay.screen = NULL;
+}
+
+void screen_init(bool count_bytes)
 {
 	log_info("Initializing ncurses context");
-	initscr();
+	if (!count_bytes || relay_start() < 0)
+		initscr();
 
 	cbreak();
 	noecho();
@@ -71,6 +234,7 @@ void screen_init(void)
 	mvwprintw(board, TEXT_Y_OFF +13, TEXT_X_OFF +2, "Move [asd]");
 	mvwprintw(board, TEXT_Y_OFF +14, TEXT_X_OFF +2, "Rotate [qe]");
 	mvwprintw(board, TEXT_Y_OFF +15, TEXT_X_OFF +2, "Hold [[space]]");
+	mvwprintw(board, TEXT_Y_OFF +16, TEXT_X_OFF +2, "Stats [F2]");
 
 	/* Draw board outline */
 	wattrset(board, A_BOLD | COLOR_PAIR(5));
@@ -93,18 +257,22 @@ void screen_cleanup(void)
 	delwin(pieces);
 	clear();
 	endwin();
+	relay_stop();
 }
 
 /* Ask user for difficulty and their name */
 void screen_draw_menu(void)
 {
 	const size_t buf_len = 256;
-
-	memset(psave, 0, sizeof *psave);
+	char path[256], name[sizeof psave->slot];
+	size_t i;
 
 	/* TODO place holder name, get from user later */
 	strlcpy(psave->id, "Lorem Ipsum", sizeof psave->id);
 
+	if (!psave->slot[0])
+		strlcpy(psave->slot, DB_SLOT_DEFAULT, sizeof psave->slot);
+
 	psave->file_loc = calloc(1, buf_len);
 	if (psave->file_loc == NULL) {
 		log_err("Out of memory");
@@ -122,16 +290,84 @@ void screen_draw_menu(void)
 #endif
 		);
 
-	/* Start the game paused if we can resume from an old save */
-	if (db_resume_state() > 0) {
+	if (db_start() < 0)
+		log_warn("Playing without a database, nothing will be saved");
+
+	/* No checkpoints when debugging either */
+#if !defined(DEBUG) && defined(NDEBUG)
+	/* One file per save slot. Only letters, digits, - and _ go in the
+	 * name; a clash is caught by the slot kept in the file.
+	 */
+	for (i = 0; i < sizeof name - 1 && psave->slot[i]; i++)
+		name[i] = isalnum((unsigned char) psave->slot[i]) ||
+			  psave->slot[i] == '-' ? psave->slot[i] : '_';
+	name[i] = '\0';
+
+	snprintf(path, sizeof path, "%s/.local/share/tetris/checkpoint-%s",
+		 getenv("HOME"), name);
+	checkpoint_open(path, psave->slot);
+#else
+	(void) path; /* unused */
+	(void) name;
+	(void) i;
+#endif
+
+	/* Start the game paused if we can resume from an old save. A
+	 * checkpoint means the last game never ended, that comes first.
+	 */
+	if (checkpoint_recover() > 0 || db_resume_state() > 0) {
 		pgame->pause = true;
 	}
 }
 
+/* p50/p99/p999 of the lock and input latency histograms, in usec. Sits to
+ * the right of the controls, blanked out when turned off.
+ */
+static void draw_stats(void)
+{
+	const struct {
+		const char *name;
+		const struct hist *h;
+	} rows[] = {
+		{ "Loop wait", &phost->loop_lock.wait },
+		{ "Loop hold", &phost->loop_lock.hold },
+		{ "Keys wait", &phost->input_lock.wait },
+		{ "Keys hold", &phost->input_lock.hold },
+		{ "Key->draw", &phost->input_latency },
+	};
+	const double p[] = { 50, 99, 99.9 };
+	uint64_t res[LEN(p)];
+	size_t i;
+
+	wattrset(board, COLOR_PAIR(1));
+
+	if (!phost->show_stats) {
+		for (i = 0; i <= LEN(rows); i++)
+			mvwprintw(board, TEXT_Y_OFF +10 +i, STATS_X_OFF, "%*s",
+				  STATS_WIDTH, "");
+		return;
+	}
+
+	mvwprintw(board, TEXT_Y_OFF +10, STATS_X_OFF, "%-*s",
+		  STATS_WIDTH, "Stats (us)     p50     p99    p999");
+
+	for (i = 0; i < LEN(rows); i++) {
+		hist_percentiles(rows[i].h, p, res, LEN(p));
+		mvwprintw(board, TEXT_Y_OFF +11 +i, STATS_X_OFF,
+			  "%-10s %8.1f%8.1f%8.1f", rows[i].name,
+			  (double) res[0] / NSEC_PER_USEC,
+			  (double) res[1] / NSEC_PER_USEC,
+			  (double) res[2] / NSEC_PER_USEC);
+	}
+}
+
 void screen_draw_game(void)
 {
+	uint64_t start = stats_now();
 	size_t i, j;
 
+	TRACE_BEGIN("screen_draw_game");
+
 	wattrset(board, COLOR_PAIR(1));
 	mvwprintw(board, TEXT_Y_OFF+1, TEXT_X_OFF+1, "Level       ");
 	mvwprintw(board, TEXT_Y_OFF+2, TEXT_X_OFF+1, "Score       ");
@@ -148,22 +384,20 @@ void screen_draw_game(void)
 
 	wclear(pieces);
 
-	struct blocks *np = HOLD_BLOCK();
-	int count = 0;
+	struct blocks np = *HOLD_BLOCK();
+	int count;
 
-	while (np) {
-		for (i = 0; i < LEN(np->p); i++) {
-			wattrset(pieces, A_BOLD | COLOR_PAIR(np->type +1));
-			mvwprintw(pieces, np->p[i].y +1,
-					np->p[i].x +1 +(count*5),
+	/* The hold block, then the next ones */
+	for (count = 0; count <= NEXT_BLOCKS_LEN; count++) {
+		if (count)
+			blocks_piece(&np, pgame->next[count - 1]);
+
+		for (i = 0; i < LEN(np.p); i++) {
+			wattrset(pieces, A_BOLD | COLOR_PAIR(np.type +1));
+			mvwprintw(pieces, np.p[i].y +1,
+					np.p[i].x +1 +(count*5),
 					BLOCK_CHAR);
 		}
-
-		count++;
-		np = np->entries.le_next;
-
-		if (np == CURRENT_BLOCK())
-			np = np->entries.le_next;
 	}
 
 	wattrset(board, COLOR_PAIR(1));
@@ -180,7 +414,7 @@ void screen_draw_game(void)
 				continue;
 
 			wattrset(board, A_BOLD | COLOR_PAIR(
-					(pgame->colors[i][j] %sizeof(colors))
+					(blocks_color_at(i, j) %sizeof(colors))
 					+1));
 			mvwprintw(board, i -2 +GAME_Y_OFF, j +1 +GAME_X_OFF,
 					BLOCK_CHAR);
@@ -197,13 +431,21 @@ void screen_draw_game(void)
 				 "PAUSED");
 	}
 
+	draw_stats();
+
 	wrefresh(pieces);
 	wrefresh(board);
+
+	metrics_observe(METRIC_FRAME, stats_now() - start);
+
+	TRACE_END("screen_draw_game");
 }
 
 /* Game over screen */
-void screen_draw_over(void)
+int screen_draw_over(void)
 {
+	int ret;
+
 	log_info("Game over");
 
 	clear();
@@ -215,28 +457,25 @@ void screen_draw_over(void)
 	mvprintw(LINES - 2, 1, "Press F1 to quit.");
 
 	if (pgame->lose) {
-		db_save_score();
+		ret = db_save_score();
 	} else {
-		db_save_state();
-		return;
+		return db_save_state();
 	}
 
 	/* Print score board when you lose a game */
-	struct db_results *res = db_get_scores(10);
-	while (res) {
-		char *date = ctime(&res->date);
-		static unsigned char count = 0;
-
-		count++;
-		mvprintw(count + 2, 4, "%2d.\t%-16s%-5d\t%-5d\t%.*s", count,
-			 res->id, res->level, res->score, strlen(date) - 1,
-			 date);
-		res = res->entries.tqe_next;
+	struct db_score res[10];
+	ssize_t i, n = db_get_scores(res, LEN(res), NULL);
+
+	for (i = 0; i < n; i++) {
+		char *date = ctime(&res[i].date);
+
+		mvprintw(i + 3, 4, "%2d.\t%-16s%-5d\t%-5d\t%.*s", (int) i + 1,
+			 res[i].id, res[i].level, res[i].score,
+			 (int) strlen(date) - 1, date);
 	}
 	refresh();
 
-	db_clean_scores();
-	free(psave->file_loc);
-
 	while (getch() != KEY_F(1)) ;
+
+	return ret;
 }
@@ -0,0 +1,1546 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * blocks-server: many games in one process, played over TCP or a Unix
+ * domain socket.
+ *
+ * Every connection is a session with a game of its own. Sessions are spread
+ * over a few worker threads, each with its own epoll set, and stay on the
+ * worker that accepted them. A worker keeps its sessions on a timing wheel
+ * by their next deadline (gravity, auto shift, lock delay), so a game costs
+ * nothing in between ticks and keys. One timerfd per worker, in its epoll
+ * set, goes off when the first of them is due.
+ *
+ * Spectators connect to a listener of their own (-P, -U) and watch the
+ * best game going when they came in, see broadcast.h. The game's worker
+ * encodes each frame once; every worker with spectators of that game sends
+ * those same frames to its own.
+ *
+ * Clients send keys and get a frame each time the game changes, at most
+ * one per wakeup. The protocol is wire.h: frames only carry what changed
+ * since the last one, so a client that falls behind just gets a bigger
+ * frame once it catches up.
+ *
+ * Terminals come in on -a, from `blocks -a socket` run in the player's
+ * terminal (an ssh ForceCommand, say), which hands the terminal itself over
+ * and waits. Those sessions are drawn right onto it, see tty.h, and their
+ * scores go to the one database connection, -d. A thousand players cost a
+ * thousand games and terminals, not a thousand processes with a curses
+ * screen, a SQLite connection and two threads each.
+ *
+ * With -t it's plain text instead, to play with nc:
+ *	client: keys, as typed at the terminal (a d s w q e, space)
+ *	server: "level L score S\n", then one line of BLOCKS_MAX_COLUMNS
+ *		characters per visible row, '.' for empty or the block's
+ *		letter, then an empty line. "game over, score S\n\n" last,
+ *		then it hangs up.
+ */
+
+/* Non-standard BSD extensions */
+#include <bsd/string.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "broadcast.h"
+#include "db.h"
+#include "debug.h"
+#include "metrics.h"
+#include "stats.h"
+#include "tick.h"
+#include "tty.h"
+#include "wheel.h"
+#include "wire.h"
+
+#define SERVER_MAX_WORKERS	64
+#define SERVER_EVENTS		256	/* per epoll_wait() */
+#define SERVER_ACCEPT_BATCH	64	/* accepts per wakeup, then others */
+
+/* Unsent output a session may have. A client that falls further behind
+ * gets no new frames until it catches up, then one with all that changed.
+ */
+#define SERVER_OUT_MAX		16384
+
+/* "level L score S\n", the rows, and the empty line */
+#define FRAME_LEN	(64 + (BLOCKS_MAX_ROWS - 2) * (BLOCKS_MAX_COLUMNS + 1))
+
+struct worker;
+
+/* What epoll hands back points at one of these, first in every struct */
+enum conn_kind {
+	CONN_PLAYER,
+	CONN_VIEWER,
+	CONN_LISTENER,
+	CONN_WATCH,			/* listener for spectators */
+	CONN_ATTACH,			/* listener for terminals */
+	CONN_HELLO,			/* a terminal on its way in */
+	CONN_WAKE,			/* a worker's eventfd */
+	CONN_TIMER,			/* a worker's timerfd */
+};
+
+struct session {
+	enum conn_kind kind;
+	int fd;
+	bool dirty;			/* board changed since the last frame */
+	bool over;			/* hang up once the output is sent */
+	bool writing;			/* waiting on EPOLLOUT */
+
+	/* A terminal: @fd is the tty, and @ctl blocks -a's socket, which
+	 * hangs up with us
+	 */
+	bool tty;
+	int ctl;
+	char name[16];
+
+	struct worker *worker;
+	struct blocks_game *game;
+	struct wheel_timer timer;	/* next blocks_step(), unless over */
+	LIST_ENTRY(session) entries;	/* worker->sessions */
+
+	char *out;			/* unsent output is out[off, len) */
+	size_t off, len, cap;
+
+	struct wire_state sent;		/* what the client has, or shows */
+	uint8_t in[WIRE_FRAME_MAX];	/* start of a key frame */
+	size_t in_len;
+
+	struct bcast_channel *channel;	/* while anyone's watching */
+};
+
+/* A worker's spectators of one game, all fed from one catchup */
+struct feed {
+	struct bcast_channel *ch;
+	uint64_t seq;			/* next frame */
+	struct bcast_frame *key;	/* the game as of seq, for newcomers */
+	bool over;
+
+	LIST_HEAD(, viewer) viewers;
+	LIST_ENTRY(feed) entries;
+};
+
+struct viewer {
+	enum conn_kind kind;
+	int fd;
+	bool writing;			/* waiting on EPOLLOUT */
+
+	struct worker *worker;
+	struct feed *feed;
+	LIST_ENTRY(viewer) entries;
+
+	struct bcast_queue q;
+};
+
+/* blocks -a connected, its hello hasn't come in yet */
+struct attach {
+	enum conn_kind kind;
+	int fd;
+	struct worker *worker;
+	LIST_ENTRY(attach) entries;
+};
+
+struct listener {
+	enum conn_kind kind;
+	int fd;
+	char path[sizeof ((struct sockaddr_un *) 0)->sun_path];
+};
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+
+	/* Every session on this worker, and when each is next due. The
+	 * timerfd goes off when the first one is, ->at.
+	 */
+	LIST_HEAD(, session) sessions;
+	struct wheel *timers;
+	struct {
+		enum conn_kind kind;
+		int fd;
+		uint64_t at;
+	} timer;
+
+	/* For the log */
+	uint64_t frames;		/* sent */
+	uint64_t steps;			/* blocks_step()s */
+	struct tick_stats ticks;	/* gravity, on time or late */
+
+	struct {
+		enum conn_kind kind;
+		int fd;
+	} wake;				/* feeds have frames */
+	LIST_HEAD(, feed) feeds;
+	LIST_HEAD(, viewer) closed;	/* freed between epoll_wait()s */
+	LIST_HEAD(, attach) attaching;
+	uint64_t viewer_frames, resyncs;
+};
+
+static struct {
+	struct listener listeners[5];	/* TCP, Unix, spectators, terminals */
+	size_t nlisteners;
+
+	bool text;			/* text frames, not wire.h */
+	bool classic;			/* classic rotation, -c */
+	bool db;			/* terminals' scores go to the database */
+	bool watch;			/* there are spectator listeners */
+	int stop_fd;			/* eventfd, readable when stopping */
+	struct worker workers[SERVER_MAX_WORKERS];
+	unsigned nworkers;
+	int64_t sessions, viewers;
+
+	/* The game new spectators get */
+	pthread_mutex_t lock;
+	struct bcast_channel *featured;
+	uint32_t featured_score;	/* atomic, read without the lock */
+} server = {
+	.stop_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The session whose game this thread is running */
+static __thread struct session *cur;
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "%s-%s usage:\n"
+		"\t%s [-t] [-p port] [-u socket] [-P port] [-U socket] "
+		"[-a socket] [-d file] [-w workers] [-m socket] [-c]\n"
+		"\t[-t] plain text frames, not binary\n"
+		"\t[-p port] listen on TCP port\n"
+		"\t[-u socket] listen on a Unix domain socket\n"
+		"\t[-P port] spectators on TCP port\n"
+		"\t[-U socket] spectators on a Unix domain socket\n"
+		"\t[-a socket] terminals from blocks -a on a Unix socket\n"
+		"\t[-d file] save terminal players' scores to this database\n"
+		"\t[-w workers] worker threads, default one per CPU\n"
+		"\t[-m socket] serve Prometheus metrics on a Unix socket\n"
+		"\t[-c] classic rotation, no SRS kicks\n",
+		__progname, VERSION, __progname);
+
+	exit(EXIT_FAILURE);
+}
+
+/* The session a timer is in */
+static struct session *timer_session(struct wheel_timer *t)
+{
+	return (struct session *) ((char *) t - offsetof(struct session, timer));
+}
+
+/* Workers in @mask have new frames for their spectators */
+static void wake_workers(uint64_t mask)
+{
+	uint64_t one = 1;
+	unsigned i;
+
+	for (i = 0; mask; i++, mask >>= 1)
+		if (mask & 1 &&
+		    write(server.workers[i].wake.fd, &one, sizeof one) < 0)
+			log_warn("Cannot wake worker %u: %s", i,
+				 strerror(errno));
+}
+
+/*
+ * Sessions
+ */
+
+/* phost->draw. Frames are made once we're done with the session, however
+ * many times the game drew in the meantime.
+ */
+static void session_draw(void)
+{
+	cur->dirty = true;
+}
+
+static int session_queue(struct session *s, const void *buf, size_t len)
+{
+	size_t cap;
+	char *out;
+
+	if (s->off == s->len)
+		s->off = s->len = 0;
+
+	if (s->len + len > s->cap && s->off) {
+		memmove(s->out, s->out + s->off, s->len - s->off);
+		s->len -= s->off;
+		s->off = 0;
+	}
+
+	if (s->len + len > s->cap) {
+		cap = s->cap ? s->cap * 2 : FRAME_LEN * 2;
+		while (cap < s->len + len)
+			cap *= 2;
+		if (!(out = realloc(s->out, cap))) {
+			log_err("Out of memory");
+			return -1;
+		}
+		s->out = out;
+		s->cap = cap;
+	}
+
+	memcpy(s->out + s->len, buf, len);
+	s->len += len;
+
+	return 1;
+}
+
+/* The board as text, current block included */
+static int session_text(struct session *s)
+{
+	static const char letters[] = "OITLJZS";	/* by block type */
+	char frame[FRAME_LEN + 64];
+	size_t i, j;
+	int n;
+
+	n = snprintf(frame, sizeof frame, "level %u score %u\n",
+		     pgame->level, pgame->score);
+
+	for (i = 2; i < BLOCKS_MAX_ROWS; i++) {
+		for (j = 0; j < BLOCKS_MAX_COLUMNS; j++)
+			frame[n++] = blocks_at_yx(i, j) ?
+				letters[blocks_color_at(i, j)] : '.';
+		frame[n++] = '\n';
+	}
+	frame[n++] = '\n';
+
+	if (pgame->lose)
+		n += snprintf(frame + n, sizeof frame - n,
+			      "game over, score %u\n\n", pgame->score);
+
+	return session_queue(s, frame, n);
+}
+
+/* The game as the client sees it: locked cells on the board, the falling
+ * block on its own
+ */
+static void session_snapshot(struct wire_state *st)
+{
+	struct blocks *np = CURRENT_BLOCK();
+	size_t i, x, y;
+
+	st->level = pgame->level;
+	st->score = pgame->score;
+	st->over = pgame->lose;
+
+	memcpy(st->spaces, pgame->spaces, sizeof st->spaces);
+
+	/* draw() is only called with the block written to the board */
+	st->type = np->type;
+	for (i = 0; i < LEN(np->p); i++) {
+		y = np->row_off + np->p[i].y;
+		x = np->col_off + np->p[i].x;
+		st->cells[i] = WIRE_CELL(y, x);
+		st->spaces[y] &= ~(1U << x);
+	}
+
+	/* Empty cells keep old colors on the board, not on the wire */
+	for (y = 0; y < BLOCKS_MAX_ROWS; y++) {
+		st->colors[y] = 0;
+		for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+			if (st->spaces[y] & (1U << x))
+				st->colors[y] |= blocks_color_at(y, x)
+					<< (x * COLOR_BITS);
+	}
+
+	st->queue[0] = HOLD_BLOCK()->type;
+	for (i = 1; i < LEN(st->queue); i++)
+		st->queue[i] = pgame->next[i - 1];
+}
+
+/* session_frame() for terminals: what changed on the screen, and the
+ * leaderboard once it's over
+ */
+static int session_tty(struct session *s)
+{
+	struct db_score top[DB_TOP_LEN];
+	struct wire_state now;
+	char buf[TTY_FRAME_MAX];
+	size_t n;
+
+	session_snapshot(&now);
+	now.over |= s->over;
+
+	if (!(n = tty_draw(buf, &s->sent, &now)))
+		return 1;
+
+	s->worker->frames++;
+	metrics_add(METRIC_FRAMES_SENT, 1);
+
+	if (session_queue(s, buf, n) < 0)
+		return -1;
+
+	if (!now.over)
+		return 1;
+
+	n = tty_over(buf, top, server.db ? db_get_scores(top, LEN(top), NULL)
+					 : 0);
+	return session_queue(s, buf, n);
+}
+
+/* Whatever changed since the last frame. Waits while the client is
+ * behind; frames are deltas, so the next one catches up on everything.
+ */
+static int session_frame(struct session *s)
+{
+	struct wire_state now;
+	uint8_t buf[WIRE_FRAME_MAX];
+	size_t n;
+
+	if (s->len - s->off >= SERVER_OUT_MAX)
+		return 1;
+
+	s->dirty = false;
+
+	if (s->tty)
+		return session_tty(s);
+
+	if (server.text) {
+		n = 0;
+	} else {
+		session_snapshot(&now);
+		if (!(n = wire_encode(buf, &s->sent, &now)))
+			return 1;
+	}
+
+	s->worker->frames++;
+	metrics_add(METRIC_FRAMES_SENT, 1);
+
+	return n ? session_queue(s, buf, n) : session_text(s);
+}
+
+/* Frame if one's due, and send what we can. Returns -1 if the session is
+ * done for.
+ */
+static int session_send(struct session *s)
+{
+	struct epoll_event ev = { .data.ptr = s };
+	ssize_t n;
+	bool writing;
+
+	if (s->dirty && session_frame(s) < 0)
+		return -1;
+
+	while (s->off < s->len) {
+		n = s->tty ? write(s->fd, s->out + s->off, s->len - s->off) :
+			send(s->fd, s->out + s->off, s->len - s->off,
+			     MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		s->off += n;
+		metrics_add(METRIC_SENT_BYTES, n);
+
+		/* Room again for a frame we held back */
+		if (s->dirty && session_frame(s) < 0)
+			return -1;
+	}
+
+	if (s->over && s->off == s->len && !s->dirty)
+		return -1;
+
+	/* Only ask for EPOLLOUT while there's something waiting */
+	writing = s->off < s->len;
+	if (writing != s->writing) {
+		ev.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+		epoll_ctl(s->worker->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+		s->writing = writing;
+	}
+
+	return 1;
+}
+
+/* Spectators get the frame too. Snapshots twice for a game with both,
+ * but there's only ever a handful of those.
+ */
+static void session_publish(struct session *s)
+{
+	struct wire_state now;
+
+	session_snapshot(&now);
+	wake_workers(bcast_publish(s->channel, &now));
+
+	if (s->channel == __atomic_load_n(&server.featured, __ATOMIC_RELAXED))
+		__atomic_store_n(&server.featured_score, now.score,
+				 __ATOMIC_RELAXED);
+}
+
+/* New spectators watch the best game going. Most of the time that's not
+ * us, and one atomic load says so.
+ */
+static void session_feature(struct session *s)
+{
+	struct bcast_channel *ch;
+
+	if (!server.watch || s->channel || s->over ||
+	    (__atomic_load_n(&server.featured, __ATOMIC_RELAXED) &&
+	     pgame->score <= __atomic_load_n(&server.featured_score,
+					     __ATOMIC_RELAXED)))
+		return;
+
+	pthread_mutex_lock(&server.lock);
+
+	if ((!server.featured || pgame->score > server.featured_score) &&
+	    (ch = bcast_channel_new())) {
+		if (server.featured)
+			bcast_channel_unref(server.featured);
+
+		bcast_channel_ref(ch);
+		s->channel = ch;
+		__atomic_store_n(&server.featured, ch, __ATOMIC_RELAXED);
+		__atomic_store_n(&server.featured_score, pgame->score,
+				 __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&server.lock);
+
+	if (s->channel)
+		session_publish(s);
+}
+
+/* Stop broadcasting. Spectators get what's left, then hang up. */
+static void session_unfeature(struct session *s)
+{
+	struct bcast_channel *ch = s->channel;
+
+	pthread_mutex_lock(&server.lock);
+	if (server.featured == ch) {
+		__atomic_store_n(&server.featured, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&server.featured_score, 0,
+				 __ATOMIC_RELAXED);
+		bcast_channel_unref(ch);
+	}
+	pthread_mutex_unlock(&server.lock);
+
+	wake_workers(bcast_close(ch));
+	bcast_channel_unref(ch);
+	s->channel = NULL;
+}
+
+static void session_close(struct session *s)
+{
+	wheel_del(s->worker->timers, &s->timer);
+	LIST_REMOVE(s, entries);
+	close(s->fd);
+	if (s->ctl >= 0)
+		close(s->ctl);
+
+	if (s->channel)
+		session_unfeature(s);
+
+	pgame = s->game;
+	blocks_cleanup();
+	pgame = NULL;
+
+	free(s->out);
+	free(s);
+
+	metrics_set(METRIC_SESSIONS,
+		    __atomic_sub_fetch(&server.sessions, 1, __ATOMIC_RELAXED));
+}
+
+/* The game moved on: send a frame if it changed, and find its next
+ * deadline. Returns -1 if the session was closed.
+ */
+static int session_update(struct session *s)
+{
+	/* The last frame says so */
+	if ((pgame->lose || pgame->quit) && !s->over) {
+		s->over = true;
+		s->dirty = true;
+
+		if (s->tty && server.db && pgame->lose)
+			db_save_score_as(s->name);
+	}
+
+	/* Over sessions have nothing left to time */
+	if (s->over)
+		wheel_del(s->worker->timers, &s->timer);
+	else
+		wheel_add(s->worker->timers, &s->timer, blocks_deadline());
+
+	/* Nobody watching, and nobody will */
+	if (s->channel && bcast_channel_alone(s->channel))
+		session_unfeature(s);
+
+	if (s->channel && s->dirty)
+		session_publish(s);
+	else
+		session_feature(s);
+
+	/* The last frame is out, spectators can go once they have it */
+	if (s->channel && s->over)
+		session_unfeature(s);
+
+	if (session_send(s) < 0) {
+		session_close(s);
+		return -1;
+	}
+
+	return 1;
+}
+
+/* @ctl and @name only for terminals, -1 and NULL otherwise */
+static void session_open(struct worker *w, int fd, int ctl, const char *name)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+	};
+	struct session *s;
+
+	if (!(s = calloc(1, sizeof *s))) {
+		log_err("Out of memory");
+		close(fd);
+		return;
+	}
+
+	s->kind = CONN_PLAYER;
+	s->fd = fd;
+	s->worker = w;
+	s->tty = ctl >= 0;
+	s->ctl = ctl;
+	if (name)
+		strlcpy(s->name, name, sizeof s->name);
+
+	cur = s;
+	blocks_init();
+	if (server.classic)
+		blocks_rotation(ROTATION_CLASSIC);
+	s->game = pgame;
+	blocks_start();
+
+	s->dirty = true;
+
+	/* The frames only ever draw what changed */
+	if (s->tty) {
+		char buf[TTY_FRAME_MAX];
+
+		if (session_queue(s, buf, tty_start(buf)) < 0)
+			goto err;
+	}
+
+	ev.data.ptr = s;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_err("Cannot add session: %s", strerror(errno));
+		goto err;
+	}
+
+	LIST_INSERT_HEAD(&w->sessions, s, entries);
+
+	metrics_set(METRIC_SESSIONS,
+		    __atomic_add_fetch(&server.sessions, 1, __ATOMIC_RELAXED));
+
+	session_update(s);
+	return;
+
+ err:
+	blocks_cleanup();
+	free(s->out);
+	free(s);
+	close(fd);
+	if (ctl >= 0)
+		close(ctl);
+}
+
+/* Keys from the client. Returns -1 if the session was closed. */
+static int session_read(struct session *s)
+{
+	int keys[WIRE_KEYS_MAX];
+	size_t i, nkeys, off = 0;
+	ssize_t n;
+
+	/* Text and terminals are a key a byte, or less */
+	if (s->tty)
+		n = read(s->fd, s->in, LEN(keys));
+	else
+		n = recv(s->fd, s->in + s->in_len, server.text ? LEN(keys) :
+			 sizeof s->in - s->in_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+
+	if (n <= 0) {
+		session_close(s);
+		return -1;
+	}
+
+	/* Nothing more to play */
+	if (s->over)
+		return 1;
+
+	if (s->tty) {
+		blocks_keys(keys, tty_keys(s->in, n, keys), false);
+
+		return session_update(s);
+	}
+
+	if (server.text) {
+		for (i = 0; i < (size_t) n; i++)
+			keys[i] = s->in[i];
+		blocks_keys(keys, i, false);
+
+		return session_update(s);
+	}
+
+	/* Every whole frame in, a partial one waits for the rest */
+	s->in_len += n;
+	while ((n = wire_decode_keys(s->in + off, s->in_len - off, keys,
+				     &nkeys)) > 0) {
+		blocks_keys(keys, nkeys, false);
+		off += n;
+	}
+
+	if (n < 0) {
+		log_warn("Bad frame from a client, hanging up");
+		session_close(s);
+		return -1;
+	}
+
+	s->in_len -= off;
+	memmove(s->in, s->in + off, s->in_len);
+
+	return session_update(s);
+}
+
+/*
+ * Terminals
+ */
+
+static void attach_close(struct attach *a)
+{
+	LIST_REMOVE(a, entries);
+	close(a->fd);
+	free(a);
+}
+
+/* blocks -a connected, its terminal comes with the hello */
+static void attach_open(struct worker *w, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+	struct attach *a;
+
+	if (!(a = calloc(1, sizeof *a))) {
+		log_err("Out of memory");
+		close(fd);
+		return;
+	}
+
+	a->kind = CONN_HELLO;
+	a->fd = fd;
+	a->worker = w;
+	LIST_INSERT_HEAD(&w->attaching, a, entries);
+
+	ev.data.ptr = a;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_err("Cannot add terminal: %s", strerror(errno));
+		attach_close(a);
+	}
+}
+
+static void attach_hello(struct attach *a)
+{
+	struct tty_hello hello;
+	char cbuf[CMSG_SPACE(sizeof (int))];
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof hello };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof cbuf,
+	};
+	struct cmsghdr *cmsg;
+	int tty = -1, flags;
+	ssize_t n;
+
+	n = recvmsg(a->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof tty))
+			memcpy(&tty, CMSG_DATA(cmsg), sizeof tty);
+
+	if (n != sizeof hello || tty < 0 || !isatty(tty) ||
+	    (flags = fcntl(tty, F_GETFL)) < 0 ||
+	    fcntl(tty, F_SETFL, flags | O_NONBLOCK) < 0) {
+		if (n != 0)
+			log_warn("Bad hello from a terminal, hanging up");
+		if (tty >= 0)
+			close(tty);
+		attach_close(a);
+		return;
+	}
+
+	/* From here on the socket is only there to hang up */
+	epoll_ctl(a->worker->epfd, EPOLL_CTL_DEL, a->fd, NULL);
+	hello.name[sizeof hello.name - 1] = '\0';
+	session_open(a->worker, tty, a->fd, hello.name);
+
+	a->fd = -1;
+	LIST_REMOVE(a, entries);
+	free(a);
+}
+
+/*
+ * Spectators
+ */
+
+/* The feed's gone with its last viewer */
+static void feed_put(struct worker *w, struct feed *f)
+{
+	if (!LIST_EMPTY(&f->viewers))
+		return;
+
+	bcast_unsubscribe(f->ch, w - server.workers);
+	bcast_channel_unref(f->ch);
+	bcast_frame_unref(f->key);
+	LIST_REMOVE(f, entries);
+	free(f);
+}
+
+/* Doesn't put the feed, whoever's going through its viewers does. Any
+ * viewer can go while a feed is pulled, events for it may still be
+ * waiting in this round's batch, so it's only freed after.
+ */
+static void viewer_close(struct viewer *v)
+{
+	LIST_REMOVE(v, entries);
+	LIST_INSERT_HEAD(&v->worker->closed, v, entries);
+	close(v->fd);
+	v->fd = -1;
+	bcast_queue_clear(&v->q);
+
+	metrics_set(METRIC_VIEWERS,
+		    __atomic_sub_fetch(&server.viewers, 1, __ATOMIC_RELAXED));
+}
+
+/* Send what we can. Returns -1 if the viewer's done for, and should be
+ * closed.
+ */
+static int viewer_send(struct viewer *v)
+{
+	struct epoll_event ev = { .data.ptr = v };
+	size_t sent = 0;
+	bool writing;
+	int ret;
+
+	ret = bcast_queue_send(&v->q, v->fd, &sent);
+	metrics_add(METRIC_SENT_BYTES, sent);
+
+	if (ret < 0 || (ret > 0 && v->feed->over))
+		return -1;
+
+	writing = !ret;
+	if (writing != v->writing) {
+		ev.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+		epoll_ctl(v->worker->epfd, EPOLL_CTL_MOD, v->fd, &ev);
+		v->writing = writing;
+	}
+
+	return 1;
+}
+
+/* Everything the game published since we last looked, to every viewer */
+static void feed_pull(struct worker *w, struct feed *f)
+{
+	struct bcast_catchup c;
+	struct viewer *v, *next;
+	size_t i;
+
+	bcast_catchup(f->ch, &f->seq, &c);
+	f->over = c.over;
+
+	if (c.key) {
+		bcast_frame_unref(f->key);
+		f->key = c.key;
+	}
+
+	for (v = LIST_FIRST(&f->viewers); v; v = next) {
+		next = LIST_NEXT(v, entries);
+
+		for (i = 0; i < c.n; i++)
+			if (bcast_queue_push(&v->q, c.deltas[i]) < 0)
+				break;
+
+		/* Too slow for deltas, the latest keyframe has it all */
+		if (c.skipped || i < c.n) {
+			bcast_queue_resync(&v->q, f->key);
+			w->resyncs++;
+			metrics_add(METRIC_RESYNCS, 1);
+		}
+
+		w->viewer_frames += c.n;
+
+		if (viewer_send(v) < 0)
+			viewer_close(v);
+	}
+
+	bcast_catchup_done(&c);
+}
+
+/* A worker has one feed per game its viewers watch */
+static struct feed *feed_get(struct worker *w, struct bcast_channel *ch)
+{
+	struct feed *f;
+
+	LIST_FOREACH(f, &w->feeds, entries)
+		if (f->ch == ch)
+			return f;
+
+	if (!(f = calloc(1, sizeof *f))) {
+		log_err("Out of memory");
+		return NULL;
+	}
+
+	bcast_channel_ref(ch);
+	f->ch = ch;
+	LIST_INIT(&f->viewers);
+	LIST_INSERT_HEAD(&w->feeds, f, entries);
+	bcast_subscribe(ch, w - server.workers);
+
+	return f;
+}
+
+static void viewer_open(struct worker *w, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+	struct bcast_channel *ch;
+	struct viewer *v;
+	struct feed *f;
+
+	pthread_mutex_lock(&server.lock);
+	if ((ch = server.featured))
+		bcast_channel_ref(ch);
+	pthread_mutex_unlock(&server.lock);
+
+	/* Nothing to watch */
+	if (!ch) {
+		close(fd);
+		return;
+	}
+
+	f = feed_get(w, ch);
+	bcast_channel_unref(ch);
+
+	if (!f || !(v = calloc(1, sizeof *v))) {
+		log_err("Out of memory");
+		close(fd);
+		if (f)
+			feed_put(w, f);
+		return;
+	}
+
+	v->kind = CONN_VIEWER;
+	v->fd = fd;
+	v->worker = w;
+	v->feed = f;
+
+	/* Up to date, then join in with a keyframe */
+	feed_pull(w, f);
+	LIST_INSERT_HEAD(&f->viewers, v, entries);
+	if (f->key)
+		bcast_queue_push(&v->q, f->key);
+
+	metrics_set(METRIC_VIEWERS,
+		    __atomic_add_fetch(&server.viewers, 1, __ATOMIC_RELAXED));
+
+	ev.data.ptr = v;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_err("Cannot add viewer: %s", strerror(errno));
+		viewer_close(v);
+		feed_put(w, f);
+		return;
+	}
+
+	if (viewer_send(v) < 0) {
+		viewer_close(v);
+		feed_put(w, f);
+	}
+}
+
+/* Viewers only ever send us a hangup */
+static void viewer_event(struct viewer *v, uint32_t events)
+{
+	struct worker *w = v->worker;
+	struct feed *f = v->feed;
+	char buf[64];
+	ssize_t n = 1;
+
+	if (v->fd < 0)
+		return;
+
+	if (events & (EPOLLIN | EPOLLRDHUP))
+		while ((n = recv(v->fd, buf, sizeof buf, 0)) > 0)
+			;
+
+	if (events & (EPOLLERR | EPOLLHUP) || n == 0 ||
+	    (n < 0 && errno != EAGAIN && errno != EINTR) ||
+	    (events & EPOLLOUT && viewer_send(v) < 0)) {
+		viewer_close(v);
+		feed_put(w, f);
+	}
+}
+
+/* Some game we have viewers of published */
+static void worker_wake(struct worker *w)
+{
+	struct feed *f, *next;
+	uint64_t n;
+
+	if (read(w->wake.fd, &n, sizeof n) < 0 && errno != EAGAIN)
+		log_warn("Cannot read wakeups: %s", strerror(errno));
+
+	for (f = LIST_FIRST(&w->feeds); f; f = next) {
+		next = LIST_NEXT(f, entries);
+		feed_pull(w, f);
+		feed_put(w, f);
+	}
+}
+
+/* Set the timerfd to go off at @deadline, on CLOCK_MONOTONIC like
+ * stats_now(), unless it already does
+ */
+static void worker_arm(struct worker *w, uint64_t deadline)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (deadline == w->timer.at)
+		return;
+
+	w->timer.at = deadline;
+
+	/* All zero disarms it. The past is fine, it goes off right away. */
+	if (deadline != UINT64_MAX) {
+		deadline = deadline ? deadline : 1;
+		its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+		its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+	}
+
+	if (timerfd_settime(w->timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		log_warn("Cannot set timer: %s", strerror(errno));
+}
+
+/* Went off. The sessions due are stepped once the events are done. */
+static void worker_timer(struct worker *w)
+{
+	uint64_t n;
+
+	if (read(w->timer.fd, &n, sizeof n) < 0 && errno != EAGAIN)
+		log_warn("Cannot read timer: %s", strerror(errno));
+
+	/* It's not set any more */
+	w->timer.at = UINT64_MAX;
+}
+
+/*
+ * Workers
+ */
+
+static void worker_accept(struct worker *w, struct listener *l)
+{
+	int fd, i, one = 1;
+
+	for (i = 0; i < SERVER_ACCEPT_BATCH; i++) {
+		fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR &&
+			    errno != ECONNABORTED)
+				log_warn("accept: %s", strerror(errno));
+			return;
+		}
+
+		/* Frames are small and we want them out now. Fails
+		 * harmlessly on Unix sockets.
+		 */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+		if (l->kind == CONN_WATCH)
+			viewer_open(w, fd);
+		else if (l->kind == CONN_ATTACH)
+			attach_open(w, fd);
+		else
+			session_open(w, fd, -1, NULL);
+	}
+}
+
+static void *worker_loop(void *vp)
+{
+	struct worker *w = vp;
+	struct blocks_host host;
+	struct wheel timers;
+	struct wheel_timer *t;
+	struct epoll_event ev[SERVER_EVENTS];
+	struct session *s;
+	struct viewer *v;
+	struct feed *f;
+	uint64_t now;
+	int i, n;
+
+	/* Its sessions' games come out of a pool of its own, so workers
+	 * don't share a cache line, or even a page, of game state. They share
+	 * CLOCK_MONOTONIC with its clock_real.
+	 */
+	blocks_host_init(&host);
+	host.draw = session_draw;
+	host.many_games = true;
+	phost = &host;
+
+	wheel_init(&timers, stats_now());
+	w->timers = &timers;
+
+	while (1) {
+		worker_arm(w, wheel_next(&timers));
+
+		n = epoll_wait(w->epfd, ev, LEN(ev), -1);
+
+		for (i = 0; i < n; i++) {
+			if (!(s = ev[i].data.ptr))
+				goto stop;
+
+			switch (*(enum conn_kind *) ev[i].data.ptr) {
+			case CONN_LISTENER:
+			case CONN_WATCH:
+			case CONN_ATTACH:
+				worker_accept(w, ev[i].data.ptr);
+				continue;
+			case CONN_HELLO:
+				attach_hello(ev[i].data.ptr);
+				continue;
+			case CONN_WAKE:
+				worker_wake(w);
+				continue;
+			case CONN_TIMER:
+				worker_timer(w);
+				continue;
+			case CONN_VIEWER:
+				viewer_event(ev[i].data.ptr, ev[i].events);
+				continue;
+			case CONN_PLAYER:
+				break;
+			}
+
+			cur = s;
+			pgame = s->game;
+
+			if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+				session_close(s);
+				continue;
+			}
+
+			/* EPOLLRDHUP shows up as a 0 byte read */
+			if (ev[i].events & (EPOLLIN | EPOLLRDHUP) &&
+			    session_read(s) < 0)
+				continue;
+
+			if (ev[i].events & EPOLLOUT && session_send(s) < 0)
+				session_close(s);
+		}
+
+		while ((v = LIST_FIRST(&w->closed))) {
+			LIST_REMOVE(v, entries);
+			free(v);
+		}
+
+		now = stats_now();
+		while ((t = wheel_expire(&timers, now))) {
+			cur = s = timer_session(t);
+			pgame = s->game;
+
+			blocks_step(now);
+			w->steps++;
+			session_update(s);
+		}
+	}
+
+ stop:
+	while ((s = LIST_FIRST(&w->sessions)))
+		session_close(s);
+
+	while (!LIST_EMPTY(&w->attaching))
+		attach_close(LIST_FIRST(&w->attaching));
+
+	while ((f = LIST_FIRST(&w->feeds))) {
+		while (!LIST_EMPTY(&f->viewers))
+			viewer_close(LIST_FIRST(&f->viewers));
+		feed_put(w, f);
+	}
+
+	while ((v = LIST_FIRST(&w->closed))) {
+		LIST_REMOVE(v, entries);
+		free(v);
+	}
+
+	w->ticks = host.ticks;
+	blocks_host_destroy(&host);
+
+	return NULL;
+}
+
+/*
+ * Setup
+ */
+
+static int listen_tcp(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	int fd, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0)) < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat sb;
+	int fd;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* A socket left over from last time, but nothing else */
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode)) {
+			errno = EEXIST;
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0)) < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* @path is the Unix socket's, to clean up after */
+static void add_listener(int fd, enum conn_kind kind, const char *path)
+{
+	struct listener *l = &server.listeners[server.nlisteners++];
+
+	l->kind = kind;
+	l->fd = fd;
+	if (path)
+		strcpy(l->path, path);
+}
+
+/* Every worker waits on every listener. EPOLLEXCLUSIVE wakes just one of
+ * them per connection, instead of the whole herd.
+ */
+static int start_workers(void)
+{
+	struct epoll_event ev;
+	struct worker *w;
+	unsigned i;
+	size_t j;
+
+	for (i = 0; i < server.nworkers; i++) {
+		w = &server.workers[i];
+
+		if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			return -1;
+
+		for (j = 0; j < server.nlisteners; j++) {
+			ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+			ev.data.ptr = &server.listeners[j];
+			if (epoll_ctl(w->epfd, EPOLL_CTL_ADD,
+				      server.listeners[j].fd, &ev) < 0)
+				return -1;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, server.stop_fd, &ev) < 0)
+			return -1;
+
+		w->wake.kind = CONN_WAKE;
+		w->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ev.data.ptr = &w->wake;
+		if (w->wake.fd < 0 ||
+		    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake.fd, &ev) < 0)
+			return -1;
+
+		w->timer.kind = CONN_TIMER;
+		w->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+		w->timer.at = UINT64_MAX;
+		ev.data.ptr = &w->timer;
+		if (w->timer.fd < 0 ||
+		    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timer.fd, &ev) < 0)
+			return -1;
+
+		if (pthread_create(&w->thread, NULL, worker_loop, w) != 0)
+			return -1;
+	}
+
+	return 1;
+}
+
+/* Each session is a socket, and the default limit is often 1024 */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+		log_info("Up to %llu open files",
+			 (unsigned long long) rl.rlim_cur);
+}
+
+/* Exits if it can't */
+static void listen_on(int port, const char *path, enum conn_kind kind)
+{
+	const char *what = kind == CONN_WATCH ? " for spectators" :
+		kind == CONN_ATTACH ? " for terminals" : "";
+	int fd;
+
+	if (port) {
+		if ((fd = listen_tcp(port)) < 0) {
+			log_err("Cannot listen on port %d: %s", port,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		add_listener(fd, kind, NULL);
+		log_info("Listening on port %d%s", port, what);
+	}
+
+	if (path) {
+		if ((fd = listen_unix(path)) < 0) {
+			log_err("Cannot listen on %s: %s", path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		add_listener(fd, kind, path);
+		log_info("Listening on %s%s", path, what);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL, *watch_path = NULL, *metrics_path = NULL;
+	const char *attach_path = NULL, *db_path = NULL;
+	int opt, port = 0, watch_port = 0, sig;
+	long workers = 0;
+	uint64_t one = 1, frames = 0, viewer_frames = 0, resyncs = 0;
+	uint64_t steps = 0;
+	struct tick_stats ticks = { 0 };
+	struct rusage ru;
+	struct timespec cpu;
+	struct worker *w;
+	sigset_t set;
+	unsigned i;
+	size_t j;
+	double secs;
+
+	while ((opt = getopt(argc, argv, "a:cd:hm:p:P:tu:U:w:")) != -1) {
+		switch (opt) {
+		case 'a':
+			attach_path = optarg;
+			break;
+		case 'c':
+			server.classic = true;
+			break;
+		case 'd':
+			db_path = optarg;
+			break;
+		case 't':
+			server.text = true;
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			watch_port = atoi(optarg);
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		case 'U':
+			watch_path = optarg;
+			break;
+		case 'w':
+			workers = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	/* Spectators only speak wire.h */
+	server.watch = watch_port || watch_path;
+	if ((!port && !path && !attach_path) || (server.watch && server.text))
+		usage();
+
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0)
+		workers = 1;
+	if (workers > SERVER_MAX_WORKERS)
+		workers = SERVER_MAX_WORKERS;
+	server.nworkers = workers;
+
+	/* Every thread inherits this, only sigwait() below sees them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	debug_start();
+	srand(time(NULL));
+	raise_fd_limit();
+
+	listen_on(port, path, CONN_LISTENER);
+	listen_on(watch_port, watch_path, CONN_WATCH);
+	listen_on(0, attach_path, CONN_ATTACH);
+
+	/* One connection and one writer thread, for everybody */
+	if (db_path) {
+		psave->file_loc = strdup(db_path);
+		if (!psave->file_loc || db_start() < 0) {
+			log_err("Cannot open database %s", db_path);
+			exit(EXIT_FAILURE);
+		}
+		server.db = true;
+	}
+
+	if (metrics_path)
+		metrics_start(metrics_path);
+
+	if ((server.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+	    start_workers() < 0) {
+		log_err("Cannot start workers: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	log_info("Started %u workers", server.nworkers);
+
+	sigwait(&set, &sig);
+	log_info("Stopping, %lld sessions, %lld spectators",
+		 (long long) __atomic_load_n(&server.sessions,
+					     __ATOMIC_RELAXED),
+		 (long long) __atomic_load_n(&server.viewers,
+					     __ATOMIC_RELAXED));
+
+	/* Stays readable, so every worker sees it */
+	if (write(server.stop_fd, &one, sizeof one) < 0)
+		log_err("Cannot stop workers: %s", strerror(errno));
+
+	for (i = 0; i < server.nworkers; i++) {
+		pthread_join(server.workers[i].thread, NULL);
+		frames += server.workers[i].frames;
+		viewer_frames += server.workers[i].viewer_frames;
+		resyncs += server.workers[i].resyncs;
+
+		w = &server.workers[i];
+		steps += w->steps;
+		ticks.ticks += w->ticks.ticks;
+		ticks.skipped += w->ticks.skipped;
+		for (j = 0; j < TICK_HIST_LEN; j++)
+			ticks.jitter[j] += w->ticks.jitter[j];
+	}
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	secs = cpu.tv_sec + cpu.tv_nsec / 1E9;
+	log_info("Sent %" PRIu64 " frames, %.0f per CPU second", frames,
+		 secs > 0 ? frames / secs : 0);
+	if (server.watch)
+		log_info("Sent spectators %" PRIu64 " frames, %.0f per CPU "
+			 "second, %" PRIu64 " resyncs", viewer_frames,
+			 secs > 0 ? viewer_frames / secs : 0, resyncs);
+
+	/* A thread per game would switch at least once a step */
+	getrusage(RUSAGE_SELF, &ru);
+	log_info("Stepped games %" PRIu64 " times, %ld context switches",
+		 steps, ru.ru_nvcsw + ru.ru_nivcsw);
+	tick_log_stats(&ticks);
+
+	for (i = 0; i < server.nlisteners; i++) {
+		close(server.listeners[i].fd);
+		if (server.listeners[i].path[0])
+			unlink(server.listeners[i].path);
+	}
+
+	/* Scores still queued go in first */
+	if (server.db)
+		db_close();
+
+	metrics_stop();
+	debug_stop();
+
+	return 0;
+}
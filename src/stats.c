@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#include "clock.h"
+#include "debug.h"
+#include "stats.h"
+
+static size_t hist_index(uint64_t v)
+{
+	unsigned msb;
+
+	if (v < HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest value that lands in bucket @i */
+static uint64_t hist_value(size_t i)
+{
+	unsigned shift;
+
+	if (i < HIST_SUB)
+		return i;
+
+	shift = i / HIST_SUB - 1;
+
+	return ((uint64_t) (HIST_SUB + i % HIST_SUB) << shift) +
+		((1ULL << shift) - 1);
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+	h->buckets[hist_index(value)]++;
+	h->count++;
+
+	if (value > h->max)
+		h->max = value;
+}
+
+void hist_percentiles(const struct hist *h, const double *p, uint64_t *res,
+		      size_t n)
+{
+	uint64_t seen = 0, want;
+	size_t i, j = 0;
+
+	/* One pass over the buckets for all of them */
+	for (i = 0; i < HIST_LEN && j < n; i++) {
+		seen += h->buckets[i];
+
+		while (j < n) {
+			want = (uint64_t) (p[j] / 100 * h->count + 0.5);
+			if (want < 1)
+				want = 1;
+			if (seen < want)
+				break;
+
+			res[j++] = hist_value(i) < h->max ? hist_value(i)
+							   : h->max;
+		}
+	}
+
+	/* Empty histogram */
+	while (j < n)
+		res[j++] = 0;
+}
+
+void hist_log(const struct hist *h, const char *name)
+{
+	const double p[] = { 50, 99, 99.9 };
+	uint64_t res[3];
+
+	if (!h->count)
+		return;
+
+	hist_percentiles(h, p, res, 3);
+
+	log_info("%s: %llu, p50 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus",
+		 name, (unsigned long long) h->count,
+		 (double) res[0] / NSEC_PER_USEC,
+		 (double) res[1] / NSEC_PER_USEC,
+		 (double) res[2] / NSEC_PER_USEC,
+		 (double) h->max / NSEC_PER_USEC);
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void lock_stats_taken(struct lock_stats *ls, uint64_t asked)
+{
+	ls->taken = stats_now();
+	hist_record(&ls->wait, ls->taken - asked);
+}
+
+void lock_stats_resumed(struct lock_stats *ls)
+{
+	ls->taken = stats_now();
+}
+
+void lock_stats_release(struct lock_stats *ls)
+{
+	hist_record(&ls->hold, stats_now() - ls->taken);
+}
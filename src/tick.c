@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "clock.h"
+#include "debug.h"
+#include "tick.h"
+
+static void record_jitter(struct tick_stats *stats, uint64_t late)
+{
+	size_t i = 0;
+
+	late /= NSEC_PER_USEC;
+	while (late && i < TICK_HIST_LEN - 1) {
+		late >>= 1;
+		i++;
+	}
+
+	stats->jitter[i]++;
+}
+
+void tick_start(struct tick *tick, uint64_t now, uint32_t interval)
+{
+	tick->next = now + interval;
+}
+
+unsigned tick_due(struct tick *tick, struct tick_stats *stats, uint64_t now,
+		  uint32_t interval)
+{
+	uint64_t due;
+
+	if (now < tick->next)
+		return 0;
+
+	record_jitter(stats, now - tick->next);
+
+	/* The tick we slept for, plus any we missed while we were busy */
+	due = 1 + (now - tick->next) / interval;
+	tick->next += due * interval;
+
+	/* After a long stall (suspend, SIGSTOP, swapped out) don't dump a
+	 * whole stack of gravity ticks on the player at once.
+	 */
+	if (due > TICK_MAX_CATCHUP) {
+		stats->skipped += due - TICK_MAX_CATCHUP;
+		due = TICK_MAX_CATCHUP;
+	}
+
+	stats->ticks += due;
+
+	return due;
+}
+
+void tick_log_stats(const struct tick_stats *stats)
+{
+	size_t i;
+
+	log_info("Ticks: %llu run, %llu skipped",
+		 (unsigned long long) stats->ticks,
+		 (unsigned long long) stats->skipped);
+
+	for (i = 0; i < TICK_HIST_LEN; i++) {
+		if (!stats->jitter[i])
+			continue;
+
+		log_info("Tick jitter < %6lluus: %llu",
+			 1ULL << i, (unsigned long long) stats->jitter[i]);
+	}
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "debug.h"
+#include "trace.h"
+
+#ifdef TRACE
+
+__thread struct trace_ring *trace_self;
+
+static struct {
+	pthread_mutex_t lock;		/* one dump at a time */
+	const char *path;
+	uint64_t clock0, nsec0;		/* trace_clock() vs CLOCK_MONOTONIC */
+	unsigned nrings;
+	struct trace_ring *rings[TRACE_MAX_THREADS];	/* never freed */
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t mono_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct trace_ring *trace_ring_new(void)
+{
+	unsigned i;
+
+	i = __atomic_fetch_add(&trace.nrings, 1, __ATOMIC_RELAXED);
+	if (i >= TRACE_MAX_THREADS)
+		return NULL;
+
+	if (!(trace_self = calloc(1, sizeof *trace_self)))
+		return NULL;
+
+	trace_self->tid = i + 1;
+	__atomic_store_n(&trace.rings[i], trace_self, __ATOMIC_RELEASE);
+
+	return trace_self;
+}
+
+/* Everyone else has SIGUSR1 blocked, so it lands here */
+static void *trace_signals(void *vp)
+{
+	sigset_t *set = vp;
+	int sig;
+
+	while (sigwait(set, &sig) == 0)
+		trace_dump();
+
+	return NULL;
+}
+
+int trace_start(const char *path)
+{
+	static sigset_t set;
+	pthread_t thread;
+
+	trace.path = path;
+	trace.clock0 = trace_clock();
+	trace.nsec0 = mono_nsec();
+
+	/* Threads inherit the mask, hence "before any threads" */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (pthread_create(&thread, NULL, trace_signals, &set) != 0)
+		return -1;
+
+	pthread_detach(thread);
+	atexit(trace_dump);
+
+	return 1;
+}
+
+void trace_dump(void)
+{
+	struct trace_ring *ring;
+	struct trace_event *ev;
+	uint64_t head, i;
+	double usec_per_tick;
+	unsigned r, n;
+	bool first = true;
+	FILE *fp;
+
+	pthread_mutex_lock(&trace.lock);
+
+	/* Ticks to microseconds, measured over the whole run */
+	usec_per_tick = (mono_nsec() - trace.nsec0) / 1E3 /
+			(double) (trace_clock() - trace.clock0 + 1);
+
+	if (!(fp = fopen(trace.path, "w"))) {
+		log_err("Cannot write trace to %s", trace.path);
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+
+	n = __atomic_load_n(&trace.nrings, __ATOMIC_RELAXED);
+	for (r = 0; r < n && r < TRACE_MAX_THREADS; r++) {
+		if (!(ring = __atomic_load_n(&trace.rings[r],
+					     __ATOMIC_ACQUIRE)))
+			continue;
+
+		/* The owner keeps going while we read, the oldest few events
+		 * may be overwritten under us. Good enough for a trace.
+		 */
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		i = head > TRACE_RING_LEN ? head - TRACE_RING_LEN : 0;
+
+		for (; i < head; i++) {
+			ev = &ring->ev[i % TRACE_RING_LEN];
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\","
+				"\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+				first ? "" : ",\n", ev->name, ev->phase,
+				(ev->ts - trace.clock0) * usec_per_tick,
+				ring->tid);
+			first = false;
+		}
+	}
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	log_info("Trace written to %s", trace.path);
+
+	pthread_mutex_unlock(&trace.lock);
+}
+
+#endif				/* TRACE */
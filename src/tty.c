@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <ncurses.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "db.h"
+#include "tty.h"
+
+/* Same places as screen.c, 0 based */
+#define GAME_Y_OFF 2
+#define GAME_X_OFF 2
+
+#define TEXT_Y_OFF 2
+#define TEXT_X_OFF (BLOCKS_MAX_COLUMNS + GAME_X_OFF + 2)
+
+/* Under the board, for the leaderboard and the shell after us */
+#define OVER_Y_OFF (BLOCKS_MAX_ROWS + 1)
+
+/* SGR attributes: an ANSI color, plus this for bold */
+#define BOLD 8
+
+/* By block type, as in screen.c */
+static const char colors[] = { COLOR_WHITE, COLOR_RED, COLOR_GREEN,
+	COLOR_YELLOW, COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN
+};
+
+static const char letters[] = "OITLJZS";
+
+/* Output so far, and where the terminal's at. -1 when we don't know. */
+struct out {
+	char *buf;
+	size_t len;
+	int y, x, attr;
+};
+
+static void put(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + o->len, TTY_FRAME_MAX - o->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		o->len += (size_t) n < TTY_FRAME_MAX - o->len ?
+			(size_t) n : TTY_FRAME_MAX - o->len - 1;
+}
+
+/* Cursor to (@y, @x), unless it's there already */
+static void go(struct out *o, int y, int x)
+{
+	if (o->y != y || o->x != x)
+		put(o, "\033[%d;%dH", y + 1, x + 1);
+
+	o->y = y;
+	o->x = x;
+}
+
+static void attr(struct out *o, int a)
+{
+	if (o->attr != a)
+		put(o, "\033[%d;3%dm", a & BOLD ? 1 : 0, a & ~BOLD);
+
+	o->attr = a;
+}
+
+/* @s at (@y, @x), printable ASCII only */
+static void print(struct out *o, int y, int x, int a, const char *s)
+{
+	go(o, y, x);
+	attr(o, a);
+	put(o, "%s", s);
+	o->x += strlen(s);
+}
+
+/* 0 for an empty cell, block type + 1 for the rest */
+static int cell(const struct wire_state *st, int y, int x)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(st->cells); i++)
+		if (st->cells[i] == WIRE_CELL(y, x))
+			return st->type + 1;
+
+	if (st->spaces[y] & (1U << x))
+		return ((st->colors[y] >> (x * COLOR_BITS)) & COLOR_MASK) + 1;
+
+	return 0;
+}
+
+static void draw(struct out *o, struct wire_state *shown,
+		 const struct wire_state *now, bool all)
+{
+	char num[16];
+	int y, x, c;
+	size_t i;
+
+	for (y = 2; y < BLOCKS_MAX_ROWS; y++) {
+		for (x = 0; x < BLOCKS_MAX_COLUMNS; x++) {
+			c = cell(now, y, x);
+			if (!all && c == cell(shown, y, x))
+				continue;
+
+			/* Dot every other column, as in screen.c */
+			if (c)
+				print(o, y - 2 + GAME_Y_OFF, x + 1 + GAME_X_OFF,
+				      colors[c - 1] | BOLD, "x");
+			else
+				print(o, y - 2 + GAME_Y_OFF, x + 1 + GAME_X_OFF,
+				      COLOR_WHITE, x % 2 ? "." : " ");
+		}
+	}
+
+	if (all || now->level != shown->level) {
+		snprintf(num, sizeof num, "%7u", now->level);
+		print(o, TEXT_Y_OFF + 1, TEXT_X_OFF + 7, COLOR_BLUE | BOLD, num);
+	}
+
+	if (all || now->score != shown->score) {
+		snprintf(num, sizeof num, "%7u", now->score);
+		print(o, TEXT_Y_OFF + 2, TEXT_X_OFF + 7, COLOR_BLUE | BOLD, num);
+	}
+
+	/* Letters under "Hold  Next:" */
+	for (i = 0; i < LEN(now->queue); i++) {
+		if (!all && now->queue[i] == shown->queue[i])
+			continue;
+
+		num[0] = letters[now->queue[i] % NUM_BLOCKS];
+		num[1] = '\0';
+		print(o, TEXT_Y_OFF + 6, TEXT_X_OFF + 2 + (i ? 4 + 2 * i : 0),
+		      colors[now->queue[i] % NUM_BLOCKS] | BOLD, num);
+	}
+
+	if (now->over && (all || !shown->over))
+		print(o, (BLOCKS_MAX_ROWS - 6) / 2 + GAME_Y_OFF,
+		      1 + GAME_X_OFF, COLOR_WHITE | BOLD, "GAME OVER");
+
+	*shown = *now;
+}
+
+size_t tty_start(char *buf)
+{
+	struct out o = { .buf = buf, .y = -1, .x = -1, .attr = -1 };
+	struct wire_state zero;
+	int y;
+
+	/* Plain colors, clear, and no cursor */
+	put(&o, "\033[0m\033[H\033[2J\033[?25l");
+	o.y = o.x = 0;
+
+	print(&o, 1, 1, COLOR_WHITE, "Tetris-" VERSION);
+	print(&o, TEXT_Y_OFF + 1, TEXT_X_OFF + 1, COLOR_WHITE, "Level");
+	print(&o, TEXT_Y_OFF + 2, TEXT_X_OFF + 1, COLOR_WHITE, "Score");
+	print(&o, TEXT_Y_OFF + 5, TEXT_X_OFF + 1, COLOR_WHITE, "Hold  Next:");
+	print(&o, TEXT_Y_OFF + 10, TEXT_X_OFF + 1, COLOR_WHITE, "Controls");
+	print(&o, TEXT_Y_OFF + 11, TEXT_X_OFF + 2, COLOR_WHITE, "Quit [F3]");
+	print(&o, TEXT_Y_OFF + 12, TEXT_X_OFF + 2, COLOR_WHITE, "Move [asd]");
+	print(&o, TEXT_Y_OFF + 13, TEXT_X_OFF + 2, COLOR_WHITE, "Rotate [qe]");
+	print(&o, TEXT_Y_OFF + 14, TEXT_X_OFF + 2, COLOR_WHITE,
+	      "Hold [[space]]");
+
+	/* Board outline */
+	for (y = 0; y < BLOCKS_MAX_ROWS - 2; y++) {
+		print(&o, y + GAME_Y_OFF, GAME_X_OFF, COLOR_BLUE | BOLD, "*");
+		print(&o, y + GAME_Y_OFF, BLOCKS_MAX_COLUMNS + 1 + GAME_X_OFF,
+		      COLOR_BLUE | BOLD, "*");
+	}
+	print(&o, BLOCKS_MAX_ROWS - 2 + GAME_Y_OFF, GAME_X_OFF,
+	      COLOR_BLUE | BOLD, "************");
+
+	memset(&zero, 0, sizeof zero);
+	draw(&o, &zero, &zero, true);
+
+	return o.len;
+}
+
+size_t tty_draw(char *buf, struct wire_state *shown,
+		const struct wire_state *now)
+{
+	struct out o = { .buf = buf, .y = -1, .x = -1, .attr = -1 };
+
+	draw(&o, shown, now, false);
+
+	return o.len;
+}
+
+size_t tty_over(char *buf, const struct db_score *top, ssize_t n)
+{
+	struct out o = { .buf = buf, .y = -1, .x = -1, .attr = -1 };
+	char row[64];
+	ssize_t i;
+	int y = OVER_Y_OFF;
+
+	if (n > 0)
+		print(&o, y++, 1, COLOR_WHITE, "Local Leaderboard");
+
+	for (i = 0; i < n; i++) {
+		snprintf(row, sizeof row, "%2d. %-16s%5u %7u", (int) i + 1,
+			 top[i].id, top[i].level, top[i].score);
+		print(&o, y++, 3, COLOR_WHITE, row);
+	}
+
+	/* The shell gets the terminal back as it found it */
+	go(&o, y, 0);
+	put(&o, "\033[0m\033[?25h");
+
+	return o.len;
+}
+
+size_t tty_keys(const uint8_t *in, size_t len, int *keys)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (in[i] == 3) {
+			keys[n++] = KEY_F(3);
+			continue;
+		}
+
+		if (in[i] != '\033') {
+			keys[n++] = in[i];
+			continue;
+		}
+
+		/* F3 is ESC O R, or ESC [ 1 3 ~. Anything else we skip up
+		 * to its final byte.
+		 */
+		if (i + 2 < len && in[i + 1] == 'O') {
+			if (in[i + 2] == 'R')
+				keys[n++] = KEY_F(3);
+			i += 2;
+			continue;
+		}
+
+		if (i + 1 < len && in[i + 1] == '[') {
+			if (i + 4 < len && !memcmp(in + i + 2, "13~", 3))
+				keys[n++] = KEY_F(3);
+			for (i += 2; i < len && (in[i] < 0x40 || in[i] > 0x7e);
+			     i++)
+				;
+		}
+	}
+
+	return n;
+}
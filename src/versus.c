@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "debug.h"
+#include "versus.h"
+
+/* Keys by enum blocks_input_cmd, as blocks_keys() wants them */
+static const int versus_keys[] = { 'a', 'd', 's', 'w', 'q', 'e', ' ' };
+
+static uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+int versus_init(struct versus *vs, uint32_t seed, int side)
+{
+	struct blocks_game *saved = pgame;
+	struct blocks_host *saved_host = phost;
+	int i;
+
+	memset(vs, 0, sizeof *vs);
+
+	vs->rng = seed ? seed : 1;
+	vs->side = side;
+	vs->rollback = UINT32_MAX;
+
+	/* Both games run on the one frame clock */
+	clock_virtual_init(&vs->clock, 0);
+	blocks_host_init(&vs->host);
+	vs->host.clock = &vs->clock.clock;
+	vs->host.draw = NULL;
+	vs->host.many_games = true;
+	phost = &vs->host;
+
+	/* Same pieces for both, that's only fair */
+	for (i = 0; i < 2; i++) {
+		if (blocks_init() < 0) {
+			pgame = saved;
+			phost = saved_host;
+			return -1;
+		}
+
+		vs->games[i] = pgame;
+		blocks_seed(seed);
+		blocks_start();
+	}
+
+	pgame = saved;
+	phost = saved_host;
+
+	return 1;
+}
+
+void versus_cleanup(struct versus *vs)
+{
+	struct blocks_game *saved = pgame;
+	struct blocks_host *saved_host = phost;
+	int i;
+
+	phost = &vs->host;
+	for (i = 0; i < 2; i++) {
+		pgame = vs->games[i];
+		if (pgame)
+			blocks_cleanup();
+		vs->games[i] = NULL;
+	}
+
+	blocks_host_destroy(&vs->host);
+
+	pgame = saved;
+	phost = saved_host;
+}
+
+/* Press the keys in bit order, all at the start of the frame */
+static void play_keys(uint8_t bits)
+{
+	int keys[LEN(versus_keys)];
+	size_t i, n = 0;
+
+	for (i = 0; i < LEN(versus_keys); i++)
+		if (bits & VERSUS_KEY(i))
+			keys[n++] = versus_keys[i];
+
+	if (n)
+		blocks_keys(keys, n, false);
+}
+
+/* 2, 3 and 4 line clears send 1, 2 and 4 rows */
+static unsigned garbage_rows(uint32_t lines)
+{
+	return lines >= 4 ? 4 : lines >= 2 ? lines - 1 : 0;
+}
+
+/* Runs frame @f, saving the state before it first */
+static void run_frame(struct versus *vs, uint32_t f)
+{
+	struct versus_frame *saved = &vs->saved[f % VERSUS_RING];
+	uint64_t now = (uint64_t) f * VERSUS_FRAME_NSEC;
+	uint32_t lines[2] = { 0, 0 };
+	int i;
+
+	/* Keys are presses, not held buttons, so whatever they pressed last
+	 * they most likely aren't pressing now
+	 */
+	if (vs->known[f % VERSUS_RING] != f + 1)
+		vs->keys[1][f % VERSUS_RING] = 0;
+
+	saved->rng = vs->rng;
+	for (i = 0; i < 2; i++) {
+		pgame = vs->games[i];
+		blocks_snapshot(&saved->games[i]);
+	}
+
+	/* First loss ends it, for both */
+	if (vs->games[0]->lose || vs->games[1]->lose)
+		return;
+
+	vs->clock.now = now;
+
+	for (i = 0; i < 2; i++) {
+		pgame = vs->games[i];
+		lines[i] = pgame->lines;
+
+		play_keys(vs->keys[i][f % VERSUS_RING]);
+		blocks_step(now);
+
+		lines[i] = pgame->lines - lines[i];
+	}
+
+	/* Both peers take from the generator in the same order, player 0's
+	 * garbage first
+	 */
+	for (i = vs->side; i < vs->side + 2; i++) {
+		pgame = vs->games[!(i % 2)];
+		if (!garbage_rows(lines[i % 2]) || pgame->lose)
+			continue;
+
+		blocks_garbage(garbage_rows(lines[i % 2]),
+			       xorshift32(&vs->rng) % BLOCKS_MAX_COLUMNS);
+	}
+
+	if (vs->games[0]->lose || vs->games[1]->lose)
+		vs->over = f + 1;
+}
+
+int versus_advance(struct versus *vs, uint8_t keys)
+{
+	struct blocks_game *saved = pgame;
+	struct blocks_host *saved_host = phost;
+	uint64_t start;
+
+	if (vs->frame >= vs->confirmed + VERSUS_MAX_ROLLBACK) {
+		vs->stalls++;
+		return 0;
+	}
+
+	start = stats_now();
+
+	phost = &vs->host;
+	vs->keys[0][vs->frame % VERSUS_RING] = keys;
+	run_frame(vs, vs->frame++);
+
+	hist_record(&vs->frame_time, stats_now() - start);
+	pgame = saved;
+	phost = saved_host;
+
+	return 1;
+}
+
+/* Back to before @vs->rollback, then everything since again, on the keys
+ * we know now
+ */
+static void roll_back(struct versus *vs)
+{
+	struct versus_frame *saved = &vs->saved[vs->rollback % VERSUS_RING];
+	uint64_t start = stats_now(), took;
+	uint32_t f;
+	int i;
+
+	vs->rng = saved->rng;
+	for (i = 0; i < 2; i++) {
+		pgame = vs->games[i];
+		blocks_rewind(&saved->games[i]);
+	}
+
+	if (vs->over > vs->rollback)
+		vs->over = 0;
+
+	for (f = vs->rollback; f < vs->frame; f++)
+		run_frame(vs, f);
+
+	took = stats_now() - start;
+	vs->rollbacks++;
+	vs->replayed += vs->frame - vs->rollback;
+	vs->replay_nsec += took;
+	hist_record(&vs->rollback_time, took);
+
+	vs->rollback = UINT32_MAX;
+}
+
+void versus_receive(struct versus *vs, const struct versus_packet *pkt)
+{
+	struct blocks_game *saved = pgame;
+	struct blocks_host *saved_host = phost;
+	uint32_t f, slot;
+	size_t i;
+
+	for (i = 0; i < pkt->n && i < LEN(pkt->keys); i++) {
+		f = pkt->frame + i;
+		slot = f % VERSUS_RING;
+
+		/* Old news, or too far ahead to have a slot */
+		if (f < vs->confirmed || f >= vs->confirmed + VERSUS_RING ||
+		    vs->known[slot] == f + 1)
+			continue;
+
+		if (f < vs->frame && vs->keys[1][slot] != pkt->keys[i] &&
+		    f < vs->rollback)
+			vs->rollback = f;
+
+		vs->keys[1][slot] = pkt->keys[i];
+		vs->known[slot] = f + 1;
+	}
+
+	while (vs->known[vs->confirmed % VERSUS_RING] == vs->confirmed + 1)
+		vs->confirmed++;
+
+	if (pkt->ack > vs->acked && pkt->ack <= vs->frame)
+		vs->acked = pkt->ack;
+
+	phost = &vs->host;
+	if (vs->rollback < vs->frame)
+		roll_back(vs);
+
+	pgame = saved;
+	phost = saved_host;
+}
+
+void versus_packet(const struct versus *vs, struct versus_packet *pkt)
+{
+	uint32_t f;
+
+	pkt->frame = vs->acked;
+	if (vs->frame > VERSUS_RING && pkt->frame < vs->frame - VERSUS_RING)
+		pkt->frame = vs->frame - VERSUS_RING;
+
+	pkt->ack = vs->confirmed;
+	pkt->n = vs->frame - pkt->frame;
+
+	for (f = pkt->frame; f < vs->frame; f++)
+		pkt->keys[f - pkt->frame] = vs->keys[0][f % VERSUS_RING];
+}
+
+enum versus_result versus_result(const struct versus *vs)
+{
+	bool lost = vs->games[0]->lose, won = vs->games[1]->lose;
+
+	/* Not over, or could still be rolled back */
+	if (!vs->over || vs->over > vs->confirmed)
+		return VERSUS_PLAYING;
+
+	if (lost && won)
+		return VERSUS_DRAW;
+	if (lost)
+		return VERSUS_LOST;
+	if (won)
+		return VERSUS_WON;
+
+	return VERSUS_PLAYING;
+}
+
+uint32_t versus_checksum(const struct versus *vs, int i)
+{
+	struct blocks_game *saved = pgame;
+	struct blocks_snapshot snap;
+
+	pgame = vs->games[i];
+	blocks_snapshot(&snap);
+	pgame = saved;
+
+	return blocks_snapshot_checksum(&snap);
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "wheel.h"
+
+#define SLOT_MASK	(WHEEL_SLOTS - 1)
+#define BIT(slot)	(1ULL << ((slot) & 63))
+#define EXPIRED		UINT16_MAX		/* timer->slot, on ->expired */
+
+/* Ticks one slot of @level spans */
+#define SPAN(level)	(1ULL << ((level) * WHEEL_BITS))
+
+void wheel_init(struct wheel *w, uint64_t now)
+{
+	size_t i, j;
+
+	w->now = now / WHEEL_TICK;
+	w->armed = 0;
+
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		for (j = 0; j < WHEEL_WORDS; j++)
+			w->busy[i][j] = 0;
+		for (j = 0; j < WHEEL_SLOTS; j++)
+			LIST_INIT(&w->slots[i][j]);
+	}
+	LIST_INIT(&w->expired);
+}
+
+/* Into the slot that comes round before it's due. Level L takes timers
+ * SPAN(L) to SPAN(L + 1) ticks out; the slot is the tick's level L digit,
+ * which is the same for no two ticks in that range.
+ */
+static void place(struct wheel *w, struct wheel_timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	unsigned level, slot;
+
+	if (expires < w->now) {
+		t->slot = EXPIRED;
+		LIST_INSERT_HEAD(&w->expired, t, entries);
+		return;
+	}
+
+	delta = expires - w->now;
+	if (delta >= SPAN(WHEEL_LEVELS)) {
+		/* Waits at the far end, and goes round again from there */
+		delta = SPAN(WHEEL_LEVELS) - 1;
+		expires = w->now + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < SPAN(level + 1))
+			break;
+
+	slot = (expires >> (level * WHEEL_BITS)) & SLOT_MASK;
+
+	t->slot = level * WHEEL_SLOTS + slot;
+	LIST_INSERT_HEAD(&w->slots[level][slot], t, entries);
+	w->busy[level][slot / 64] |= BIT(slot);
+}
+
+/* Takes @t off its list, and clears the busy bit if that was the last.
+ * LIST_REMOVE() leaves the links be, we check them to see if it's set.
+ */
+static void unlink_timer(struct wheel *w, struct wheel_timer *t)
+{
+	unsigned level = t->slot / WHEEL_SLOTS, slot = t->slot & SLOT_MASK;
+
+	LIST_REMOVE(t, entries);
+	t->entries.le_prev = NULL;
+
+	if (t->slot != EXPIRED && LIST_EMPTY(&w->slots[level][slot]))
+		w->busy[level][slot / 64] &= ~BIT(slot);
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t deadline)
+{
+	wheel_del(w, t);
+
+	/* Rounded up, so it can't go off before @deadline */
+	if (deadline > UINT64_MAX - WHEEL_TICK)
+		t->expires = UINT64_MAX / WHEEL_TICK;
+	else
+		t->expires = (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+
+	place(w, t);
+	w->armed++;
+}
+
+void wheel_del(struct wheel *w, struct wheel_timer *t)
+{
+	if (!t->entries.le_prev)
+		return;
+
+	unlink_timer(w, t);
+	w->armed--;
+}
+
+/* First tick from ->now on that has work in @level: a level 0 slot's
+ * timers are due, a higher one's cascade. UINT64_MAX if it has none.
+ */
+static uint64_t level_next(const struct wheel *w, unsigned level)
+{
+	const uint64_t *busy = w->busy[level];
+	uint64_t first, span = SPAN(level), word;
+	unsigned k, i, slot;
+
+	/* The first tick on a slot boundary, and that slot */
+	first = (w->now + span - 1) & ~(span - 1);
+	k = (first >> (level * WHEEL_BITS)) & SLOT_MASK;
+
+	/* Round the words from k's, the bits below k last */
+	word = busy[k / 64] & ~(BIT(k) - 1);
+	for (i = 0; !word && i < WHEEL_WORDS; i++)
+		word = busy[(k / 64 + 1 + i) % WHEEL_WORDS];
+	if (!word)
+		return UINT64_MAX;
+
+	i = i ? (k / 64 + i) % WHEEL_WORDS : k / 64;
+	slot = i * 64 + __builtin_ctzll(word);
+
+	return first + (uint64_t) ((slot - k) & SLOT_MASK) * span;
+}
+
+static uint64_t next_tick(const struct wheel *w)
+{
+	uint64_t next = UINT64_MAX, t;
+	unsigned level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		if ((t = level_next(w, level)) < next)
+			next = t;
+
+	return next;
+}
+
+/* Tick ->now: whatever is in the slots it reaches moves down a level, or
+ * if that's level 0, is due
+ */
+static void run_tick(struct wheel *w)
+{
+	struct wheel_timer *t;
+	unsigned level, slot;
+
+	for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+		if (w->now & (SPAN(level) - 1))
+			continue;
+
+		slot = (w->now >> (level * WHEEL_BITS)) & SLOT_MASK;
+		while ((t = LIST_FIRST(&w->slots[level][slot]))) {
+			unlink_timer(w, t);
+			place(w, t);
+		}
+	}
+
+	/* ->expired is empty, so the slot's list just becomes it. The timers
+	 * keep their ->slot; taking one off only clears a bit already clear,
+	 * or leaves one set that still is.
+	 */
+	slot = w->now & SLOT_MASK;
+	if ((t = LIST_FIRST(&w->slots[0][slot]))) {
+		LIST_FIRST(&w->expired) = t;
+		t->entries.le_prev = &LIST_FIRST(&w->expired);
+		LIST_INIT(&w->slots[0][slot]);
+		w->busy[0][slot / 64] &= ~BIT(slot);
+	}
+}
+
+struct wheel_timer *wheel_expire(struct wheel *w, uint64_t now)
+{
+	uint64_t tick = now / WHEEL_TICK, next;
+	struct wheel_timer *t;
+
+	while (LIST_EMPTY(&w->expired) && w->now <= tick) {
+		/* Straight to the next tick with anything to do */
+		next = next_tick(w);
+		if (next > tick) {
+			w->now = tick + 1;
+			break;
+		}
+
+		w->now = next;
+		run_tick(w);
+		w->now++;
+	}
+
+	if (!(t = LIST_FIRST(&w->expired)))
+		return NULL;
+
+	unlink_timer(w, t);
+	w->armed--;
+
+	return t;
+}
+
+uint64_t wheel_next(const struct wheel *w)
+{
+	uint64_t next;
+
+	if (!LIST_EMPTY(&w->expired))
+		return 0;
+
+	next = next_tick(w);
+
+	return next == UINT64_MAX ? next : next * WHEEL_TICK;
+}
@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "wire.h"
+
+#define ROW_MASK	((1U << BLOCKS_MAX_ROWS) - 1)
+#define FULL_ROW	((1U << BLOCKS_MAX_COLUMNS) - 1)
+#define CELLS		(BLOCKS_MAX_ROWS * BLOCKS_MAX_COLUMNS)
+
+/* A piece lies across at most this many rows, so that's the most lines
+ * one lock can clear, and the fewest cells it leaves for a row to fill.
+ */
+#define CLEAR_MAX	4
+
+struct reader {
+	const uint8_t *p, *end;
+	bool bad;			/* ran out, or nonsense */
+};
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+static uint64_t get_varint(struct reader *r)
+{
+	uint64_t v = 0;
+	unsigned shift;
+
+	for (shift = 0; r->p < r->end && shift < 64; shift += 7) {
+		v |= (uint64_t) (*r->p & 0x7f) << shift;
+		if (!(*r->p++ & 0x80))
+			return v;
+	}
+
+	r->bad = true;
+	return 0;
+}
+
+static uint8_t get_byte(struct reader *r)
+{
+	if (r->p == r->end) {
+		r->bad = true;
+		return 0;
+	}
+
+	return *r->p++;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* Start of a frame in @buf, returns its length or -1/0 like the decoders.
+ * An empty frame is still a byte long, so it's never taken for one that
+ * isn't all there yet.
+ */
+static ssize_t get_frame(struct reader *r, const uint8_t *buf, size_t len)
+{
+	uint64_t body;
+
+	r->p = buf;
+	r->end = buf + len;
+	r->bad = false;
+
+	body = get_varint(r);
+	if (r->bad)
+		return r->p == r->end && len < 2 ? 0 : -1;
+
+	if (body > WIRE_FRAME_MAX - (size_t) (r->p - buf))
+		return -1;
+
+	if ((size_t) (r->end - r->p) < body)
+		return 0;
+
+	r->end = r->p + body;
+
+	return r->end - buf;
+}
+
+/* Length in front of the body at @buf + 2, which is @len long */
+static size_t put_frame(uint8_t *buf, size_t len)
+{
+	uint8_t *p = put_varint(buf, len);
+
+	if (p - buf == 1)
+		memmove(buf + 1, buf + 2, len);
+
+	return (p - buf) + len;
+}
+
+/*
+ * Boards
+ */
+
+/* Take out the rows in @mask, everything above them moves down */
+static void clear_rows(uint16_t *spaces, uint32_t *colors, uint32_t mask)
+{
+	int i, j;
+
+	for (i = j = BLOCKS_MAX_ROWS - 1; i >= 0; i--) {
+		if (mask & (1U << i))
+			continue;
+		spaces[j] = spaces[i];
+		colors[j] = colors[i];
+		j--;
+	}
+
+	for (; j >= 0; j--) {
+		spaces[j] = 0;
+		colors[j] = 0;
+	}
+}
+
+static uint32_t rows_changed(const uint16_t *spaces, const uint32_t *colors,
+			     const struct wire_state *now)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < BLOCKS_MAX_ROWS; i++)
+		if (spaces[i] != now->spaces[i] || colors[i] != now->colors[i])
+			mask |= 1U << i;
+
+	return mask;
+}
+
+/*
+ * Lines cleared since @sent, as best we can tell: the rows that, taken out,
+ * leave the fewest rows to send. A lock alone changes at most CLEAR_MAX
+ * rows, so only look when more changed. Clears are within CLEAR_MAX rows
+ * of each other, and of rows that were nearly full.
+ */
+static uint32_t find_clear(const struct wire_state *sent,
+			   const struct wire_state *now)
+{
+	uint16_t spaces[BLOCKS_MAX_ROWS];
+	uint32_t colors[BLOCKS_MAX_ROWS], mask, best_mask = 0;
+	int best, n, top, i;
+	unsigned sub;
+
+	best = __builtin_popcount(rows_changed(sent->spaces, sent->colors,
+					       now));
+	if (best <= CLEAR_MAX)
+		return 0;
+
+	for (top = 0; top < BLOCKS_MAX_ROWS; top++) {
+		for (sub = 1; sub < 1U << CLEAR_MAX; sub++) {
+			mask = (sub << top) & ROW_MASK;
+			if (mask != sub << top || !(sub & 1))
+				continue;
+
+			for (i = top; i < top + CLEAR_MAX; i++)
+				if (mask & (1U << i) &&
+				    __builtin_popcount(sent->spaces[i]) <
+				    BLOCKS_MAX_COLUMNS - CLEAR_MAX)
+					break;
+			if (i < top + CLEAR_MAX)
+				continue;
+
+			memcpy(spaces, sent->spaces, sizeof spaces);
+			memcpy(colors, sent->colors, sizeof colors);
+			clear_rows(spaces, colors, mask);
+
+			n = __builtin_popcount(rows_changed(spaces, colors,
+							    now));
+			if (n < best) {
+				best = n;
+				best_mask = mask;
+			}
+		}
+	}
+
+	return best_mask;
+}
+
+/* Colors of the cells in @cells, packed lowest column first */
+static uint32_t pack_colors(uint32_t colors, uint16_t cells)
+{
+	uint32_t packed = 0;
+	unsigned n = 0;
+	int x;
+
+	for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+		if (cells & (1U << x))
+			packed |= ((colors >> (x * COLOR_BITS)) & COLOR_MASK)
+				<< (n++ * COLOR_BITS);
+
+	return packed;
+}
+
+/* COLOR_MASK for each cell in @cells, where they sit in a colors row */
+static uint32_t color_bits(uint16_t cells)
+{
+	uint32_t bits = 0;
+	int x;
+
+	for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+		if (cells & (1U << x))
+			bits |= COLOR_MASK << (x * COLOR_BITS);
+
+	return bits;
+}
+
+/* Cells whose color differs between two colors rows */
+static uint16_t color_cells(uint32_t a, uint32_t b)
+{
+	uint16_t cells = 0;
+	int x;
+
+	for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+		if (((a ^ b) >> (x * COLOR_BITS)) & COLOR_MASK)
+			cells |= 1U << x;
+
+	return cells;
+}
+
+static uint32_t unpack_colors(uint32_t packed, uint16_t cells)
+{
+	uint32_t colors = 0;
+	int x;
+
+	for (x = 0; x < BLOCKS_MAX_COLUMNS; x++) {
+		if (!(cells & (1U << x)))
+			continue;
+		colors |= (packed & COLOR_MASK) << (x * COLOR_BITS);
+		packed >>= COLOR_BITS;
+	}
+
+	return colors;
+}
+
+/*
+ * Server side
+ */
+
+/* Records taking @sent to @now, from @p on. Returns where they end. */
+static uint8_t *encode(uint8_t *p, struct wire_state *sent,
+		       const struct wire_state *now)
+{
+	uint16_t flip, filled;
+	uint32_t mask, all;
+	uint64_t queue;
+	int d, i;
+
+	if ((mask = find_clear(sent, now))) {
+		*p++ = WIRE_CLEAR;
+		p = put_varint(p, mask);
+		clear_rows(sent->spaces, sent->colors, mask);
+	}
+
+	if ((mask = rows_changed(sent->spaces, sent->colors, now))) {
+		*p++ = WIRE_ROWS;
+		p = put_varint(p, mask);
+
+		for (i = 0; i < BLOCKS_MAX_ROWS; i++) {
+			if (!(mask & (1U << i)))
+				continue;
+
+			/* Usually only cells that just filled need a color.
+			 * If any other cell changed color, send them all.
+			 */
+			flip = sent->spaces[i] ^ now->spaces[i];
+			filled = flip & now->spaces[i];
+			all = !!(color_cells(sent->colors[i], now->colors[i]) &
+				 now->spaces[i] & ~filled);
+			if (all)
+				filled = now->spaces[i];
+
+			p = put_varint(p, flip | all << BLOCKS_MAX_COLUMNS);
+			p = put_varint(p, pack_colors(now->colors[i], filled));
+		}
+	}
+
+	if (sent->type != now->type ||
+	    memcmp(sent->cells, now->cells, sizeof now->cells)) {
+		d = now->cells[0] - sent->cells[0];
+		for (i = 1; i < 4; i++)
+			if (now->cells[i] - sent->cells[i] != d)
+				break;
+
+		if (sent->type == now->type && i == 4) {
+			*p++ = WIRE_MOVE;
+			p = put_varint(p, zigzag(d));
+		} else {
+			*p++ = WIRE_PIECE;
+			*p++ = now->type;
+			memcpy(p, now->cells, 4);
+			p += 4;
+		}
+	}
+
+	if (memcmp(sent->queue, now->queue, sizeof now->queue)) {
+		if (sent->queue[0] == now->queue[0] &&
+		    !memcmp(&sent->queue[2], &now->queue[1],
+			    sizeof now->queue - 2)) {
+			*p++ = WIRE_SHIFT;
+			*p++ = now->queue[NEXT_BLOCKS_LEN];
+		} else {
+			for (i = 0, queue = 0; i < (int) sizeof now->queue; i++)
+				queue |= (uint64_t) now->queue[i]
+					<< (i * COLOR_BITS);
+			*p++ = WIRE_QUEUE;
+			p = put_varint(p, queue);
+		}
+	}
+
+	if (sent->level != now->level || sent->score != now->score) {
+		*p++ = WIRE_SCORE;
+		p = put_varint(p, zigzag((int64_t) now->level - sent->level));
+		p = put_varint(p, zigzag((int64_t) now->score - sent->score));
+	}
+
+	if (now->over && !sent->over)
+		*p++ = WIRE_OVER;
+
+	*sent = *now;
+
+	return p;
+}
+
+size_t wire_encode(uint8_t *buf, struct wire_state *sent,
+		   const struct wire_state *now)
+{
+	uint8_t *body = buf + 2, *p = encode(body, sent, now);
+
+	if (p == body)
+		return 0;
+
+	return put_frame(buf, p - body);
+}
+
+size_t wire_encode_key(uint8_t *buf, const struct wire_state *now)
+{
+	struct wire_state empty = { 0 };
+	uint8_t *body = buf + 2, *p = body;
+
+	*p++ = WIRE_RESET;
+	p = encode(p, &empty, now);
+
+	return put_frame(buf, p - body);
+}
+
+ssize_t wire_decode_keys(const uint8_t *buf, size_t len, int *keys,
+			 size_t *n)
+{
+	struct reader r;
+	ssize_t frame;
+	uint64_t key;
+
+	if ((frame = get_frame(&r, buf, len)) <= 0)
+		return frame;
+
+	for (*n = 0; r.p < r.end; (*n)++) {
+		key = get_varint(&r);
+		if (r.bad || *n == WIRE_KEYS_MAX || key > INT32_MAX)
+			return -1;
+		keys[*n] = key;
+	}
+
+	return r.end - buf;
+}
+
+/*
+ * Client side
+ */
+
+ssize_t wire_decode(const uint8_t *buf, size_t len, struct wire_state *st)
+{
+	struct reader r;
+	ssize_t frame;
+	uint64_t v, mask;
+	uint16_t filled;
+	int64_t d;
+	int i;
+
+	if ((frame = get_frame(&r, buf, len)) <= 0)
+		return frame;
+
+	while (r.p < r.end && !r.bad) {
+		switch (get_byte(&r)) {
+		case WIRE_CLEAR:
+			if ((v = get_varint(&r)) >> BLOCKS_MAX_ROWS)
+				return -1;
+			clear_rows(st->spaces, st->colors, v);
+			break;
+		case WIRE_ROWS:
+			if ((mask = get_varint(&r)) >> BLOCKS_MAX_ROWS)
+				return -1;
+
+			for (i = 0; i < BLOCKS_MAX_ROWS; i++) {
+				if (!(mask & (1U << i)))
+					continue;
+
+				if ((v = get_varint(&r)) >>
+				    (BLOCKS_MAX_COLUMNS + 1))
+					return -1;
+
+				/* The low bits flip, the top one says whose
+				 * colors follow
+				 */
+				st->spaces[i] ^= v & FULL_ROW;
+				filled = v >> BLOCKS_MAX_COLUMNS ? st->spaces[i] :
+					v & st->spaces[i];
+
+				v = get_varint(&r);
+				st->colors[i] &= color_bits(st->spaces[i] &
+							    ~filled);
+				st->colors[i] |= unpack_colors(v, filled);
+			}
+			break;
+		case WIRE_PIECE:
+			if ((st->type = get_byte(&r)) >= NUM_BLOCKS)
+				return -1;
+			for (i = 0; i < 4; i++)
+				if ((st->cells[i] = get_byte(&r)) >= CELLS)
+					return -1;
+			break;
+		case WIRE_MOVE:
+			d = unzigzag(get_varint(&r));
+			for (i = 0; i < 4; i++) {
+				if (st->cells[i] + d < 0 ||
+				    st->cells[i] + d >= CELLS)
+					return -1;
+				st->cells[i] += d;
+			}
+			break;
+		case WIRE_QUEUE:
+			v = get_varint(&r);
+			for (i = 0; i < (int) sizeof st->queue; i++)
+				if ((st->queue[i] = (v >> (i * COLOR_BITS)) &
+				     COLOR_MASK) >= NUM_BLOCKS)
+					return -1;
+			break;
+		case WIRE_SHIFT:
+			memmove(&st->queue[1], &st->queue[2],
+				sizeof st->queue - 2);
+			if ((st->queue[NEXT_BLOCKS_LEN] = get_byte(&r)) >=
+			    NUM_BLOCKS)
+				return -1;
+			break;
+		case WIRE_SCORE:
+			st->level += unzigzag(get_varint(&r));
+			st->score += unzigzag(get_varint(&r));
+			break;
+		case WIRE_OVER:
+			st->over = true;
+			break;
+		case WIRE_RESET:
+			memset(st, 0, sizeof *st);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return r.bad ? -1 : r.end - buf;
+}
+
+size_t wire_encode_keys(uint8_t *buf, const int *keys, size_t n)
+{
+	uint8_t *body = buf + 2, *p = body;
+	size_t i;
+
+	for (i = 0; i < n && i < WIRE_KEYS_MAX; i++)
+		p = put_varint(p, (uint32_t) keys[i]);
+
+	return put_frame(buf, p - body);
+}
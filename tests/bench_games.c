@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Resident games benchmark: starts lots of games on one host, as a server
+ * worker would, and reports what they cost in RSS, then steps every one of
+ * them at 60Hz on a virtual clock, with a key for every 8th game each round.
+ *
+ *	tests/bench_games [games] [rounds]
+ *
+ * 1M games and 60 rounds, a second of game time, by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "clock.h"
+#include "stats.h"
+
+#define FRAME_NSEC	(NSEC_PER_SEC / 60)
+
+/* Every 8th game gets one of these each round */
+static const char keys[] = "adqesw ";
+
+static long rss_kb(void)
+{
+	FILE *fp = fopen("/proc/self/status", "r");
+	char line[256];
+	long kb = 0;
+
+	while (fp && fgets(line, sizeof line, fp))
+		if (!strncmp(line, "VmRSS:", 6))
+			kb = atol(line + 6);
+
+	if (fp)
+		fclose(fp);
+
+	return kb;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000, i;
+	int rounds = argc > 2 ? atoi(argv[2]) : 60, r, key;
+	struct blocks_game **games;
+	struct clock_virtual virt;
+	struct blocks_host host;
+	uint64_t start, end, now, steps = 0, pressed = 0;
+	long rss;
+	double per_game;
+
+	if (!n || !(games = malloc(n * sizeof *games))) {
+		fprintf(stderr, "Can't have %zu games\n", n);
+		return EXIT_FAILURE;
+	}
+
+	/* One host for all of them, no drawing */
+	clock_virtual_init(&virt, 0);
+	blocks_host_init(&host);
+	host.draw = NULL;
+	host.clock = &virt.clock;
+	phost = &host;
+
+	srand(1);
+	rss = rss_kb();
+	start = stats_now();
+
+	for (i = 0; i < n; i++) {
+		blocks_init();
+		blocks_start();
+		games[i] = pgame;
+	}
+
+	end = stats_now();
+	per_game = (rss_kb() - rss) * 1024.0 / n;
+
+	printf("%zu games: %.1f MB RSS, %.0f B/game, %.2fM games/GB, "
+	       "%.0f ns to start one\n", n, per_game * n / (1 << 20),
+	       per_game, per_game > 0 ? (1 << 30) / per_game / 1E6 : 0,
+	       (double) (end - start) / n);
+
+	start = stats_now();
+
+	for (r = 1; r <= rounds; r++) {
+		now = r * FRAME_NSEC;
+		virt.now = now;
+
+		for (i = 0; i < n; i++) {
+			pgame = games[i];
+			if (pgame->lose)
+				continue;
+
+			if ((i + r) % 8 == 0) {
+				key = keys[(i + r) % (sizeof keys - 1)];
+				blocks_keys(&key, 1, false);
+				pressed++;
+			}
+
+			blocks_step(now);
+			steps++;
+		}
+	}
+
+	end = stats_now();
+
+	printf("%d rounds: %llu steps, %llu keys, %.1f ns/step, "
+	       "%.1fM steps/s\n", rounds, (unsigned long long) steps,
+	       (unsigned long long) pressed,
+	       steps ? (double) (end - start) / steps : 0,
+	       end > start ? steps * 1E3 / (end - start) : 0);
+
+	for (i = 0; i < n; i++) {
+		pgame = games[i];
+		blocks_cleanup();
+	}
+
+	blocks_host_destroy(&host);
+	free(games);
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Resume benchmark: fills Saves with players x SLOTS slots worth of game
+ * saves, then times the old two sorted SELECTs and a DELETE against
+ * db_resume_state(), for players with saves and for one without.
+ *
+ *	tests/bench_resume [saves] [database]
+ *
+ * 100k saves and /tmp/bench_resume.db by default. The database is removed
+ * when we're done.
+ */
+
+#include <bsd/string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "blocks.h"
+#include "clock.h"
+#include "db.h"
+#include "debug.h"
+#include "stats.h"
+
+#define SLOTS		5
+#define SAVES		20	/* per slot */
+#define RESUMES		1000
+
+static void fill(const char *path, long saves)
+{
+	struct blocks_save save;
+	sqlite3_stmt *stmt;
+	sqlite3 *db;
+	char name[16], slot[16];
+	int i;
+
+	blocks_save(&save);
+
+	if (sqlite3_open(path, &db) != SQLITE_OK ||
+	    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "INSERT INTO Saves VALUES(?,?,?,?);", -1,
+			       &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Player, then slot, then SAVES saves a second apart */
+	for (i = 0; i < saves; i++) {
+		snprintf(name, sizeof name, "p%d", i / (SLOTS * SAVES));
+		snprintf(slot, sizeof slot, "s%d", i / SAVES % SLOTS);
+		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, slot, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 3, 1400000000 + i);
+		sqlite3_bind_blob(stmt, 4, &save, sizeof save, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+	sqlite3_close(db);
+}
+
+/* What resuming used to do: the newest save of anybody, found twice by
+ * sorting the whole table, then deleted by ROWID
+ */
+static void old_resume(const char *path)
+{
+	sqlite3_stmt *stmt;
+	sqlite3 *db;
+	sqlite3_int64 rowid = 0;
+	uint64_t start;
+	char sql[64];
+
+	sqlite3_open(path, &db);
+	start = stats_now();
+
+	sqlite3_prepare_v2(db, "SELECT * FROM Saves ORDER BY date DESC;", -1,
+			   &stmt, NULL);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	sqlite3_prepare_v2(db, "SELECT ROWID,date FROM Saves "
+			   "ORDER BY date DESC;", -1, &stmt, NULL);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		rowid = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	snprintf(sql, sizeof sql, "DELETE FROM Saves WHERE ROWID = %lld;",
+		 (long long) rowid);
+	sqlite3_exec(db, sql, NULL, NULL, NULL);
+
+	printf("old SELECT/SELECT/DELETE     %10.1f us\n",
+	       (double) (stats_now() - start) / NSEC_PER_USEC);
+
+	sqlite3_close(db);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 2 ? argv[2] : "/tmp/bench_resume.db";
+	long saves = argc > 1 ? atol(argv[1]) : 100000;
+	long players = saves / (SLOTS * SAVES);
+	struct blocks_host host;
+	char wal[256], shm[256];
+	uint64_t start, hits = 0;
+	int i;
+
+	if (players < 1) {
+		fprintf(stderr, "At least %d saves\n", SLOTS * SAVES);
+		return EXIT_FAILURE;
+	}
+
+	snprintf(wal, sizeof wal, "%s-wal", path);
+	snprintf(shm, sizeof shm, "%s-shm", path);
+	unlink(path);
+	unlink(wal);
+	unlink(shm);
+
+	/* Resuming logs, through the rings like in the game */
+	debug_start();
+
+	/* Saves are restored into a game, as at startup */
+	blocks_host_init(&host);
+	phost = &host;
+	blocks_init();
+
+	/* The first open makes the tables */
+	psave->file_loc = strdup(path);
+	if (db_start() < 0)
+		return EXIT_FAILURE;
+	db_close();
+
+	fill(path, saves);
+	printf("%ld saves, %ld players x %d slots\n", saves, players, SLOTS);
+
+	old_resume(path);
+
+	psave->file_loc = strdup(path);
+	if (db_start() < 0)
+		return EXIT_FAILURE;
+
+	/* A different player and slot every time. Each takes one save out,
+	 * there's plenty left.
+	 */
+	start = stats_now();
+	for (i = 0; i < RESUMES; i++) {
+		snprintf(psave->id, sizeof psave->id, "p%d",
+			 (int) (i % players));
+		snprintf(psave->slot, sizeof psave->slot, "s%d", i % SLOTS);
+		hits += db_resume_state() > 0;
+	}
+	printf("db_resume_state(), hit       %10.1f us (%llu/%d)\n",
+	       (double) (stats_now() - start) / RESUMES / NSEC_PER_USEC,
+	       (unsigned long long) hits, RESUMES);
+
+	strlcpy(psave->id, "nobody", sizeof psave->id);
+	start = stats_now();
+	for (i = 0; i < RESUMES; i++)
+		db_resume_state();
+	printf("db_resume_state(), no save   %10.1f us\n",
+	       (double) (stats_now() - start) / RESUMES / NSEC_PER_USEC);
+
+	db_close();
+	blocks_cleanup();
+	blocks_host_destroy(&host);
+	debug_stop();
+
+	unlink(path);
+	unlink(wal);
+	unlink(shm);
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Leaderboard benchmark: fills Scores with random rows, then times the old
+ * unindexed query, the index build on first open, and db_get_scores() with
+ * and without @after.
+ *
+ *	tests/bench_scores [rows] [database]
+ *
+ * 10M rows and /tmp/bench_scores.db by default. The database is removed
+ * when we're done.
+ */
+
+#include <bsd/string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "clock.h"
+#include "db.h"
+#include "stats.h"
+
+#define PAGES		1000	/* deep pages walked with @after */
+#define REPEAT		1000
+
+/* Players, so names repeat like they would */
+#define NAMES		100000
+
+static void fill(const char *path, long rows)
+{
+	sqlite3_stmt *stmt;
+	sqlite3 *db;
+	char name[16];
+	long i;
+
+	if (sqlite3_open(path, &db) != SQLITE_OK ||
+	    sqlite3_exec(db, "PRAGMA journal_mode=WAL;" DB_SCORES_TABLE
+			 "BEGIN;", NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, DB_INSERT_SCORE, -1, &stmt, NULL) !=
+	    SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	for (i = 0; i < rows; i++) {
+		snprintf(name, sizeof name, "p%d", rand() % NAMES);
+		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 2, rand() % 30 + 1);
+		sqlite3_bind_int(stmt, 3, rand() % 1000000 + 1);
+		sqlite3_bind_int64(stmt, 4, 1400000000 + i);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+	sqlite3_close(db);
+}
+
+/* The query the leaderboard used to run, for the first 10 rows */
+static void old_top(const char *path)
+{
+	sqlite3_stmt *stmt;
+	sqlite3 *db;
+	uint64_t start;
+	int i;
+
+	sqlite3_open(path, &db);
+
+	start = stats_now();
+	sqlite3_prepare_v2(db, "SELECT * FROM Scores ORDER BY score DESC;",
+			   -1, &stmt, NULL);
+	for (i = 0; i < 10 && sqlite3_step(stmt) == SQLITE_ROW; i++)
+		;
+	sqlite3_finalize(stmt);
+
+	printf("old unindexed top 10          %10.1f ms\n",
+	       (double) (stats_now() - start) / NSEC_PER_MSEC);
+
+	sqlite3_close(db);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 2 ? argv[2] : "/tmp/bench_scores.db";
+	long rows = argc > 1 ? atol(argv[1]) : 10000000;
+	struct db_score res[10], last;
+	char wal[256], shm[256];
+	uint64_t start;
+	ssize_t n;
+	int i;
+
+	snprintf(wal, sizeof wal, "%s-wal", path);
+	snprintf(shm, sizeof shm, "%s-shm", path);
+	unlink(path);
+	unlink(wal);
+	unlink(shm);
+
+	start = stats_now();
+	fill(path, rows);
+	printf("%ld rows filled in             %10.1f s\n", rows,
+	       (double) (stats_now() - start) / NSEC_PER_SEC);
+
+	old_top(path);
+
+	/* The first open builds both indexes */
+	psave->file_loc = strdup(path);
+	strlcpy(psave->id, "bench", sizeof psave->id);
+
+	start = stats_now();
+	if (db_start() < 0)
+		return EXIT_FAILURE;
+	printf("db_start(), index build       %10.1f s\n",
+	       (double) (stats_now() - start) / NSEC_PER_SEC);
+
+	start = stats_now();
+	for (i = 0; i < REPEAT; i++)
+		n = db_get_scores(res, 10, NULL);
+	printf("top 10, no @after (cached)    %10.3f us\n",
+	       (double) (stats_now() - start) / REPEAT / NSEC_PER_USEC);
+
+	/* Page by page, PAGES deep */
+	n = db_get_scores(res, 10, NULL);
+	start = stats_now();
+	for (i = 0; i < PAGES && n > 0; i++) {
+		last = res[n - 1];
+		n = db_get_scores(res, 10, &last);
+	}
+	printf("next 10 with @after, %d deep %10.3f us\n", PAGES,
+	       (double) (stats_now() - start) / PAGES / NSEC_PER_USEC);
+
+	/* The same page again and again, the deepest one */
+	start = stats_now();
+	for (i = 0; i < REPEAT; i++)
+		db_get_scores(res, 10, &last);
+	printf("one page with @after          %10.3f us\n",
+	       (double) (stats_now() - start) / REPEAT / NSEC_PER_USEC);
+
+	start = stats_now();
+	for (i = 0; i < REPEAT; i++)
+		db_get_best("p42", res);
+	printf("best score for one name       %10.3f us\n",
+	       (double) (stats_now() - start) / REPEAT / NSEC_PER_USEC);
+
+	db_close();
+	unlink(path);
+	unlink(wal);
+	unlink(shm);
+
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Timer wheel benchmark, with @timers armed at once:
+ *	- timers/sec: simulated time, 1ms at a time. Each timer that goes off
+ *	  is set again 16ms to 1s out, like gravity.
+ *	- moving timers that aren't due yet, like a key press does
+ *	- jitter: real time. The timers are spread over SPREAD_NSEC, the wheel
+ *	  is driven from one timerfd as in blocks-server, and each one's
+ *	  lateness goes in a histogram.
+ *
+ *	tests/bench_wheel [timers]
+ *
+ * 1M timers by default.
+ */
+
+#include <sys/timerfd.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "wheel.h"
+
+#define SIM_NSEC	(5 * NSEC_PER_SEC)	/* simulated time */
+#define SPREAD_NSEC	(10 * NSEC_PER_SEC)	/* real time */
+#define LATE_BUCKETS	20			/* powers of 2, in usec */
+
+struct item {
+	uint64_t deadline;
+	struct wheel_timer timer;
+};
+
+/* xorshift32, the same run every time */
+static uint32_t rnd(void)
+{
+	static uint32_t x = 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+/* A frame to a second out */
+static uint64_t later(uint64_t now)
+{
+	return now + 16 * NSEC_PER_MSEC + rnd() % (984 * NSEC_PER_MSEC);
+}
+
+static void simulated(struct wheel *w, struct item *items, size_t n)
+{
+	struct wheel_timer *t;
+	uint64_t now, start, end, fired = 0;
+	size_t i;
+
+	wheel_init(w, 0);
+	for (i = 0; i < n; i++)
+		wheel_add(w, &items[i].timer, later(0));
+
+	start = stats_now();
+
+	for (now = WHEEL_TICK; now <= SIM_NSEC; now += WHEEL_TICK) {
+		wheel_next(w);
+		while ((t = wheel_expire(w, now))) {
+			wheel_add(w, t, later(now));
+			fired++;
+		}
+	}
+
+	end = stats_now();
+
+	printf("%zu armed: %llu fired and set again, %.1f ns each, "
+	       "%.2fM timers/s\n", n, (unsigned long long) fired,
+	       (double) (end - start) / fired, fired * 1E3 / (end - start));
+
+	/* Moved before they're due */
+	start = stats_now();
+	for (i = 0; i < 4 * n; i++) {
+		t = &items[rnd() % n].timer;
+		wheel_del(w, t);
+		wheel_add(w, t, later(now));
+	}
+	end = stats_now();
+
+	printf("%zu armed: moved one in %.1f ns, %.2fM/s\n", n,
+	       (double) (end - start) / (4 * n), 4 * n * 1E3 / (end - start));
+}
+
+static int real_time(struct wheel *w, struct item *items, size_t n)
+{
+	struct itimerspec its = { .it_interval = { 0, 0 } };
+	struct wheel_timer *t;
+	struct item *it;
+	uint64_t late[LATE_BUCKETS] = { 0 };
+	uint64_t base, at, now, us, worst = 0, fired = 0, sum = 0, x;
+	size_t i, b;
+	int fd;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	memset(items, 0, n * sizeof *items);
+	base = stats_now();
+	wheel_init(w, base);
+
+	for (i = 0; i < n; i++) {
+		items[i].deadline = base + 100 * NSEC_PER_MSEC +
+			rnd() % (SPREAD_NSEC / NSEC_PER_USEC) * NSEC_PER_USEC;
+		wheel_add(w, &items[i].timer, items[i].deadline);
+	}
+
+	while ((at = wheel_next(w)) != UINT64_MAX) {
+		/* 0 would disarm it */
+		its.it_value.tv_sec = at / NSEC_PER_SEC;
+		its.it_value.tv_nsec = at ? at % NSEC_PER_SEC : 1;
+		timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+		if (read(fd, &x, sizeof x) < 0) {
+			perror("timerfd");
+			close(fd);
+			return -1;
+		}
+
+		now = stats_now();
+		while ((t = wheel_expire(w, now))) {
+			it = (struct item *) ((char *) t -
+					      offsetof(struct item, timer));
+			if (now - it->deadline > worst)
+				worst = now - it->deadline;
+
+			us = (now - it->deadline) / NSEC_PER_USEC;
+			for (b = 0; b < LATE_BUCKETS - 1 && (1ULL << b) <= us;
+			     b++)
+				;
+			late[b]++;
+			fired++;
+		}
+	}
+
+	close(fd);
+
+	printf("real time: %llu fired over %.0fs, worst %.2f ms late\n",
+	       (unsigned long long) fired, (double) SPREAD_NSEC / NSEC_PER_SEC,
+	       (double) worst / NSEC_PER_MSEC);
+	for (b = 0; b < LATE_BUCKETS && sum < fired; b++) {
+		if (!(sum += late[b]))
+			continue;
+		printf("  within %7llu us: %5.1f%%\n", 1ULL << b,
+		       100.0 * sum / fired);
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	struct item *items = calloc(n ? n : 1, sizeof *items);
+	struct wheel *w = malloc(sizeof *w);
+
+	if (!n || !items || !w) {
+		fprintf(stderr, "Can't have %zu timers\n", n);
+		return EXIT_FAILURE;
+	}
+
+	simulated(w, items, n);
+
+	if (real_time(w, items, n) < 0)
+		return EXIT_FAILURE;
+
+	free(items);
+	free(w);
+
+	return 0;
+}
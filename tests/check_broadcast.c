@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Spectators against the channel they watch. Random keys play games on a
+ * virtual clock, published into a channel the way blocks-server does it,
+ * and a spectator joins partway into each. Its frames go out through a
+ * socketpair with a small buffer, fed and read back at random:
+ *	- the feed goes unpulled for long enough to lose the backlog
+ *	- the spectator stops reading until its send queue fills
+ *	- sends go partway and reads are of any size, so frames come in
+ *	  pieces, and resyncs find the head frame half sent
+ * After every frame it decodes, the spectator must have the game as the
+ * channel had it: a delta is one frame on from the last, a WIRE_RESET
+ * keyframe catches up to some later one. Once everything's through, it
+ * must equal the channel's state.
+ *
+ *	tests/check_broadcast [games]
+ *
+ * 500 games by default. Exits 1 on the first few failures.
+ */
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "broadcast.h"
+#include "clock.h"
+#include "wire.h"
+
+#define FRAMES		4000	/* most a game publishes */
+#define FRAME_NSEC	(NSEC_PER_SEC / 60)
+#define HISTORY		1024	/* frames the spectator may lag */
+#define IN_FLIGHT	4096	/* frames the socket may hold */
+#define SNDBUF		1024
+#define MAX_FAILS	5
+
+static struct clock_virtual virt;
+static unsigned fails;
+
+/* The game's side: what it published, frame n is history[n % HISTORY] */
+static struct {
+	struct bcast_channel *ch;
+	struct wire_state history[HISTORY];
+} game;
+
+/* The server's side of one spectator, see feed_pull(). Which frame each
+ * one queued is as of goes alongside, and on into the socket.
+ */
+static struct {
+	uint64_t seq;
+	struct bcast_frame *key;
+	bool over;
+	struct bcast_queue q;
+	uint64_t q_seq[BCAST_QUEUE_LEN];
+	int fd;
+} feed;
+
+/* The spectator's side, and the frames on their way to it */
+static struct {
+	int fd;
+	uint8_t buf[WIRE_FRAME_MAX * 2];
+	size_t len;
+	struct wire_state st;
+	uint64_t seq;			/* the frame it's at */
+
+	uint64_t sent[IN_FLIGHT];
+	size_t head, n;
+} spec;
+
+static unsigned long frames, keys, skips, full, half_sent;
+
+/* xorshift32, the same run every time */
+static uint32_t rnd(void)
+{
+	static uint32_t x = 1492;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+/* A socket takes a sendmsg() this small whole or not at all, so this one
+ * stands in for bcast_queue_send()'s, and now and then sends only part
+ */
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	uint8_t buf[BCAST_QUEUE_LEN * WIRE_FRAME_MAX];
+	size_t i, len = 0;
+
+	for (i = 0; i < (size_t) msg->msg_iovlen; i++) {
+		memcpy(buf + len, msg->msg_iov[i].iov_base,
+		       msg->msg_iov[i].iov_len);
+		len += msg->msg_iov[i].iov_len;
+	}
+
+	if (len > 1 && rnd() % 4 == 0)
+		len = 1 + rnd() % (len - 1);
+
+	return send(fd, buf, len, flags);
+}
+
+static void fail(const char *what)
+{
+	if (fails++ < MAX_FAILS)
+		printf("frame %lu, at %llu of %llu: %s\n", frames,
+		       (unsigned long long) spec.seq,
+		       (unsigned long long) game.ch->seq, what);
+}
+
+/* The game as blocks-server sends it, see session_snapshot() */
+static void snapshot(struct wire_state *st)
+{
+	struct blocks *np = CURRENT_BLOCK();
+	size_t i, x, y;
+
+	memset(st, 0, sizeof *st);
+	st->level = pgame->level;
+	st->score = pgame->score;
+	st->over = pgame->lose;
+
+	memcpy(st->spaces, pgame->spaces, sizeof st->spaces);
+
+	st->type = np->type;
+	for (i = 0; i < LEN(np->p); i++) {
+		y = np->row_off + np->p[i].y;
+		x = np->col_off + np->p[i].x;
+		st->cells[i] = WIRE_CELL(y, x);
+		st->spaces[y] &= ~(1U << x);
+	}
+
+	for (y = 0; y < BLOCKS_MAX_ROWS; y++)
+		for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+			if (st->spaces[y] & (1U << x))
+				st->colors[y] |= blocks_color_at(y, x)
+					<< (x * COLOR_BITS);
+
+	st->queue[0] = HOLD_BLOCK()->type;
+	for (i = 1; i < LEN(st->queue); i++)
+		st->queue[i] = pgame->next[i - 1];
+}
+
+static void publish(void)
+{
+	struct wire_state now;
+
+	snapshot(&now);
+	bcast_publish(game.ch, &now);
+	game.history[game.ch->seq % HISTORY] = game.ch->state;
+}
+
+/* Put @seq down for the frame last queued */
+static void queued(uint64_t seq)
+{
+	feed.q_seq[(feed.q.head + feed.q.len - 1) % BCAST_QUEUE_LEN] = seq;
+}
+
+/* Everything published since the last pull, as feed_pull() does it */
+static void pull(void)
+{
+	struct bcast_catchup c;
+	uint64_t from = feed.seq;
+	size_t i;
+
+	bcast_catchup(game.ch, &feed.seq, &c);
+	feed.over = c.over;
+
+	if (c.key) {
+		bcast_frame_unref(feed.key);
+		feed.key = c.key;
+	}
+
+	for (i = 0; i < c.n; i++) {
+		if (bcast_queue_push(&feed.q, c.deltas[i]) < 0)
+			break;
+		queued(from + i + 1);
+	}
+
+	if (c.skipped || i < c.n) {
+		skips += c.skipped;
+		full += !c.skipped;
+		half_sent += feed.q.off != 0;
+		bcast_queue_resync(&feed.q, feed.key);
+		queued(feed.seq);
+	}
+
+	bcast_catchup_done(&c);
+}
+
+/* Frames sent whole are in the socket, in order */
+static int send_some(void)
+{
+	size_t sent = 0, head = feed.q.head, len = feed.q.len;
+	int ret;
+
+	if ((ret = bcast_queue_send(&feed.q, feed.fd, &sent)) < 0)
+		fail("sendmsg() failed");
+
+	for (; len > feed.q.len; len--, head++) {
+		if (spec.n == IN_FLIGHT) {
+			fail("too many frames in the socket");
+			continue;
+		}
+		spec.sent[(spec.head + spec.n++) % IN_FLIGHT] =
+			feed.q_seq[head % BCAST_QUEUE_LEN];
+	}
+
+	return ret;
+}
+
+/* The frame just decoded takes the spectator to the one it's as of */
+static void check_frame(bool key)
+{
+	uint64_t seq;
+
+	if (!spec.n) {
+		fail("more frames came than went");
+		return;
+	}
+	seq = spec.sent[spec.head++ % IN_FLIGHT];
+	spec.n--;
+
+	if (key ? seq < spec.seq : seq != spec.seq + 1)
+		fail(key ? "keyframe went back" : "delta skipped a frame");
+	else if (seq > game.ch->seq || seq + HISTORY <= game.ch->seq)
+		fail("frame out of the history");
+	else if (memcmp(&spec.st, &game.history[seq % HISTORY],
+			sizeof spec.st))
+		fail(key ? "spectator differs after a keyframe" :
+		     "spectator differs after a delta");
+
+	spec.seq = seq;
+}
+
+/* Up to @max bytes off the socket, and every frame that completes.
+ * Returns the bytes read.
+ */
+static size_t receive(size_t max)
+{
+	ssize_t n;
+	size_t off, got;
+	bool key;
+
+	if (max > sizeof spec.buf - spec.len)
+		max = sizeof spec.buf - spec.len;
+
+	n = recv(spec.fd, spec.buf + spec.len, max, MSG_DONTWAIT);
+	if (n < 0 && errno != EAGAIN)
+		fail("recv() failed");
+	if (n <= 0)
+		return 0;
+	spec.len += n;
+	got = n;
+
+	for (off = 0; off < spec.len; off += n) {
+		key = spec.buf[off + (spec.buf[off] & 0x80 ? 2 : 1)] ==
+			WIRE_RESET;
+		if ((n = wire_decode(spec.buf + off, spec.len - off,
+				     &spec.st)) <= 0)
+			break;
+
+		frames++;
+		keys += key;
+		check_frame(key);
+	}
+
+	if (n < 0) {
+		fail("frame didn't decode");
+		spec.len = 0;
+		return got;
+	}
+
+	memmove(spec.buf, spec.buf + off, spec.len - off);
+	spec.len -= off;
+
+	return got;
+}
+
+/* Everything through to the spectator, which must be up to date */
+static void drain(void)
+{
+	bool sent;
+	int i;
+
+	pull();
+	for (i = 0; i < 100000; i++) {
+		sent = send_some() != 0;
+		if (!receive(sizeof spec.buf) && sent)
+			break;
+	}
+
+	if (spec.len || spec.n || feed.q.len)
+		fail("spectator never caught up");
+	else if (memcmp(&spec.st, &game.ch->state, sizeof spec.st))
+		fail("spectator differs from the channel");
+}
+
+/* Joins as viewer_open() does: up to date, then the latest keyframe */
+static void join(void)
+{
+	memset(&spec.st, 0xa5, sizeof spec.st);
+	spec.len = 0;
+	spec.seq = 0;
+	spec.n = 0;
+
+	pull();
+	bcast_queue_clear(&feed.q);
+	if (feed.key) {
+		bcast_queue_push(&feed.q, feed.key);
+		queued(feed.seq);
+	} else {
+		memset(&spec.st, 0, sizeof spec.st);
+	}
+}
+
+static void play_game(int fd)
+{
+	static const char moves[] = "aaadddeeqqsss  w";
+	int ch, i, join_at = rnd() % 200, pull_every = 1, read_every = 1;
+	size_t read_max = 1;
+
+	memset(&feed, 0, sizeof feed);
+	feed.fd = fd;
+	game.ch = bcast_channel_new();
+	game.history[0] = game.ch->state;
+
+	blocks_init();
+	blocks_seed(rnd());
+	blocks_start();
+
+	for (i = 0; i < FRAMES && !pgame->lose; i++) {
+		ch = moves[rnd() % (sizeof moves - 1)];
+		blocks_keys(&ch, 1, false);
+		virt.now += FRAME_NSEC;
+		blocks_step(virt.now);
+		publish();
+
+		if (i == join_at)
+			join();
+
+		/* Now and then a new pace, sometimes a stall */
+		if (rnd() % 64 == 0) {
+			pull_every = rnd() % 4 ? 1 + rnd() % 4 :
+				BCAST_BACKLOG + rnd() % BCAST_BACKLOG;
+			read_every = rnd() % 4 ? 1 + rnd() % 2 : 50 + rnd() % 200;
+			read_max = 1 + rnd() % 64;
+		}
+
+		if (i < join_at)
+			continue;
+		if (rnd() % pull_every == 0) {
+			pull();
+			send_some();
+		}
+		if (rnd() % read_every == 0)
+			receive(1 + rnd() % read_max);
+	}
+
+	if (i <= join_at)
+		join();
+
+	bcast_close(game.ch);
+	drain();
+	if (!feed.over)
+		fail("channel closed, but not over");
+
+	bcast_queue_clear(&feed.q);
+	bcast_frame_unref(feed.key);
+	bcast_channel_unref(game.ch);
+	blocks_cleanup();
+}
+
+int main(int argc, char **argv)
+{
+	struct blocks_host host;
+	long games = argc > 1 ? atol(argv[1]) : 500, i;
+	int fds[2], size = SNDBUF;
+
+	blocks_host_init(&host);
+	host.draw = NULL;
+	clock_virtual_init(&virt, 0);
+	host.clock = &virt.clock;
+	phost = &host;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+	spec.fd = fds[1];
+
+	for (i = 0; i < games; i++)
+		play_game(fds[0]);
+
+	printf("check_broadcast: %ld games, %lu frames, %lu keyframes, "
+	       "%lu resyncs (%lu skipped, %lu full, %lu half sent), "
+	       "%u failures\n", games, frames, keys, skips + full, skips, full,
+	       half_sent, fails);
+
+	/* Each kind of resync has to have happened to count */
+	if (!skips || !full || !half_sent) {
+		printf("check_broadcast: a kind of resync never happened\n");
+		fails++;
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	blocks_host_destroy(&host);
+
+	return fails ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Rotation against a reference: SRS the way the guideline tables it, every
+ * piece in its box in all four states and the kicks for each turn, y up.
+ * Random pieces, in random places on boards from empty to full, turned
+ * either way. A quarter of the turns are classic, about the pivot with a
+ * column left or right to kick to. For each:
+ *	- rotate_block() turns if and only if the reference finds a kick
+ *	- it took the same kick, and the piece is on the same cells
+ *	- a turn that doesn't fit leaves the piece where it was
+ *
+ *	tests/check_srs [turns]
+ *
+ * 3M turns by default. Exits 1 on the first few failures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* rotate_block() is static, the game is built in here */
+#include "../src/blocks.c"
+
+#define KICKS		5
+#define MAX_FAILS	5
+
+struct cell {
+	int x, y;
+};
+
+/* Each piece in its box, y down, as dealt then clockwise */
+static const struct cell boxes[NUM_BLOCKS][4][4] = {
+	[O_BLOCK] = {
+		{ { 1, 0 }, { 2, 0 }, { 1, 1 }, { 2, 1 } },
+		{ { 1, 0 }, { 2, 0 }, { 1, 1 }, { 2, 1 } },
+		{ { 1, 0 }, { 2, 0 }, { 1, 1 }, { 2, 1 } },
+		{ { 1, 0 }, { 2, 0 }, { 1, 1 }, { 2, 1 } },
+	},
+	[I_BLOCK] = {
+		{ { 0, 1 }, { 1, 1 }, { 2, 1 }, { 3, 1 } },
+		{ { 2, 0 }, { 2, 1 }, { 2, 2 }, { 2, 3 } },
+		{ { 0, 2 }, { 1, 2 }, { 2, 2 }, { 3, 2 } },
+		{ { 1, 0 }, { 1, 1 }, { 1, 2 }, { 1, 3 } },
+	},
+	[T_BLOCK] = {
+		{ { 1, 0 }, { 0, 1 }, { 1, 1 }, { 2, 1 } },
+		{ { 1, 0 }, { 1, 1 }, { 2, 1 }, { 1, 2 } },
+		{ { 0, 1 }, { 1, 1 }, { 2, 1 }, { 1, 2 } },
+		{ { 1, 0 }, { 0, 1 }, { 1, 1 }, { 1, 2 } },
+	},
+	[L_BLOCK] = {
+		{ { 2, 0 }, { 0, 1 }, { 1, 1 }, { 2, 1 } },
+		{ { 1, 0 }, { 1, 1 }, { 1, 2 }, { 2, 2 } },
+		{ { 0, 1 }, { 1, 1 }, { 2, 1 }, { 0, 2 } },
+		{ { 0, 0 }, { 1, 0 }, { 1, 1 }, { 1, 2 } },
+	},
+	[J_BLOCK] = {
+		{ { 0, 0 }, { 0, 1 }, { 1, 1 }, { 2, 1 } },
+		{ { 1, 0 }, { 2, 0 }, { 1, 1 }, { 1, 2 } },
+		{ { 0, 1 }, { 1, 1 }, { 2, 1 }, { 2, 2 } },
+		{ { 1, 0 }, { 1, 1 }, { 0, 2 }, { 1, 2 } },
+	},
+	[Z_BLOCK] = {
+		{ { 0, 0 }, { 1, 0 }, { 1, 1 }, { 2, 1 } },
+		{ { 2, 0 }, { 1, 1 }, { 2, 1 }, { 1, 2 } },
+		{ { 0, 1 }, { 1, 1 }, { 1, 2 }, { 2, 2 } },
+		{ { 1, 0 }, { 0, 1 }, { 1, 1 }, { 0, 2 } },
+	},
+	[S_BLOCK] = {
+		{ { 1, 0 }, { 2, 0 }, { 0, 1 }, { 1, 1 } },
+		{ { 1, 0 }, { 1, 1 }, { 2, 1 }, { 2, 2 } },
+		{ { 1, 1 }, { 2, 1 }, { 0, 2 }, { 1, 2 } },
+		{ { 0, 0 }, { 0, 1 }, { 1, 1 }, { 1, 2 } },
+	},
+};
+
+/* Kicks turning out of each state, clockwise then counter clockwise, y up */
+static const struct cell jlstz_kicks[4][2][KICKS] = {
+	{ { { 0, 0 }, { -1, 0 }, { -1,  1 }, { 0, -2 }, { -1, -2 } },
+	  { { 0, 0 }, {  1, 0 }, {  1,  1 }, { 0, -2 }, {  1, -2 } } },
+	{ { { 0, 0 }, {  1, 0 }, {  1, -1 }, { 0,  2 }, {  1,  2 } },
+	  { { 0, 0 }, {  1, 0 }, {  1, -1 }, { 0,  2 }, {  1,  2 } } },
+	{ { { 0, 0 }, {  1, 0 }, {  1,  1 }, { 0, -2 }, {  1, -2 } },
+	  { { 0, 0 }, { -1, 0 }, { -1,  1 }, { 0, -2 }, { -1, -2 } } },
+	{ { { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0,  2 }, { -1,  2 } },
+	  { { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0,  2 }, { -1,  2 } } },
+};
+
+static const struct cell i_kicks[4][2][KICKS] = {
+	{ { { 0, 0 }, { -2, 0 }, {  1, 0 }, { -2, -1 }, {  1,  2 } },
+	  { { 0, 0 }, { -1, 0 }, {  2, 0 }, { -1,  2 }, {  2, -1 } } },
+	{ { { 0, 0 }, { -1, 0 }, {  2, 0 }, { -1,  2 }, {  2, -1 } },
+	  { { 0, 0 }, {  2, 0 }, { -1, 0 }, {  2,  1 }, { -1, -2 } } },
+	{ { { 0, 0 }, {  2, 0 }, { -1, 0 }, {  2,  1 }, { -1, -2 } },
+	  { { 0, 0 }, {  1, 0 }, { -2, 0 }, {  1, -2 }, { -2,  1 } } },
+	{ { { 0, 0 }, {  1, 0 }, { -2, 0 }, {  1, -2 }, { -2,  1 } },
+	  { { 0, 0 }, { -2, 0 }, {  1, 0 }, { -2, -1 }, {  1,  2 } } },
+};
+
+/* Classic turns in place, or a column left, or right */
+static const int classic_shifts[] = { 0, -1, 1 };
+
+static unsigned fails;
+
+/* xorshift32, the same run every time */
+static uint32_t rnd(void)
+{
+	static uint32_t x = 12345;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+static void fail(const struct blocks *b, int from, const char *what)
+{
+	if (fails++ < MAX_FAILS)
+		printf("%s: type %d state %d at %d,%d: %s\n",
+		       pgame->rotation == ROTATION_CLASSIC ? "classic" : "srs",
+		       b->type, from, b->col_off, b->row_off, what);
+}
+
+/* Off the board counts as taken */
+static bool taken(int x, int y)
+{
+	return x < 0 || x >= BLOCKS_MAX_COLUMNS || y < 0 ||
+	       y >= BLOCKS_MAX_ROWS || blocks_at_yx(y, x);
+}
+
+static bool fits(const struct cell *c)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (taken(c[i].x, c[i].y))
+			return false;
+
+	return true;
+}
+
+static void cells_of(const struct blocks *b, struct cell *c)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		c[i].x = b->col_off + b->p[i].x;
+		c[i].y = b->row_off + b->p[i].y;
+	}
+}
+
+/* Same four cells, in any order */
+static bool same(const struct cell *a, const struct cell *b)
+{
+	int i, j;
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 4; j++)
+			if (a[i].x == b[j].x && a[i].y == b[j].y)
+				break;
+		if (j == 4)
+			return false;
+	}
+
+	return true;
+}
+
+/* @box of @type in @state, its top left at (@x, @y) */
+static void place(struct cell *c, int type, int state, int x, int y)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		c[i].x = boxes[type][state][i].x + x;
+		c[i].y = boxes[type][state][i].y + y;
+	}
+}
+
+/* Where SRS puts @b turned @dir (1 clockwise, -1 counter), and with which
+ * kick, -1 if none fit. The box is found from where the piece is.
+ */
+static int srs(const struct blocks *b, int dir, struct cell *out)
+{
+	const struct cell *kicks;
+	struct cell c[4], want[4];
+	int bx = 99, by = 99, sx = 99, sy = 99, to = (b->rot + dir) & 3, i, k;
+
+	cells_of(b, c);
+	for (i = 0; i < 4; i++) {
+		bx = c[i].x < bx ? c[i].x : bx;
+		by = c[i].y < by ? c[i].y : by;
+		sx = boxes[b->type][b->rot][i].x < sx ?
+			boxes[b->type][b->rot][i].x : sx;
+		sy = boxes[b->type][b->rot][i].y < sy ?
+			boxes[b->type][b->rot][i].y : sy;
+	}
+	bx -= sx;
+	by -= sy;
+
+	place(want, b->type, b->rot, bx, by);
+	if (!same(c, want)) {
+		fail(b, b->rot, "not the shape SRS has");
+		return -2;
+	}
+
+	if (b->type == O_BLOCK) {
+		memcpy(out, c, sizeof c);
+		return 0;
+	}
+
+	kicks = (b->type == I_BLOCK ? i_kicks : jlstz_kicks)[b->rot][dir < 0];
+	for (k = 0; k < KICKS; k++) {
+		place(out, b->type, to, bx + kicks[k].x, by - kicks[k].y);
+		if (fits(out))
+			return k;
+	}
+
+	return -1;
+}
+
+/* Classic: each cell turned about the pivot, then shifted */
+static int classic(const struct blocks *b, int dir, struct cell *out)
+{
+	size_t k;
+	int i;
+
+	if (b->type == O_BLOCK) {
+		cells_of(b, out);
+		return 0;
+	}
+
+	for (k = 0; k < LEN(classic_shifts); k++) {
+		for (i = 0; i < 4; i++) {
+			out[i].x = b->col_off + classic_shifts[k] -
+				   dir * b->p[i].y;
+			out[i].y = b->row_off + dir * b->p[i].x;
+		}
+		if (fits(out))
+			return k;
+	}
+
+	return -1;
+}
+
+/* A @type piece turned to @state, somewhere it fits, on a random board */
+static void setup(struct blocks *b, int type, int state)
+{
+	struct cell c[4];
+	int density, x, y, i;
+
+	memset(pgame->spaces, 0, sizeof pgame->spaces);
+	blocks_piece(b, type);
+	for (i = 0; i < state; i++) {
+		b->col_off = BLOCKS_MAX_COLUMNS / 2;
+		b->row_off = BLOCKS_MAX_ROWS / 2;
+		rotate_block(b, ROT_RIGHT);
+	}
+
+	do {
+		b->col_off = rnd() % BLOCKS_MAX_COLUMNS;
+		b->row_off = rnd() % BLOCKS_MAX_ROWS;
+		cells_of(b, c);
+	} while (!fits(c));
+
+	density = rnd() % 100;
+	for (y = 0; y < BLOCKS_MAX_ROWS; y++)
+		for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+			if ((int) (rnd() % 100) < density)
+				pgame->spaces[y] |= 1 << x;
+
+	for (i = 0; i < 4; i++)
+		pgame->spaces[c[i].y] &= ~(1 << c[i].x);
+}
+
+static void turn(struct blocks *b)
+{
+	struct blocks was;
+	struct cell want[4], got[4];
+	int dir = rnd() % 2 ? 1 : -1, kick, ret;
+
+	kick = pgame->rotation == ROTATION_CLASSIC ?
+		classic(b, dir, want) : srs(b, dir, want);
+	if (kick < -1)
+		return;
+
+	was = *b;
+	ret = rotate_block(b, dir > 0 ? ROT_RIGHT : ROT_LEFT);
+	cells_of(b, got);
+
+	if ((ret == 1) != (kick >= 0)) {
+		fail(&was, was.rot, ret == 1 ? "turned, but nothing fits" :
+		     "didn't turn, but it fits");
+	} else if (kick < 0) {
+		if (memcmp(&was, b, sizeof was))
+			fail(&was, was.rot, "moved without turning");
+	} else if (b->type == O_BLOCK) {
+		if (!same(got, want))
+			fail(&was, was.rot, "O block moved");
+	} else if (b->rot != ((was.rot + dir) & 3)) {
+		fail(&was, was.rot, "wrong state");
+	} else if (b->kick != kick + 1) {
+		fail(&was, was.rot, "wrong kick");
+	} else if (!same(got, want)) {
+		fail(&was, was.rot, "wrong cells");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct blocks_host host;
+	long turns = argc > 1 ? atol(argv[1]) : 3000000, i;
+
+	blocks_host_init(&host);
+	host.draw = NULL;
+	phost = &host;
+	blocks_init();
+
+	for (i = 0; i < turns; i++) {
+		blocks_rotation(rnd() % 4 ? ROTATION_SRS : ROTATION_CLASSIC);
+		setup(CURRENT_BLOCK(), rnd() % NUM_BLOCKS, rnd() % 4);
+		turn(CURRENT_BLOCK());
+	}
+
+	printf("check_srs: %ld turns, %u failures\n", turns, fails);
+
+	blocks_cleanup();
+	blocks_host_destroy(&host);
+
+	return fails ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * T-spins against a reference that looks at the board a cell at a time:
+ * a T block in every state, anywhere it fits on a random board, after a
+ * random last move, and now and then some other piece. find_t_spin() must
+ * agree it's
+ *	- nothing, unless a T turned into place with three corners filled
+ *	- a T-spin if both corners either side of its point are filled, or
+ *	  it took the last kick
+ *	- a mini otherwise
+ * The walls and floor count as filled, above the board doesn't.
+ *
+ *	tests/check_tspin [positions]
+ *
+ * 2M positions by default. Exits 1 on the first few failures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* find_t_spin() is static, the game is built in here */
+#include "../src/blocks.c"
+
+#define KICKS		5
+#define MAX_FAILS	5
+
+static unsigned fails;
+
+/* xorshift32, the same run every time */
+static uint32_t rnd(void)
+{
+	static uint32_t x = 4242;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+static bool filled(int x, int y)
+{
+	if (x < 0 || x >= BLOCKS_MAX_COLUMNS || y >= BLOCKS_MAX_ROWS)
+		return true;
+
+	return y >= 0 && blocks_at_yx(y, x);
+}
+
+/* The point is the one cell next to the pivot without one opposite it */
+static void point_of(const struct blocks *b, int *px, int *py)
+{
+	size_t i, j;
+
+	for (i = 0; i < LEN(b->p); i++) {
+		if (!b->p[i].x && !b->p[i].y)
+			continue;
+
+		for (j = 0; j < LEN(b->p); j++)
+			if (b->p[j].x == -b->p[i].x && b->p[j].y == -b->p[i].y)
+				break;
+
+		if (j == LEN(b->p)) {
+			*px = b->p[i].x;
+			*py = b->p[i].y;
+		}
+	}
+}
+
+static int reference(const struct blocks *b)
+{
+	int x = b->col_off, y = b->row_off, px = 0, py = 0, corners;
+	bool front;
+
+	if (b->type != T_BLOCK || !b->kick)
+		return T_SPIN_NONE;
+
+	corners = filled(x - 1, y - 1) + filled(x + 1, y - 1) +
+		  filled(x + 1, y + 1) + filled(x - 1, y + 1);
+	if (corners < 3)
+		return T_SPIN_NONE;
+
+	point_of(b, &px, &py);
+	if (py)
+		front = filled(x - 1, y + py) && filled(x + 1, y + py);
+	else
+		front = filled(x + px, y - 1) && filled(x + px, y + 1);
+
+	return front || b->kick == KICKS ? T_SPIN : T_SPIN_MINI;
+}
+
+static bool on_board(const struct blocks *b)
+{
+	size_t i;
+	int x, y;
+
+	for (i = 0; i < LEN(b->p); i++) {
+		x = b->col_off + b->p[i].x;
+		y = b->row_off + b->p[i].y;
+		if (x < 0 || x >= BLOCKS_MAX_COLUMNS || y < 0 ||
+		    y >= BLOCKS_MAX_ROWS)
+			return false;
+	}
+
+	return true;
+}
+
+/* A T (mostly) turned to a random state, somewhere it fits on a random
+ * board, with a random last move: 0 for a shift or a drop, else the kick
+ */
+static void setup(struct blocks *b)
+{
+	int state = rnd() % 4, density, x, y, i;
+
+	memset(pgame->spaces, 0, sizeof pgame->spaces);
+	blocks_piece(b, rnd() % 8 ? T_BLOCK : rnd() % NUM_BLOCKS);
+	for (i = 0; i < state; i++) {
+		b->col_off = BLOCKS_MAX_COLUMNS / 2;
+		b->row_off = BLOCKS_MAX_ROWS / 2;
+		rotate_block(b, ROT_RIGHT);
+	}
+
+	do {
+		b->col_off = rnd() % BLOCKS_MAX_COLUMNS;
+		b->row_off = rnd() % BLOCKS_MAX_ROWS;
+	} while (!on_board(b));
+
+	b->kick = rnd() % (KICKS + 1);
+
+	density = rnd() % 100;
+	for (y = 0; y < BLOCKS_MAX_ROWS; y++)
+		for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+			if ((int) (rnd() % 100) < density)
+				pgame->spaces[y] |= 1 << x;
+
+	for (i = 0; i < 4; i++)
+		pgame->spaces[b->row_off + b->p[i].y] &=
+			~(1 << (b->col_off + b->p[i].x));
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[] = { "none", "mini", "T-spin" };
+	struct blocks_host host;
+	struct blocks *b;
+	long positions = argc > 1 ? atol(argv[1]) : 2000000, i;
+	long kinds[3] = { 0 };
+	int want, got;
+
+	blocks_host_init(&host);
+	host.draw = NULL;
+	phost = &host;
+	blocks_init();
+	b = CURRENT_BLOCK();
+
+	for (i = 0; i < positions; i++) {
+		setup(b);
+
+		want = reference(b);
+		got = find_t_spin(b);
+		kinds[want]++;
+
+		if (got != want && fails++ < MAX_FAILS)
+			printf("type %d state %d at %d,%d kick %d: "
+			       "%s, want %s\n", b->type, b->rot, b->col_off,
+			       b->row_off, b->kick, got < 3 ? names[got] : "?",
+			       names[want]);
+	}
+
+	printf("check_tspin: %ld positions (%ld none, %ld mini, %ld T-spin), "
+	       "%u failures\n", positions, kinds[0], kinds[1], kinds[2], fails);
+
+	blocks_cleanup();
+	blocks_host_destroy(&host);
+
+	return fails ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Timer wheel against a reference model: a flat array of what should be
+ * armed. Random adds, deletes and jumps of time, from under a tick to
+ * months, and after each jump:
+ *	- wheel_next() is never later than the earliest armed timer
+ *	- wheel_expire() only hands out armed timers that are due
+ *	- nothing due is left on the wheel, and the armed count agrees
+ *
+ *	tests/check_wheel [operations]
+ *
+ * 2M operations by default. Exits 1 on the first few failures.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wheel.h"
+
+#define TIMERS		5000
+#define MAX_FAILS	5
+
+static struct wheel_timer timers[TIMERS];
+static bool armed[TIMERS];
+static unsigned fails;
+
+/* xorshift64, the same run every time */
+static uint64_t rnd(void)
+{
+	static uint64_t x = 88172645463325252ULL;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return x;
+}
+
+static void fail(const char *what, size_t i, uint64_t now)
+{
+	if (fails++ < MAX_FAILS)
+		printf("%s: timer %zu expires %llu, tick %llu\n", what, i,
+		       (unsigned long long) timers[i].expires,
+		       (unsigned long long) (now / WHEEL_TICK));
+}
+
+/* From the past to months out, mostly soon */
+static uint64_t deadline(uint64_t now)
+{
+	switch (rnd() % 6) {
+	case 0:
+		return now - rnd() % (5 * NSEC_PER_MSEC);
+	case 1:
+		return now + rnd() % (100 * NSEC_PER_MSEC);
+	case 2:
+		return now + rnd() % (10 * NSEC_PER_SEC);
+	case 3:
+		return now + rnd() % (1000 * NSEC_PER_SEC);
+	case 4:
+		return now + rnd() % (4000000 * NSEC_PER_SEC);
+	default:
+		return now + rnd() % (64 * NSEC_PER_MSEC);
+	}
+}
+
+/* Mostly a few ticks, sometimes seconds, now and then weeks */
+static uint64_t jump(void)
+{
+	uint64_t r = rnd() % 100;
+
+	if (r < 90)
+		return rnd() % (3 * NSEC_PER_MSEC);
+	if (r < 99)
+		return rnd() % (2 * NSEC_PER_SEC);
+	return rnd() % (2000000 * NSEC_PER_SEC);
+}
+
+static void advance(struct wheel *w, uint64_t now)
+{
+	struct wheel_timer *t;
+	uint64_t next, min = UINT64_MAX;
+	size_t i, n = 0;
+
+	for (i = 0; i < TIMERS; i++)
+		if (armed[i] && timers[i].expires * WHEEL_TICK < min)
+			min = timers[i].expires * WHEEL_TICK;
+
+	next = wheel_next(w);
+	if (next > min && fails++ < MAX_FAILS)
+		printf("wheel_next() %llu, but one's due at %llu\n",
+		       (unsigned long long) next, (unsigned long long) min);
+
+	while ((t = wheel_expire(w, now))) {
+		i = t - timers;
+		if (!armed[i])
+			fail("not armed, but went off", i, now);
+		if (t->expires > now / WHEEL_TICK)
+			fail("went off early", i, now);
+		armed[i] = false;
+	}
+
+	for (i = 0; i < TIMERS; i++) {
+		if (armed[i] && timers[i].expires <= now / WHEEL_TICK)
+			fail("due, but still on the wheel", i, now);
+		n += armed[i];
+	}
+
+	if (n != w->armed && fails++ < MAX_FAILS)
+		printf("%zu armed, the wheel says %zu\n", n, w->armed);
+}
+
+int main(int argc, char **argv)
+{
+	static struct wheel w;
+	uint64_t now = 123456789 * NSEC_PER_USEC;
+	long ops = argc > 1 ? atol(argv[1]) : 2000000, op;
+	size_t i;
+	int what;
+
+	wheel_init(&w, now);
+
+	for (op = 0; op < ops; op++) {
+		i = rnd() % TIMERS;
+		what = rnd() % 10;
+
+		if (what < 5) {
+			wheel_add(&w, &timers[i], deadline(now));
+			armed[i] = true;
+		} else if (what < 6) {
+			wheel_del(&w, &timers[i]);
+			armed[i] = false;
+		} else {
+			now += jump();
+			advance(&w, now);
+		}
+	}
+
+	printf("check_wheel: %ld operations, %u failures\n", ops, fails);
+
+	return fails ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2014  James Smith <james@theta.pw>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Wire codec against the games it carries. Bots play games on a virtual
+ * clock, looking ahead to clear lines and now and then dropping a piece
+ * anywhere, and every change is snapshot the way blocks-server does it:
+ *	- wire_encode() deltas, and every 16th change a wire_encode_key() frame
+ *	  decoded from junk, leave the client equal to the server
+ *	- a frame cut short anywhere decodes to 0 and leaves the client alone
+ *	- a frame with a byte changed decodes to -1, or to a state that's in
+ *	  bounds
+ *	- both frame length encodings, and a lone clear, get exercised
+ * Then lines cleared out of a nearly full board must go as a single
+ * WIRE_CLEAR, hand made malformed frames and keys must decode to -1, and
+ * random keys must come back as they went.
+ *
+ *	tests/check_wire [games]
+ *
+ * 200 games by default. Exits 1 on the first few failures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "clock.h"
+#include "wire.h"
+
+#define PIECES		200	/* most a bot plays per game */
+#define FRAME_NSEC	(NSEC_PER_SEC / 60)
+#define KEY_EVERY	16
+#define CELLS		(BLOCKS_MAX_ROWS * BLOCKS_MAX_COLUMNS)
+#define FULL_ROW	((1U << BLOCKS_MAX_COLUMNS) - 1)
+#define MAX_FAILS	5
+
+static struct clock_virtual virt;
+static unsigned fails;
+
+/* Both sides of one game's connection */
+static struct {
+	struct wire_state sent, client;
+	unsigned long frames, keys, bytes, long_frames;
+} conn;
+
+/* xorshift32, the same run every time */
+static uint32_t rnd(void)
+{
+	static uint32_t x = 2014;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+static void fail(const char *what, size_t len)
+{
+	if (fails++ < MAX_FAILS)
+		printf("frame %lu (%zu bytes): %s\n", conn.frames, len, what);
+}
+
+/* The game as blocks-server sends it, see session_snapshot() */
+static void snapshot(struct wire_state *st)
+{
+	struct blocks *np = CURRENT_BLOCK();
+	size_t i, x, y;
+
+	memset(st, 0, sizeof *st);
+	st->level = pgame->level;
+	st->score = pgame->score;
+	st->over = pgame->lose;
+
+	memcpy(st->spaces, pgame->spaces, sizeof st->spaces);
+
+	st->type = np->type;
+	for (i = 0; i < LEN(np->p); i++) {
+		y = np->row_off + np->p[i].y;
+		x = np->col_off + np->p[i].x;
+		st->cells[i] = WIRE_CELL(y, x);
+		st->spaces[y] &= ~(1U << x);
+	}
+
+	for (y = 0; y < BLOCKS_MAX_ROWS; y++)
+		for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+			if (st->spaces[y] & (1U << x))
+				st->colors[y] |= blocks_color_at(y, x)
+					<< (x * COLOR_BITS);
+
+	st->queue[0] = HOLD_BLOCK()->type;
+	for (i = 1; i < LEN(st->queue); i++)
+		st->queue[i] = pgame->next[i - 1];
+}
+
+/* What a client may end up with, whatever it was sent */
+static bool in_bounds(const struct wire_state *st)
+{
+	size_t i;
+
+	if (st->type >= NUM_BLOCKS)
+		return false;
+
+	for (i = 0; i < LEN(st->cells); i++)
+		if (st->cells[i] >= CELLS)
+			return false;
+
+	for (i = 0; i < LEN(st->queue); i++)
+		if (st->queue[i] >= NUM_BLOCKS)
+			return false;
+
+	for (i = 0; i < BLOCKS_MAX_ROWS; i++)
+		if (st->spaces[i] & ~FULL_ROW)
+			return false;
+
+	return true;
+}
+
+/* Cut short, changed a byte: neither may get the client anywhere bad */
+static void mangle(const uint8_t *buf, size_t len)
+{
+	struct wire_state st;
+	uint8_t bad[WIRE_FRAME_MAX];
+	ssize_t ret;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		st = conn.client;
+		if (wire_decode(buf, i, &st) != 0 ||
+		    memcmp(&st, &conn.client, sizeof st))
+			fail("cut short, but not incomplete", i);
+	}
+
+	memcpy(bad, buf, len);
+	bad[rnd() % len] ^= 1 + rnd() % 255;
+	st = conn.client;
+	ret = wire_decode(bad, len, &st);
+	if (ret < -1 || ret > (ssize_t) len || (ret > 0 && !in_bounds(&st)))
+		fail("changed a byte, decoded out of bounds", len);
+}
+
+/* A new game's connection starts with a keyframe, over the last one's */
+static void join(void)
+{
+	uint8_t buf[WIRE_FRAME_MAX];
+	size_t len;
+
+	snapshot(&conn.sent);
+	len = wire_encode_key(buf, &conn.sent);
+	conn.keys++;
+	conn.long_frames += buf[0] & 0x80 ? 1 : 0;
+
+	if (wire_decode(buf, len, &conn.client) != (ssize_t) len)
+		fail("keyframe didn't decode", len);
+	else if (memcmp(&conn.client, &conn.sent, sizeof conn.sent))
+		fail("client differs after joining", len);
+}
+
+/* One change of the game, sent both ways */
+static void publish(void)
+{
+	struct wire_state now, fresh;
+	uint8_t buf[WIRE_FRAME_MAX];
+	size_t len;
+
+	snapshot(&now);
+
+	len = wire_encode(buf, &conn.sent, &now);
+	if (memcmp(&conn.sent, &now, sizeof now))
+		fail("wire_encode() didn't bring @sent up to date", len);
+
+	if (!len) {
+		if (memcmp(&conn.client, &now, sizeof now))
+			fail("nothing sent, but the game changed", len);
+		return;
+	}
+
+	conn.frames++;
+	conn.bytes += len;
+	conn.long_frames += buf[0] & 0x80 ? 1 : 0;
+
+	if (len > WIRE_FRAME_MAX)
+		fail("frame too long", len);
+
+	mangle(buf, len);
+
+	if (wire_decode(buf, len, &conn.client) != (ssize_t) len)
+		fail("delta didn't decode", len);
+	else if (memcmp(&conn.client, &now, sizeof now))
+		fail("client differs after the delta", len);
+
+	if (conn.frames % KEY_EVERY)
+		return;
+
+	/* A spectator joining now */
+	len = wire_encode_key(buf, &now);
+	memset(&fresh, 0xa5, sizeof fresh);
+	conn.keys++;
+	conn.long_frames += buf[0] & 0x80 ? 1 : 0;
+
+	if (wire_decode(buf, len, &fresh) != (ssize_t) len)
+		fail("keyframe didn't decode", len);
+	else if (memcmp(&fresh, &now, sizeof now))
+		fail("client differs after the keyframe", len);
+}
+
+static void key(int ch)
+{
+	blocks_keys(&ch, 1, false);
+	publish();
+
+	/* Gravity, a frame a key */
+	virt.now += FRAME_NSEC;
+	blocks_step(virt.now);
+	publish();
+}
+
+/* A key for real, or on a copy the bot throws away */
+static void press(int ch, bool really)
+{
+	if (really)
+		key(ch);
+	else
+		blocks_keys(&ch, 1, false);
+}
+
+/* Turn @rot times, all the way left, then @col right, and drop */
+static void play(int rot, int col, bool really)
+{
+	int i;
+
+	for (i = 0; i < rot; i++)
+		press('e', really);
+	for (i = 0; i < BLOCKS_MAX_COLUMNS / 2; i++)
+		press('a', really);
+	for (i = 0; i < col; i++)
+		press('d', really);
+
+	press('w', really);
+}
+
+/* Lines first, then a low, flat board without holes */
+static int rate(uint16_t lines)
+{
+	int x, y, rating = (pgame->lines_destroyed - lines) * 1000;
+	bool roof;
+
+	for (x = 0; x < BLOCKS_MAX_COLUMNS; x++) {
+		for (y = 0, roof = false; y < BLOCKS_MAX_ROWS; y++) {
+			if (blocks_at_yx(y, x)) {
+				rating -= roof ? 0 : BLOCKS_MAX_ROWS - y;
+				roof = true;
+			} else if (roof) {
+				rating -= 20;
+			}
+		}
+	}
+
+	return pgame->lose ? -100000 : rating;
+}
+
+/* Try every turn and column on a copy, play the best, now and then any */
+static void bot_piece(void)
+{
+	struct blocks_snapshot snap;
+	uint64_t at = virt.now;
+	int rot, col, best = 0, best_rot = 0, best_col = 0, r;
+
+	if (rnd() % 16 == 0)
+		key(' ');
+
+	if (rnd() % 5 == 0) {
+		play(rnd() % 4, rnd() % BLOCKS_MAX_COLUMNS, true);
+		return;
+	}
+
+	blocks_snapshot(&snap);
+	for (rot = 0; rot < 4; rot++) {
+		for (col = 0; col < BLOCKS_MAX_COLUMNS; col++) {
+			play(rot, col, false);
+			r = rate(snap.game.lines_destroyed);
+			if ((!rot && !col) || r > best) {
+				best = r;
+				best_rot = rot;
+				best_col = col;
+			}
+			blocks_rewind(&snap);
+			virt.now = at;
+		}
+	}
+
+	play(best_rot, best_col, true);
+}
+
+static void bot_game(void)
+{
+	int pieces;
+
+	blocks_init();
+	blocks_seed(rnd());
+	blocks_start();
+
+	join();
+
+	for (pieces = 0; pieces < PIECES && !pgame->lose; pieces++)
+		bot_piece();
+
+	blocks_cleanup();
+}
+
+/* Rows out of a nearly full board go as one record, no rows follow */
+static void lone_clears(void)
+{
+	struct wire_state sent, now;
+	uint8_t buf[WIRE_FRAME_MAX];
+	uint32_t mask;
+	size_t len;
+	int i, j, x, y;
+
+	for (i = 0; i < 10000; i++) {
+		/* Four rows or less, within four of each other, are full */
+		mask = (rnd() % 15 + 1) << (BLOCKS_MAX_ROWS - 4 - rnd() % 8);
+
+		memset(&sent, 0, sizeof sent);
+		for (y = 4; y < BLOCKS_MAX_ROWS; y++) {
+			sent.spaces[y] = mask & (1U << y) ? FULL_ROW :
+				rnd() & FULL_ROW;
+			for (x = 0; x < BLOCKS_MAX_COLUMNS; x++)
+				if (sent.spaces[y] & (1U << x))
+					sent.colors[y] |= (1 + rnd() % 7)
+						<< (x * COLOR_BITS);
+		}
+
+		/* now is sent with them gone */
+		now = sent;
+		for (y = j = BLOCKS_MAX_ROWS - 1; y >= 0; y--) {
+			if (mask & (1U << y))
+				continue;
+			now.spaces[j] = sent.spaces[y];
+			now.colors[j--] = sent.colors[y];
+		}
+		for (; j >= 0; j--)
+			now.spaces[j] = now.colors[j] = 0;
+
+		len = wire_encode(buf, &sent, &now);
+		if (len > 2 + 4 && fails++ < MAX_FAILS)
+			printf("clearing rows %#x took %zu bytes\n", mask, len);
+	}
+}
+
+/* Frames that must be refused, from a client with a piece at the top */
+static void bad_frames(void)
+{
+	static const struct {
+		const char *what;
+		uint8_t len, frame[16];
+	} bad[] = {
+		{ "no such record", 2, { 1, 0 } },
+		{ "no such record", 2, { 1, WIRE_RESET + 1 } },
+		{ "clear past the board", 6,
+		  { 5, WIRE_CLEAR, 0x80, 0x80, 0x80, 0x02 } },
+		{ "rows past the board", 6,
+		  { 5, WIRE_ROWS, 0x80, 0x80, 0x80, 0x02 } },
+		{ "row wider than the board", 6,
+		  { 5, WIRE_ROWS, 0x01, 0x80, 0x10, 0x00 } },
+		{ "fewer rows than the mask", 4, { 3, WIRE_ROWS, 0x03, 0x01 } },
+		{ "no such block", 7, { 6, WIRE_PIECE, NUM_BLOCKS, 0, 1, 2, 3 } },
+		{ "cell past the board", 7,
+		  { 6, WIRE_PIECE, T_BLOCK, 0, 1, 2, CELLS } },
+		{ "piece cut short", 5, { 4, WIRE_PIECE, T_BLOCK, 0, 1 } },
+		{ "moved off the top", 3, { 2, WIRE_MOVE, 3 } },
+		{ "moved off the bottom", 4, { 3, WIRE_MOVE, 0xb8, 0x03 } },
+		{ "no such block queued", 3, { 2, WIRE_QUEUE, NUM_BLOCKS } },
+		{ "no such block shifted in", 3,
+		  { 2, WIRE_SHIFT, NUM_BLOCKS } },
+		{ "shift cut short", 2, { 1, WIRE_SHIFT } },
+		{ "score cut short", 3, { 2, WIRE_SCORE, 0x80 } },
+		{ "varint too long", 13,
+		  { 12, WIRE_SCORE, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+		    0x80, 0x80, 0x80, 0x80 } },
+		{ "longer than a frame", 2, { 0xff, 0x01 } },
+		{ "length too long", 11,
+		  { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+		    0x80, 0x01 } },
+	};
+	static const uint8_t bad_keys[][8] = {
+		{ 5, 0x80, 0x80, 0x80, 0x80, 0x08 },	/* past INT32_MAX */
+		{ 2, 0x01, 0x80 },			/* cut short */
+	};
+	struct wire_state st;
+	uint8_t buf[WIRE_FRAME_MAX];
+	int keys[WIRE_KEYS_MAX];
+	size_t i, n;
+
+	for (i = 0; i < LEN(bad); i++) {
+		memset(&st, 0, sizeof st);
+		st.type = T_BLOCK;
+		memcpy(st.cells, (uint8_t []) { 1, 10, 11, 12 }, 4);
+
+		if (wire_decode(bad[i].frame, bad[i].len, &st) != -1 &&
+		    fails++ < MAX_FAILS)
+			printf("bad frame decoded: %s\n", bad[i].what);
+	}
+
+	for (i = 0; i < LEN(bad_keys); i++)
+		if (wire_decode_keys(bad_keys[i], bad_keys[i][0] + 1, keys,
+				     &n) != -1 && fails++ < MAX_FAILS)
+			printf("bad keys %zu decoded\n", i);
+
+	/* One key too many */
+	buf[0] = WIRE_KEYS_MAX + 1;
+	memset(buf + 1, 'a', WIRE_KEYS_MAX + 1);
+	if (wire_decode_keys(buf, WIRE_KEYS_MAX + 2, keys, &n) != -1 &&
+	    fails++ < MAX_FAILS)
+		printf("%d keys decoded\n", WIRE_KEYS_MAX + 1);
+}
+
+/* Keys there and back, and cut short anywhere */
+static void random_keys(void)
+{
+	int in[WIRE_KEYS_MAX], out[WIRE_KEYS_MAX];
+	uint8_t buf[WIRE_FRAME_MAX];
+	size_t i, n, got, len, cut;
+
+	for (i = 0; i < 100000; i++) {
+		n = rnd() % (WIRE_KEYS_MAX + 1);
+		for (got = 0; got < n; got++)
+			in[got] = rnd() % 2 ? rnd() % 0x200 :
+				(int) (rnd() & INT32_MAX);
+
+		len = wire_encode_keys(buf, in, n);
+		if (len > WIRE_FRAME_MAX ||
+		    wire_decode_keys(buf, len, out, &got) != (ssize_t) len ||
+		    got != n || memcmp(in, out, n * sizeof *in)) {
+			if (fails++ < MAX_FAILS)
+				printf("%zu keys didn't come back\n", n);
+			continue;
+		}
+
+		cut = rnd() % len;
+		if (wire_decode_keys(buf, cut, out, &got) != 0 &&
+		    fails++ < MAX_FAILS)
+			printf("%zu keys cut to %zu bytes decoded\n", n, cut);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	long games = argc > 1 ? atol(argv[1]) : 200, i;
+	struct blocks_host host;
+
+	clock_virtual_init(&virt, 0);
+	blocks_host_init(&host);
+	host.draw = NULL;
+	host.clock = &virt.clock;
+	phost = &host;
+
+	for (i = 0; i < games; i++)
+		bot_game();
+
+	if (!conn.long_frames && fails++ < MAX_FAILS)
+		printf("no frame took a 2 byte length\n");
+
+	lone_clears();
+	bad_frames();
+	random_keys();
+
+	printf("check_wire: %ld games, %lu frames (%.1f bytes each), "
+	       "%lu keyframes, %lu with 2 byte lengths, %u failures\n",
+	       games, conn.frames,
+	       conn.frames ? (double) conn.bytes / conn.frames : 0,
+	       conn.keys, conn.long_frames, fails);
+
+	blocks_host_destroy(&host);
+
+	return fails ? EXIT_FAILURE : 0;
+}